@@ -15,18 +15,9 @@ typedef enum {
   OP_POP,
   OP_GET_LOCAL,
   OP_SET_LOCAL,
-  OP_SET_GLOBAL,
-  OP_GET_GLOBAL,
-  OP_DEFINE_GLOBAL_INT,
-  OP_DEFINE_GLOBAL_FLOAT,
-  OP_DEFINE_GLOBAL_STRING,
-  OP_DEFINE_GLOBAL,
-  OP_GET_GLOBAL_INT,
-  OP_GET_GLOBAL_FLOAT,
-  OP_GET_GLOBAL_STRING,
-  OP_SET_GLOBAL_INT,
-  OP_SET_GLOBAL_FLOAT,
-  OP_SET_GLOBAL_STRING,
+  OP_GET_GLOBAL_SLOT,
+  OP_SET_GLOBAL_SLOT,
+  OP_DEFINE_GLOBAL_SLOT,
   OP_GET_UPVALUE,
   OP_SET_UPVALUE,
   OP_GET_PROPERTY,
@@ -35,6 +26,10 @@ typedef enum {
   OP_EQUAL,
   OP_GREATER,
   OP_LESS,
+  OP_GREATER_INT,
+  OP_LESS_INT,
+  OP_GREATER_FLOAT,
+  OP_LESS_FLOAT,
   OP_ADD,
   OP_SUBTRACT,
   OP_MULTIPLY,
@@ -48,6 +43,7 @@ typedef enum {
   OP_MULTIPLY_FLOAT,
   OP_DIVIDE_FLOAT,
   OP_NOT,
+  OP_NEGATE,
   OP_NEGATE_INT,
   OP_NEGATE_FLOAT,
   OP_PRINT,
@@ -55,6 +51,7 @@ typedef enum {
   OP_JUMP_IF_FALSE,
   OP_LOOP,
   OP_CALL,
+  OP_TAIL_CALL,
   OP_INVOKE,
   OP_SUPER_INVOKE,
   OP_CLOSURE,
@@ -68,14 +65,41 @@ typedef enum {
   OP_CHECK_FLOAT,
   OP_CHECK_STRING,
   OP_RUNTIME_ERROR,
+  // Superinstructions, only ever produced by optimizeChunk().
+  OP_INC_LOCAL_INT,
+  OP_LESS_JUMP_IF_FALSE,
+  OP_GREATER_JUMP_IF_FALSE,
+  OP_GET_LOCAL_GET_LOCAL,
+  OP_LESS_INT_JUMP_IF_FALSE,
+  OP_GREATER_INT_JUMP_IF_FALSE,
 } OpCode;
 
+#define INLINE_CACHE_WAYS 4
+#define CACHE_MEGAMORPHIC (INLINE_CACHE_WAYS + 1)
+
+// One receiver shape seen at a property or invoke site. For reads, index
+// is the field's slot, or -1 with target holding the method's closure.
+// For writes, target is the shape the store transitions to, if any.
+typedef struct {
+  Obj* shape;
+  Obj* target;
+  int index;
+} CacheEntry;
+
+typedef struct {
+  CacheEntry entries[INLINE_CACHE_WAYS];
+  int count;            //entries in use, or CACHE_MEGAMORPHIC once it gave up
+} InlineCache;
+
 typedef struct {        //chunk ds to hold bytecodes
   int count;            //no. of bytecode instructions currently in use
   int capacity;         //no. of elements in memory we allocated
   uint8_t* code;        //pointer to the array of bytecode instructions
   int* lines;           //array to store line numbers for debugging
   ValueArray constants; //array to store constants
+  int cacheCount;
+  int cacheCapacity;
+  InlineCache* caches;  //one per property/invoke instruction
   TokenType* type;
 } Chunk;
 
@@ -83,5 +107,7 @@ void initChunk(Chunk* chunk);                          //initialize a chunk
 void freeChunk(Chunk* chunk);                          //free a chunk
 void writeChunk(Chunk* chunk, uint8_t byte, int line); //add a chunk
 int addConstant(Chunk* chunk, Value value);            //add a const
+int addInlineCache(Chunk* chunk);                      //reserve a property cache
+int instructionLength(Chunk* chunk, int offset);       //bytes taken by the instruction at offset
 
 #endif
\ No newline at end of file
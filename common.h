@@ -10,10 +10,42 @@
 #define DEBUG_TRACE_EXECUTION
 #define DEBUG_STRESS_GC
 #define DEBUG_LOG_GC
+#define DEBUG_ASSERT_TYPES
+#define DEBUG_PRINT_CACHE_STATS
 #define UINT8_COUNT (UINT8_MAX + 1)
+
+// Threaded dispatch through a label table needs GCC/Clang's labels-as-values.
+// Build with -DNO_COMPUTED_GOTO to force the portable switch loop.
+#if (defined(__GNUC__) || defined(__clang__)) && !defined(NO_COMPUTED_GOTO)
+#define COMPUTED_GOTO
+#endif
+
+// The baseline JIT emits System V x86-64 code that works on NaN-boxed
+// values. Build with -DNO_JIT to leave it out.
+#if defined(__x86_64__) && defined(NAN_BOXING) && \
+    (defined(__linux__) || defined(__APPLE__)) && !defined(NO_JIT)
+#define BASELINE_JIT
+#endif
+
+// Hash tables match 16 control bytes at a time with SSE2 where the
+// compiler targets it. Build with -DNO_SIMD_TABLES to use the portable
+// loop.
+#if defined(__SSE2__) && !defined(NO_SIMD_TABLES)
+#define SIMD_TABLES
+#endif
+
+// Marking on a background thread needs pthreads and values a single
+// aligned load can read whole. Build with -DNO_CONCURRENT_GC to leave it
+// out.
+#if defined(NAN_BOXING) && (defined(__GNUC__) || defined(__clang__)) && \
+    (defined(__linux__) || defined(__APPLE__)) && !defined(NO_CONCURRENT_GC)
+#define CONCURRENT_GC
+#endif
 #endif
 #undef DEBUG_PRINT_CODE
 #undef DEBUG_TRACE_EXECUTION
 #undef DEBUG_STRESS_GC
 #undef DEBUG_LOG_GC
+#undef DEBUG_ASSERT_TYPES
+#undef DEBUG_PRINT_CACHE_STATS
 
@@ -6,6 +6,7 @@
 #include "common.h"
 #include "compiler.h"
 #include "memory.h"
+#include "optimize.h"
 #include "scanner.h"
 #include "vm.h"
 #ifdef DEBUG_PRINT_CODE
@@ -20,6 +21,10 @@ typedef struct {
   ValueType currentType;
 } Parser;
 
+// Static type of an expression the compiler could not prove anything about
+// (parameters, call results, properties). Operations on it stay checked.
+#define TYPE_UNKNOWN ((ValueType)-1)
+
 typedef enum {
   PREC_NONE,
   PREC_ASSIGNMENT,  // =
@@ -38,6 +43,7 @@ typedef void (*ParseFn)(bool canAssign);
 
 typedef struct {
     char* name;
+    int length;
     ValueType type;
 } Symbol;
 
@@ -54,7 +60,7 @@ typedef struct {
 } ParseRule;
 
 typedef struct {
-  TokenType type;
+  ValueType type;
   Token name;
   int depth;
   bool isCaptured;
@@ -69,6 +75,7 @@ typedef struct VM{
 typedef struct {
   uint8_t index;
   bool isLocal;
+  ValueType type;
 } Upvalue;
 
 typedef enum {
@@ -88,6 +95,7 @@ typedef struct Compiler {
   int localCount;
   Upvalue upvalues[UINT8_COUNT];
   int scopeDepth;
+  int lastCall;      // offset of the most recent OP_CALL, or -1
 } Compiler;
 
 typedef struct ClassCompiler {
@@ -98,7 +106,6 @@ typedef struct ClassCompiler {
 Parser parser;
 Compiler* current = NULL;
 ClassCompiler* currentClass = NULL;
-VM vm;
 SymbolTable symbolTable;
 
 static void errorAt(Token* token, const char* message) {
@@ -133,25 +140,50 @@ void initSymbolTable() {
     symbolTable.capacity = 0;
 }
 
-void addSymbol(const char* name, ValueType type, int scope, int line) {
+static Symbol* findSymbol(Token* name) {
+    for (int i = 0; i < symbolTable.count; i++) {
+        Symbol* symbol = &symbolTable.symbols[i];
+        if (symbol->length == name->length &&
+            memcmp(symbol->name, name->start, name->length) == 0) {
+            return symbol;
+        }
+    }
+    return NULL;
+}
+
+void addSymbol(Token* name, ValueType type) {
+    Symbol* existing = findSymbol(name);
+    if (existing != NULL) {
+        // Code compiled earlier already relies on the first declaration.
+        if (existing->type != type) {
+            error("Global already declared with a different type.");
+        }
+        return;
+    }
     if (symbolTable.count + 1 > symbolTable.capacity) {
         int oldCapacity = symbolTable.capacity;
         symbolTable.capacity = GROW_CAPACITY(oldCapacity);
         symbolTable.symbols = GROW_ARRAY(Symbol, symbolTable.symbols, oldCapacity, symbolTable.capacity);
     }
     Symbol* symbol = &symbolTable.symbols[symbolTable.count++];
-    symbol->name = strdup(name);
+    symbol->name = ALLOCATE(char, name->length + 1);
+    memcpy(symbol->name, name->start, name->length);
+    symbol->name[name->length] = '\0';
+    symbol->length = name->length;
     symbol->type = type;
 }
 
-ValueType getSymbolType(const char* name) {
-    for (int i = 0; i < symbolTable.count; i++) {
-        if (strcmp(symbolTable.symbols[i].name, name) == 0) {
-            return symbolTable.symbols[i].type;
-        }
+ValueType getSymbolType(Token* name) {
+    Symbol* symbol = findSymbol(name);
+    return symbol != NULL ? symbol->type : TYPE_UNKNOWN;
+}
+
+// Functions and classes can't take over a global declared with a type.
+static void checkUntypedGlobal(Token* name) {
+    if (current->scopeDepth > 0) return;
+    if (getSymbolType(name) != TYPE_UNKNOWN) {
+        error("Global already declared with a different type.");
     }
-    error("Invalid symbol type");
-    return -1;
 }
 
 static Chunk* currentChunk() {
@@ -214,11 +246,10 @@ static void emitLoop(int loopStart) {
 }
 
 static int emitJump(uint8_t instruction) {
-  int offset = currentChunk()->count - 2;
   emitByte(instruction);
   emitByte(0xff);
   emitByte(0xff);
-  return offset;
+  return currentChunk()->count - 2;
 }
 
 static void emitReturn() {
@@ -268,7 +299,7 @@ static uint8_t makeConstantString() {
 static void emitConstant(Value value) {
     //printf("Entered emitConstant\n");
     //printf("Value type: %d\n", value.type);
-    switch (value.type) {
+    switch (VALUE_TYPE(value)) {
         case VAL_INT:
             printf("Emitting integer constant\n");
             emitBytes(OP_CONSTANT_INT, makeConstantInt(value));
@@ -309,6 +340,7 @@ static void initCompiler(Compiler* compiler, FunctionType type) {
     compiler->type = type;
     compiler->localCount = 0;
     compiler->scopeDepth = 0;
+    compiler->lastCall = -1;
     compiler->function = newFunction();
     current = compiler;
     if (type != TYPE_SCRIPT) {
@@ -317,6 +349,7 @@ static void initCompiler(Compiler* compiler, FunctionType type) {
     Local* local = &current->locals[current->localCount++];
     local->depth = 0;
     local->isCaptured = false;
+    local->type = TYPE_UNKNOWN;
     if (type != TYPE_FUNCTION) {
         local->name.start = "this";
         local->name.length = 4;
@@ -331,6 +364,8 @@ static ObjFunction* endCompiler() {
     //printf("entered endCompiler\n");
     emitReturn();
     ObjFunction* function = current->function;
+    optimizeChunk(currentChunk());
+    function->maxStack = maxStackDepth(currentChunk(), function->arity);
     #ifdef DEBUG_PRINT_CODE
     if (!parser.hadError) {
     disassembleChunk(currentChunk(), function->name != NULL ? function->name->chars : "<script>");
@@ -369,6 +404,32 @@ static uint8_t identifierConstant(Token* name) {
   return makeConstant(OBJ_VAL(copyString(name->start, name->length)));
 }
 
+static uint16_t globalVariable(Token* name) {
+  int slot = globalSlot(copyString(name->start, name->length));
+  if (slot > UINT16_MAX) {
+    error("Too many global variables.");
+    return 0;
+  }
+  return (uint16_t)slot;
+}
+
+static void emitGlobal(uint8_t instruction, uint16_t slot) {
+  emitByte(instruction);
+  emitByte((slot >> 8) & 0xff);
+  emitByte(slot & 0xff);
+}
+
+// Property and invoke instructions carry the index of their own cache.
+static void emitInlineCache() {
+  int cache = addInlineCache(currentChunk());
+  if (cache > UINT16_MAX) {
+    error("Too many property accesses in one function.");
+    return;
+  }
+  emitByte((cache >> 8) & 0xff);
+  emitByte(cache & 0xff);
+}
+
 static bool identifiersEqual(Token* a, Token* b) {
   if (a->length != b->length) return false;
   return memcmp(a->start, b->start, a->length) == 0;
@@ -378,7 +439,7 @@ static bool isGlobal(Token* name) {
     //printf("Checking if '%.*s' is global\n", name->length, name->start);
     ObjString* globalName = copyString(name->start, name->length);
     Value value;
-    bool result = tableGet(&vm.globals, globalName, &value);
+    bool result = tableGet(&vm.globalSlots, globalName, &value);
     //printf("Global check result: %s\n", result ? "true" : "false");
     return result;
 }
@@ -400,7 +461,8 @@ static int resolveLocal(Compiler* compiler, Token* name) {
     return -1;
 }
 
-static int addUpvalue(Compiler* compiler, uint8_t index, bool isLocal) {
+static int addUpvalue(Compiler* compiler, uint8_t index, bool isLocal,
+                      ValueType type) {
   int upvalueCount = compiler->function->upvalueCount;
   for (int i = 0; i < upvalueCount; i++) {
     Upvalue* upvalue = &compiler->upvalues[i];
@@ -416,6 +478,7 @@ static int addUpvalue(Compiler* compiler, uint8_t index, bool isLocal) {
 
   compiler->upvalues[upvalueCount].isLocal = isLocal;
   compiler->upvalues[upvalueCount].index = index;
+  compiler->upvalues[upvalueCount].type = type;
   return compiler->function->upvalueCount++;
 }
 
@@ -425,12 +488,14 @@ static int resolveUpvalue(Compiler* compiler, Token* name) {
   int local = resolveLocal(compiler->enclosing, name);
   if (local != -1) {
     compiler->enclosing->locals[local].isCaptured = true;
-    return addUpvalue(compiler, (uint8_t)local, true);
+    return addUpvalue(compiler, (uint8_t)local, true,
+                      compiler->enclosing->locals[local].type);
   }
 
   int upvalue = resolveUpvalue(compiler->enclosing, name);
   if (upvalue != -1) {
-    return addUpvalue(compiler, (uint8_t)upvalue, false);
+    return addUpvalue(compiler, (uint8_t)upvalue, false,
+                      compiler->enclosing->upvalues[upvalue].type);
   }
   return -1;
 }
@@ -444,7 +509,7 @@ static void addLocal(Token name) {
     local->name = name;
     local->depth = -1;
     local->isCaptured = false;
-    local->type = parser.previous.type;
+    local->type = TYPE_UNKNOWN;
     //printf("Added local variable '%.*s' at index %d\n", name.length, name.start, current->localCount - 1);
 }
 
@@ -472,9 +537,56 @@ static const char* typeToString(ValueType type) {
     }
 }
 
-static uint8_t parseVariable(const char* errorMessage) {
+static ValueType declaredType(TokenType keyword) {
+    switch (keyword) {
+        case TOKEN_INT: return VAL_INT;
+        case TOKEN_FLOAT: return VAL_FLOAT;
+        case TOKEN_STRING: return VAL_OBJ;
+        default: return TYPE_UNKNOWN;
+    }
+}
+
+// Makes sure a value stored into a variable of a declared type really has
+// that type, so later reads can be trusted by the unchecked opcodes. Known
+// mismatches are compile errors; unknown values get a runtime check.
+static void emitTypeCheck(ValueType declared, ValueType actual) {
+    if (declared == TYPE_UNKNOWN) return;
+    if (actual == TYPE_UNKNOWN) {
+        switch (declared) {
+            case VAL_INT: emitByte(OP_CHECK_INT); break;
+            case VAL_FLOAT: emitByte(OP_CHECK_FLOAT); break;
+            case VAL_OBJ: emitByte(OP_CHECK_STRING); break;
+            default: break;
+        }
+        return;
+    }
+    if (actual != declared) {
+        error("Type mismatch in assignment.");
+    }
+}
+
+static void emitDefaultValue(ValueType type) {
+    switch (type) {
+        case VAL_INT:
+            emitBytes(OP_CONSTANT_INT, makeConstant(INT_VAL(0)));
+            break;
+        case VAL_FLOAT:
+            emitBytes(OP_CONSTANT_FLOAT, makeConstant(FLOAT_VAL(0)));
+            break;
+        case VAL_OBJ:
+            emitBytes(OP_CONSTANT_STRING, makeConstant(OBJ_VAL(copyString("", 0))));
+            break;
+        default:
+            emitByte(OP_NIL);
+            break;
+    }
+}
+
+static uint16_t parseVariable(const char* errorMessage) {
     consume(TOKEN_IDENTIFIER, errorMessage);
-    return identifierConstant(&parser.previous);
+    declareVariable();
+    if (current->scopeDepth > 0) return 0;
+    return globalVariable(&parser.previous);
 }
 
 static void markInitialized() {
@@ -484,22 +596,13 @@ static void markInitialized() {
            current->locals[current->localCount - 1].name.start, current->scopeDepth);
 }
 
-static void defineVariable(uint8_t global) {
-  TokenType type = parser.current.type;
+static void defineVariable(uint16_t global) {
   if (current->scopeDepth > 0) {
     markInitialized();
     return;
   }
   //printf("Defining variable with index: %d\n", global);
-  if(type == TOKEN_INT){
-    emitBytes(OP_DEFINE_GLOBAL, global);
-  } else if (type == TOKEN_FLOAT){
-    emitBytes(OP_DEFINE_GLOBAL, global);
-  } else if (type == TOKEN_STRING){
-    emitBytes(OP_DEFINE_GLOBAL, global);
-  } else {
-    emitBytes(OP_DEFINE_GLOBAL, global);
-  }
+  emitGlobal(OP_DEFINE_GLOBAL_SLOT, global);
 }
 
 static uint8_t argumentList() {
@@ -518,12 +621,14 @@ static uint8_t argumentList() {
 }
 
 static void and_(bool canAssign) {
+  ValueType leftType = parser.currentType;
   int endJump = emitJump(OP_JUMP_IF_FALSE);
 
   emitByte(OP_POP);
   parsePrecedence(PREC_AND);
 
   patchJump(endJump);
+  if (parser.currentType != leftType) parser.currentType = TYPE_UNKNOWN;
 }
 
 static void checkTypes(TokenType declaredType, TokenType expressionType) {
@@ -569,6 +674,15 @@ const char* valueTypeToString(ValueType type) {
     }
 }
     
+// Picks the unchecked opcode when both operand types are proven, and the
+// checked one that inspects the runtime types otherwise.
+static OpCode typedOp(ValueType left, ValueType right,
+                      OpCode checked, OpCode intOp, OpCode floatOp) {
+    if (left == VAL_INT && right == VAL_INT) return intOp;
+    if (left == VAL_FLOAT && right == VAL_FLOAT) return floatOp;
+    return checked;
+}
+
 static void binary(bool canAssign) {
     printf("Entering binary function. parser.currentType: %d\n", parser.currentType);
     TokenType operatorType = parser.previous.type;
@@ -576,80 +690,63 @@ static void binary(bool canAssign) {
     ValueType leftType = parser.currentType;
     parsePrecedence((Precedence)(rule->precedence + 1));
     ValueType rightType = parser.currentType;
-    if (leftType != rightType) {
+    bool proven = leftType != TYPE_UNKNOWN && rightType != TYPE_UNKNOWN;
+    if (proven && leftType != rightType) {
             error("Operands must be of compatible types.");
             return;
     }
     switch (operatorType) {
         case TOKEN_BANG_EQUAL:    emitBytes(OP_EQUAL, OP_NOT); break;
         case TOKEN_EQUAL_EQUAL:   emitByte(OP_EQUAL); break;
-        case TOKEN_GREATER:       emitByte(OP_GREATER); break;
-        case TOKEN_GREATER_EQUAL: emitBytes(OP_LESS, OP_NOT); break;
-        case TOKEN_LESS:          emitByte(OP_LESS); break;
-        case TOKEN_LESS_EQUAL:    emitBytes(OP_GREATER, OP_NOT); break;
+        case TOKEN_GREATER:
+            emitByte(typedOp(leftType, rightType, OP_GREATER, OP_GREATER_INT, OP_GREATER_FLOAT));
+            break;
+        case TOKEN_GREATER_EQUAL:
+            emitBytes(typedOp(leftType, rightType, OP_LESS, OP_LESS_INT, OP_LESS_FLOAT), OP_NOT);
+            break;
+        case TOKEN_LESS:
+            emitByte(typedOp(leftType, rightType, OP_LESS, OP_LESS_INT, OP_LESS_FLOAT));
+            break;
+        case TOKEN_LESS_EQUAL:
+            emitBytes(typedOp(leftType, rightType, OP_GREATER, OP_GREATER_INT, OP_GREATER_FLOAT), OP_NOT);
+            break;
         case TOKEN_PLUS:
-            printf("entered token-plus\n");
-            printf("left: %d , right: %d\n", leftType, rightType);
-            if (leftType == VAL_FLOAT && rightType == VAL_FLOAT) {
-                printf("float enter in tokens\n");
-                emitByte(OP_ADD_FLOAT);
-            } else if (leftType == VAL_INT && rightType == VAL_INT) {
-                printf("int enter in tokens\n");
-                emitByte(OP_ADD_INT);
-            } else if (leftType == VAL_OBJ && rightType == VAL_OBJ) {
-                printf("obj enter in tokens\n");
-                emitByte(OP_ADD);
-            } else {
-                printf("Type mismatch: Cannot add %s and %s.\n", 
+            if (proven && leftType != VAL_INT && leftType != VAL_FLOAT && leftType != VAL_OBJ) {
+                printf("Type mismatch: Cannot add %s and %s.\n",
                       valueTypeToString(leftType), valueTypeToString(rightType));
                 emitByte(OP_TYPE_ERROR);  // Emit a type error opcode
                 return;  // Stop compilation of this expression
             }
-            break;
+            emitByte(typedOp(leftType, rightType, OP_ADD, OP_ADD_INT, OP_ADD_FLOAT));
+            parser.currentType = proven ? leftType : TYPE_UNKNOWN;
+            return;
         case TOKEN_MINUS:
-            printf("entered token-minus\n");
-            if (leftType == VAL_FLOAT && rightType == VAL_FLOAT) {
-                emitByte(OP_SUBTRACT_FLOAT);
-            } else if (leftType == VAL_INT && rightType == VAL_INT) {
-                emitByte(OP_SUBTRACT_INT);
-            } else {
-              printf("Both the variables are not the same type.\n");
-              exit(1);
-            }
-            break;
-          case TOKEN_STAR:
-            printf("entered token-star\n");
-            printf("leftType: %d, rightType: %d\n", leftType, rightType);
-            if (leftType == VAL_FLOAT && rightType == VAL_FLOAT) {
-                printf("star-float\n");
-                emitByte(OP_MULTIPLY_FLOAT);
-            } else if (leftType == VAL_INT && rightType == VAL_INT) {
-                printf("star-int\n");
-                emitByte(OP_MULTIPLY_INT);
-            } else {
-              printf("Both the variables are not the same type.\n");
-              exit(1);
-            }
-            break;
-          case TOKEN_SLASH:
-            printf("entered token-slash\n");
-            if (leftType == VAL_FLOAT && rightType == VAL_FLOAT) {
-                emitByte(OP_DIVIDE_FLOAT);
-            } else if (leftType == VAL_INT && rightType == VAL_INT) {
-                emitByte(OP_DIVIDE_INT);
-            } else {
-              printf("Both the variables are not the same type.\n");
-              exit(1);
+        case TOKEN_STAR:
+        case TOKEN_SLASH: {
+            if (proven && leftType != VAL_INT && leftType != VAL_FLOAT) {
+                error("Operands must be two integers or two floats.");
+                return;
             }
-            break;
+            OpCode checked = operatorType == TOKEN_MINUS ? OP_SUBTRACT
+                           : operatorType == TOKEN_STAR ? OP_MULTIPLY : OP_DIVIDE;
+            OpCode intOp = operatorType == TOKEN_MINUS ? OP_SUBTRACT_INT
+                         : operatorType == TOKEN_STAR ? OP_MULTIPLY_INT : OP_DIVIDE_INT;
+            OpCode floatOp = operatorType == TOKEN_MINUS ? OP_SUBTRACT_FLOAT
+                           : operatorType == TOKEN_STAR ? OP_MULTIPLY_FLOAT : OP_DIVIDE_FLOAT;
+            emitByte(typedOp(leftType, rightType, checked, intOp, floatOp));
+            parser.currentType = proven ? leftType : TYPE_UNKNOWN;
+            return;
+        }
         default: return; 
     }
-    parser.currentType = leftType;
+    parser.currentType = VAL_BOOL;
 }
 
 static void call(bool canAssign) {
   uint8_t argCount = argumentList();
   emitBytes(OP_CALL, argCount);
+  current->lastCall = currentChunk()->count - 2;
+  parser.currentType = TYPE_UNKNOWN;
 }
 
 static void dot(bool canAssign) {
@@ -658,20 +755,24 @@ static void dot(bool canAssign) {
   if (canAssign && match(TOKEN_EQUAL)) {
     expression();
     emitBytes(OP_SET_PROPERTY, name);
+    emitInlineCache();
   } else if (match(TOKEN_LEFT_PAREN)) {
     uint8_t argCount = argumentList();
     emitBytes(OP_INVOKE, name);
     emitByte(argCount);
+    emitInlineCache();
   } else {
     emitBytes(OP_GET_PROPERTY, name);
+    emitInlineCache();
   }
+  parser.currentType = TYPE_UNKNOWN;
 }
 
 static void literal(bool canAssign) {
   switch (parser.previous.type) {
-    case TOKEN_FALSE: emitByte(OP_FALSE); break;
-    case TOKEN_NIL: emitByte(OP_NIL); break;
-    case TOKEN_TRUE: emitByte(OP_TRUE); break;
+    case TOKEN_FALSE: emitByte(OP_FALSE); parser.currentType = VAL_BOOL; break;
+    case TOKEN_NIL: emitByte(OP_NIL); parser.currentType = VAL_NIL; break;
+    case TOKEN_TRUE: emitByte(OP_TRUE); parser.currentType = VAL_BOOL; break;
     default: return;
   }
 }
@@ -707,8 +808,9 @@ static ValueType getVariableType(Token* name) {
         }
     }
     ObjString* nameString = copyString(name->start, name->length);
-    Value value;
-    if (tableGet(&vm.globals, nameString, &value)) {
+    Value slot;
+    if (tableGet(&vm.globalSlots, nameString, &slot)) {
+        Value value = vm.globalValues.values[AS_INT(slot)];
         if (IS_INT(value)) return VAL_INT;
         if (IS_FLOAT(value)) return VAL_FLOAT;
         if (IS_STRING(value)) return VAL_OBJ;
@@ -722,12 +824,14 @@ static ValueType getVariableType(Token* name) {
 }
 
 static void or_(bool canAssign) {
+  ValueType leftType = parser.currentType;
   int elseJump = emitJump(OP_JUMP_IF_FALSE);
   int endJump = emitJump(OP_JUMP);
   patchJump(elseJump);
   emitByte(OP_POP);
   parsePrecedence(PREC_OR);
   patchJump(endJump);
+  if (parser.currentType != leftType) parser.currentType = TYPE_UNKNOWN;
 }
 
 static void string(bool canAssign) {
@@ -793,41 +897,37 @@ static void string(bool canAssign) {
 
 static void namedVariable(Token name, bool canAssign) {
   uint8_t getOp, setOp;
+  ValueType varType;
   int arg = resolveLocal(current, &name);
-  TokenType type = name.type;
   if (arg != -1) {
     getOp = OP_GET_LOCAL;
     setOp = OP_SET_LOCAL;
+    varType = current->locals[arg].type;
   } else if ((arg = resolveUpvalue(current, &name)) != -1) {
     getOp = OP_GET_UPVALUE;
     setOp = OP_SET_UPVALUE;
+    varType = current->upvalues[arg].type;
   } else {
-    arg = identifierConstant(&name);
-    switch (type) {
-      case VAL_INT:
-        getOp = OP_GET_GLOBAL_INT;
-        setOp = OP_SET_GLOBAL_INT;
-        break;
-      case VAL_FLOAT:
-        getOp = OP_GET_GLOBAL_FLOAT;
-        setOp = OP_SET_GLOBAL_FLOAT;
-        break;
-      case VAL_OBJ:
-        getOp = OP_GET_GLOBAL_STRING;
-        setOp = OP_SET_GLOBAL_STRING;
-        break;
-      default:
-        getOp = OP_GET_GLOBAL;
-        setOp = OP_SET_GLOBAL;
-        break;
-    }
+    arg = globalVariable(&name);
+    getOp = OP_GET_GLOBAL_SLOT;
+    setOp = OP_SET_GLOBAL_SLOT;
+    varType = getSymbolType(&name);
   }
   if (canAssign && match(TOKEN_EQUAL)) {
     expression();
-    emitBytes(setOp, (uint8_t)arg);
+    emitTypeCheck(varType, parser.currentType);
+    if (setOp == OP_SET_GLOBAL_SLOT) {
+      emitGlobal(setOp, (uint16_t)arg);
+    } else {
+      emitBytes(setOp, (uint8_t)arg);
+    }
+    if (varType == TYPE_UNKNOWN) return;
+  } else if (getOp == OP_GET_GLOBAL_SLOT) {
+    emitGlobal(getOp, (uint16_t)arg);
   } else {
     emitBytes(getOp, (uint8_t)arg);
   }
+  parser.currentType = varType;
 }
 
 static void variable(bool canAssign) {
@@ -860,6 +960,7 @@ static void super_(bool canAssign) {
     namedVariable(syntheticToken("super"), false);
     emitBytes(OP_GET_SUPER, name);
   }
+  parser.currentType = TYPE_UNKNOWN;
 }
 
 static void this_(bool canAssign) {
@@ -874,9 +975,20 @@ static void unary(bool canAssign) {
   TokenType operatorType = parser.previous.type;
   parsePrecedence(PREC_UNARY);
   switch (operatorType) {
-    case TOKEN_BANG: emitByte(OP_NOT); break;
+    case TOKEN_BANG:
+        emitByte(OP_NOT);
+        parser.currentType = VAL_BOOL;
+        break;
     case TOKEN_MINUS: 
-        emitByte(OP_NEGATE_INT); break;
+        if (parser.currentType == VAL_INT) {
+          emitByte(OP_NEGATE_INT);
+        } else if (parser.currentType == VAL_FLOAT) {
+          emitByte(OP_NEGATE_FLOAT);
+        } else {
+          emitByte(OP_NEGATE);
+          parser.currentType = TYPE_UNKNOWN;
+        }
+        break;
       }
 }
 
@@ -980,7 +1092,7 @@ static void function(FunctionType type) {
       if (current->function->arity > 255) {
         errorAtCurrent("Can't have more than 255 parameters.");
       }
-      uint8_t constant = parseVariable("Expect parameter name.");
+      uint16_t constant = parseVariable("Expect parameter name.");
       defineVariable(constant);
     } while (match(TOKEN_COMMA));
   }
@@ -1013,10 +1125,11 @@ static void method() {
 static void classDeclaration() {
   consume(TOKEN_IDENTIFIER, "Expect class name.");
   Token className = parser.previous;
+  checkUntypedGlobal(&className);
   uint8_t nameConstant = identifierConstant(&parser.previous);
   declareVariable();
   emitBytes(OP_CLASS, nameConstant);
-  defineVariable(nameConstant);
+  defineVariable(current->scopeDepth > 0 ? 0 : globalVariable(&className));
   ClassCompiler classCompiler;
   classCompiler.hasSuperclass = false;
   classCompiler.enclosing = currentClass;
@@ -1051,7 +1164,8 @@ static void classDeclaration() {
 }
 
 static void funDeclaration() {
-  uint8_t global = parseVariable("Expect function name.");
+  uint16_t global = parseVariable("Expect function name.");
+  checkUntypedGlobal(&parser.previous);
   markInitialized();
   function(TYPE_FUNCTION);
   defineVariable(global);
@@ -1068,26 +1182,31 @@ static void varDeclaration() {
   //printf("Entering varDeclaration\n");
   printf("Current token: %d, lexeme: %.*s\n", parser.current.type, parser.current.length, parser.current.start);
   TokenType type = parser.previous.type;
+  ValueType varType = declaredType(type);
   if (!check(TOKEN_IDENTIFIER)) {
     error("Expect variable name.");
     return;
   }
-  uint8_t global = parseVariable("Expect variable name");
+  uint16_t global = parseVariable("Expect variable name");
+  Token name = parser.previous;
+  if (current->scopeDepth > 0) {
+    current->locals[current->localCount - 1].type = varType;
+  }
   //advance();
   if (match(TOKEN_EQUAL)) {
     //printf("Found '=', parsing expression\n");
     expression();
-    //checkTypes(type, parser.previous.type);
+    emitTypeCheck(varType, parser.currentType);
   } else {
-    emitByte(OP_NIL);
+    emitDefaultValue(varType);
   }
   //printf("About to consume semicolon\n");
   consume(TOKEN_SEMICOLON, "Expect ';' after variable declaration.");
   //printf("Semicolon consumed\n");
   defineVariable(global);
-  addSymbol(parser.previous.start , parser.currentType, current->scopeDepth , parser.previous.line);
-  if (type != TOKEN_ERROR) {
-    //storeVariableType(global, type);
+  if (current->scopeDepth == 0) {
+    addSymbol(&name, varType);
+    if (varType != TYPE_UNKNOWN) setGlobalType(global, varType);
   }
   printf("Exiting varDeclaration\n");
 }
@@ -1171,6 +1290,11 @@ static void returnStatement() {
     }
     expression();
     consume(TOKEN_SEMICOLON, "Expect ';' after return value.");
+    // A call that is the last thing the return value does is in tail
+    // position. Any jump that skips it lands on the OP_RETURN below.
+    if (current->lastCall == currentChunk()->count - 2) {
+      currentChunk()->code[current->lastCall] = OP_TAIL_CALL;
+    }
     emitByte(OP_RETURN);
   }
 }
@@ -1284,6 +1408,7 @@ ObjFunction* compile(const char* source) {
   initCompiler(&compiler, TYPE_SCRIPT);
   parser.hadError = false;
   parser.panicMode = false;
+  parser.currentType = TYPE_UNKNOWN;
   advance();
   while (!match(TOKEN_EOF)) {
     printf("Entering declaration...\n");
@@ -1,7 +1,11 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
 #include "debug.h"
+#include "jit.h"
 #include "object.h"
 #include "value.h"
+#include "vm.h"
 
 void disassembleChunk(Chunk* chunk, const char* name) {
   printf("== %s ==\n", name);
@@ -28,6 +32,28 @@ static int invokeInstruction(const char* name, Chunk* chunk, int offset) {
   return offset + 3;
 }
 
+static int propertyInstruction(const char* name, Chunk* chunk, int offset) {
+  uint8_t constant = chunk->code[offset + 1];
+  uint16_t cache = (uint16_t)((chunk->code[offset + 2] << 8) |
+                              chunk->code[offset + 3]);
+  printf("%-16s %4d '", name, constant);
+  printValue(chunk->constants.values[constant]);
+  printf("' ic %d\n", cache);
+  return offset + 4;
+}
+
+static int cachedInvokeInstruction(const char* name, Chunk* chunk,
+                                   int offset) {
+  uint8_t constant = chunk->code[offset + 1];
+  uint8_t argCount = chunk->code[offset + 2];
+  uint16_t cache = (uint16_t)((chunk->code[offset + 3] << 8) |
+                              chunk->code[offset + 4]);
+  printf("%-16s (%d args) %4d '", name, argCount, constant);
+  printValue(chunk->constants.values[constant]);
+  printf("' ic %d\n", cache);
+  return offset + 5;
+}
+
 static int simpleInstruction(const char* name, int offset) {
   printf("%s\n", name);
   return offset + 1;
@@ -39,6 +65,30 @@ static int byteInstruction(const char* name, Chunk* chunk, int offset) {
   return offset + 2;
 }
 
+static int twoByteInstruction(const char* name, Chunk* chunk, int offset) {
+  uint8_t first = chunk->code[offset + 1];
+  uint8_t second = chunk->code[offset + 2];
+  printf("%-16s %4d %4d\n", name, first, second);
+  return offset + 3;
+}
+
+static int incrementInstruction(const char* name, Chunk* chunk, int offset) {
+  uint8_t slot = chunk->code[offset + 1];
+  uint8_t constant = chunk->code[offset + 2];
+  printf("%-16s %4d += %d '", name, slot, constant);
+  printValue(chunk->constants.values[constant]);
+  printf("'\n");
+  return offset + 3;
+}
+
+static int globalInstruction(const char* name, Chunk* chunk, int offset) {
+  uint16_t slot = (uint16_t)((chunk->code[offset + 1] << 8) |
+                             chunk->code[offset + 2]);
+  ObjString* global = globalSlotName(slot);
+  printf("%-16s %4d '%s'\n", name, slot, global == NULL ? "?" : global->chars);
+  return offset + 3;
+}
+
 static int jumpInstruction(const char* name, int sign, Chunk* chunk, int offset) {
   uint16_t jump = (uint16_t)(chunk->code[offset + 1] << 8);
   jump |= chunk->code[offset + 2];
@@ -75,32 +125,20 @@ int disassembleInstruction(Chunk* chunk, int offset) {
       return byteInstruction("OP_GET_LOCAL", chunk, offset);
     case OP_SET_LOCAL:
       return byteInstruction("OP_SET_LOCAL", chunk, offset);
-    case OP_GET_GLOBAL_INT:
-      return constantInstruction("OP_GET_GLOBAL_INT", chunk, offset);
-    case OP_GET_GLOBAL_FLOAT:
-      return constantInstruction("OP_GET_GLOBAL_FLOAT", chunk, offset);
-    case OP_GET_GLOBAL_STRING:
-      return constantInstruction("OP_GET_GLOBAL_STRING", chunk, offset);
-    case OP_DEFINE_GLOBAL_INT:
-      return constantInstruction("OP_DEFINE_GLOBAL_INT", chunk, offset);
-    case OP_DEFINE_GLOBAL_FLOAT:
-      return constantInstruction("OP_DEFINE_GLOBAL_FLOAT", chunk, offset);
-    case OP_DEFINE_GLOBAL_STRING:
-      return constantInstruction("OP_DEFINE_GLOBAL_STRING", chunk, offset);
-    case OP_SET_GLOBAL_INT:
-      return constantInstruction("OP_SET_GLOBAL_INT", chunk, offset);
-    case OP_SET_GLOBAL_FLOAT:
-      return constantInstruction("OP_SET_GLOBAL_FLOAT", chunk, offset);
-    case OP_SET_GLOBAL_STRING:
-      return constantInstruction("OP_SET_GLOBAL_STRING", chunk, offset);
+    case OP_GET_GLOBAL_SLOT:
+      return globalInstruction("OP_GET_GLOBAL_SLOT", chunk, offset);
+    case OP_SET_GLOBAL_SLOT:
+      return globalInstruction("OP_SET_GLOBAL_SLOT", chunk, offset);
+    case OP_DEFINE_GLOBAL_SLOT:
+      return globalInstruction("OP_DEFINE_GLOBAL_SLOT", chunk, offset);
     case OP_GET_UPVALUE:
       return byteInstruction("OP_GET_UPVALUE", chunk, offset);
     case OP_SET_UPVALUE:
       return byteInstruction("OP_SET_UPVALUE", chunk, offset);
     case OP_GET_PROPERTY:
-      return constantInstruction("OP_GET_PROPERTY", chunk, offset);
+      return propertyInstruction("OP_GET_PROPERTY", chunk, offset);
     case OP_SET_PROPERTY:
-      return constantInstruction("OP_SET_PROPERTY", chunk, offset);
+      return propertyInstruction("OP_SET_PROPERTY", chunk, offset);
     case OP_GET_SUPER:
       return constantInstruction("OP_GET_SUPER", chunk, offset);
     case OP_EQUAL:
@@ -109,30 +147,46 @@ int disassembleInstruction(Chunk* chunk, int offset) {
       return simpleInstruction("OP_GREATER", offset);
     case OP_LESS:
       return simpleInstruction("OP_LESS", offset);
+    case OP_GREATER_INT:
+      return simpleInstruction("OP_GREATER_INT", offset);
+    case OP_LESS_INT:
+      return simpleInstruction("OP_LESS_INT", offset);
+    case OP_GREATER_FLOAT:
+      return simpleInstruction("OP_GREATER_FLOAT", offset);
+    case OP_LESS_FLOAT:
+      return simpleInstruction("OP_LESS_FLOAT", offset);
     case OP_ADD:
       return simpleInstruction("OP_ADD", offset);
+    case OP_SUBTRACT:
+      return simpleInstruction("OP_SUBTRACT", offset);
+    case OP_MULTIPLY:
+      return simpleInstruction("OP_MULTIPLY", offset);
+    case OP_DIVIDE:
+      return simpleInstruction("OP_DIVIDE", offset);
     case OP_ADD_INT:
       return simpleInstruction("OP_ADD_INT", offset);
     case OP_SUBTRACT_INT:
-      return simpleInstruction("OP_SUBTRACT", offset);
+      return simpleInstruction("OP_SUBTRACT_INT", offset);
     case OP_MULTIPLY_INT:
-      return simpleInstruction("OP_MULTIPLY", offset);
+      return simpleInstruction("OP_MULTIPLY_INT", offset);
     case OP_DIVIDE_INT:
-      return simpleInstruction("OP_DIVIDE", offset);
+      return simpleInstruction("OP_DIVIDE_INT", offset);
     case OP_NOT:
       return simpleInstruction("OP_NOT", offset);
-    case OP_NEGATE_INT:
+    case OP_NEGATE:
       return simpleInstruction("OP_NEGATE", offset);
+    case OP_NEGATE_INT:
+      return simpleInstruction("OP_NEGATE_INT", offset);
     case OP_ADD_FLOAT:
-      return simpleInstruction("OP_ADD_INT", offset);
+      return simpleInstruction("OP_ADD_FLOAT", offset);
     case OP_SUBTRACT_FLOAT:
-      return simpleInstruction("OP_SUBTRACT", offset);
+      return simpleInstruction("OP_SUBTRACT_FLOAT", offset);
     case OP_MULTIPLY_FLOAT:
-      return simpleInstruction("OP_MULTIPLY", offset);
+      return simpleInstruction("OP_MULTIPLY_FLOAT", offset);
     case OP_DIVIDE_FLOAT:
-      return simpleInstruction("OP_DIVIDE", offset);
+      return simpleInstruction("OP_DIVIDE_FLOAT", offset);
     case OP_NEGATE_FLOAT:
-      return simpleInstruction("OP_NEGATE", offset);
+      return simpleInstruction("OP_NEGATE_FLOAT", offset);
     case OP_PRINT:
       return simpleInstruction("OP_PRINT", offset);
     case OP_JUMP:
@@ -143,8 +197,10 @@ int disassembleInstruction(Chunk* chunk, int offset) {
       return jumpInstruction("OP_LOOP", -1, chunk, offset);
     case OP_CALL:
       return byteInstruction("OP_CALL", chunk, offset);
+    case OP_TAIL_CALL:
+      return byteInstruction("OP_TAIL_CALL", chunk, offset);
     case OP_INVOKE:
-      return invokeInstruction("OP_INVOKE", chunk, offset);
+      return cachedInvokeInstruction("OP_INVOKE", chunk, offset);
     case OP_SUPER_INVOKE:
       return invokeInstruction("OP_SUPER_INVOKE", chunk, offset);
     case OP_CLOSURE: {
@@ -181,8 +237,143 @@ int disassembleInstruction(Chunk* chunk, int offset) {
       return simpleInstruction("OP_CHECK_STRING", offset);
     case OP_RUNTIME_ERROR:
       return simpleInstruction("OP_RUNTIME_ERROR", offset);
+    case OP_INC_LOCAL_INT:
+      return incrementInstruction("OP_INC_LOCAL_INT", chunk, offset);
+    case OP_LESS_JUMP_IF_FALSE:
+      return jumpInstruction("OP_LESS_JUMP_IF_FALSE", 1, chunk, offset);
+    case OP_GREATER_JUMP_IF_FALSE:
+      return jumpInstruction("OP_GREATER_JUMP_IF_FALSE", 1, chunk, offset);
+    case OP_GET_LOCAL_GET_LOCAL:
+      return twoByteInstruction("OP_GET_LOCAL_GET_LOCAL", chunk, offset);
+    case OP_LESS_INT_JUMP_IF_FALSE:
+      return jumpInstruction("OP_LESS_INT_JUMP_IF_FALSE", 1, chunk, offset);
+    case OP_GREATER_INT_JUMP_IF_FALSE:
+      return jumpInstruction("OP_GREATER_INT_JUMP_IF_FALSE", 1, chunk, offset);
     default:
       printf("Unknown opcode %d\n", instruction);
       return offset + 1;
   }
 }
+
+static const char* traceTypeName(int8_t type) {
+  switch (type) {
+    case VAL_BOOL: return "bool";
+    case VAL_NIL: return "nil";
+    case VAL_INT: return "int";
+    case VAL_FLOAT: return "float";
+    case VAL_OBJ: return "obj";
+    case TYPE_STRING: return "string";
+    default: return "?";
+  }
+}
+
+// One recorded iteration, each instruction with the types it found in
+// peek(1) and peek(0).
+void disassembleTrace(Chunk* chunk, Trace* trace, const char* name) {
+  printf("== trace %s @%04d: %d steps, %d guards (%d removed) ==\n", name,
+         trace->header, trace->stepCount, trace->guards,
+         trace->guardsRemoved);
+  for (int i = 0; i < trace->stepCount; i++) {
+    TraceStep* step = &trace->steps[i];
+    printf("%-6s %-6s ", traceTypeName(step->types[1]),
+           traceTypeName(step->types[0]));
+    disassembleInstruction(chunk, step->offset);
+  }
+}
+
+// FNV-1a, the hash strings used before, for comparison.
+static uint32_t fnvHash(const char* key, int length) {
+  uint32_t hash = 2166136261u;
+  for (int i = 0; i < length; i++) {
+    hash ^= (uint8_t)key[i];
+    hash *= 16777619;
+  }
+  return hash;
+}
+
+typedef uint32_t (*HashFn)(const char* key, int length);
+
+static double hashRate(HashFn hash, const char* buffer, int length) {
+  const size_t total = 64 * 1024 * 1024;
+  size_t rounds = total / length;
+  volatile uint32_t sink = 0;
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (size_t i = 0; i < rounds; i++) {
+    sink ^= hash(buffer + (i & 15), length);
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  double seconds = (end.tv_sec - start.tv_sec) +
+                   (end.tv_nsec - start.tv_nsec) / 1e9;
+  (void)sink;
+  return rounds * (double)length / seconds / (1024 * 1024);
+}
+
+#define PROBE_BUCKETS 7
+
+static int probeBucket(int distance) {
+  if (distance < 4) return distance;
+  if (distance < 8) return 4;
+  if (distance < 16) return 5;
+  return 6;
+}
+
+// Inserts every interned string into an empty, linearly probed table of
+// vm.strings' size under the given hash, counting how far each lands
+// from its home slot.
+static size_t probeLengths(HashFn hash, size_t buckets[PROBE_BUCKETS],
+                           double* mean, int* max) {
+  int capacity = vm.strings.capacity;
+  bool* used = calloc(capacity, sizeof(bool));
+  size_t count = 0, total = 0;
+  *max = 0;
+  // Mid-resize, some strings are still in the old arrays.
+  for (int i = 0; i < capacity + vm.strings.oldCapacity; i++) {
+    ObjString* key = i < capacity ? vm.strings.keys[i]
+                                  : vm.strings.oldKeys[i - capacity];
+    if (key == NULL) continue;
+    uint32_t index = hash(key->chars, key->length) & (capacity - 1);
+    int distance = 0;
+    while (used[index]) {
+      index = (index + 1) & (capacity - 1);
+      distance++;
+    }
+    used[index] = true;
+    buckets[probeBucket(distance)]++;
+    total += distance;
+    count++;
+    if (distance > *max) *max = distance;
+  }
+  *mean = count == 0 ? 0 : (double)total / count;
+  free(used);
+  return count;
+}
+
+void printStringStats() {
+  static const int lengths[] = {4, 16, 64, 1024};
+  char buffer[1024 + 16];
+  for (size_t i = 0; i < sizeof(buffer); i++) buffer[i] = (char)rand();
+  printf("string hash MB/s   fnv-1a   current\n");
+  for (int i = 0; i < 4; i++) {
+    printf("  %4d bytes     %8.0f  %8.0f\n", lengths[i],
+           hashRate(fnvHash, buffer, lengths[i]),
+           hashRate(hashString, buffer, lengths[i]));
+  }
+
+  static const char* labels[PROBE_BUCKETS] = {
+    "0", "1", "2", "3", "4-7", "8-15", "16+"
+  };
+  size_t fnv[PROBE_BUCKETS] = {0}, current[PROBE_BUCKETS] = {0};
+  double fnvMean, currentMean;
+  int fnvMax, currentMax;
+  probeLengths(fnvHash, fnv, &fnvMean, &fnvMax);
+  size_t count = probeLengths(hashString, current, &currentMean, &currentMax);
+  printf("vm.strings: %zu strings in %d slots\n", count,
+         vm.strings.capacity);
+  printf("  probe length   fnv-1a   current\n");
+  for (int i = 0; i < PROBE_BUCKETS; i++) {
+    printf("  %-12s %8zu  %8zu\n", labels[i], fnv[i], current[i]);
+  }
+  printf("  mean         %8.2f  %8.2f\n", fnvMean, currentMean);
+  printf("  max          %8d  %8d\n", fnvMax, currentMax);
+}
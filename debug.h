@@ -2,8 +2,11 @@
 #define clox_debug_h
 
 #include "chunk.h"
+#include "object.h"
 
 void disassembleChunk(Chunk* chunk, const char* name);
 int disassembleInstruction(Chunk* chunk, int offset);
+void disassembleTrace(Chunk* chunk, Trace* trace, const char* name);
+void printStringStats();
 
 #endif
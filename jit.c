@@ -0,0 +1,1410 @@
+#include <limits.h>
+#include <stddef.h>
+#include <string.h>
+#include "common.h"
+#include "debug.h"
+#include "jit.h"
+#include "memory.h"
+#include "vm.h"
+
+#ifdef BASELINE_JIT
+#include <sys/mman.h>
+
+// A template JIT: each bytecode instruction becomes a fixed run of x86-64
+// that works on the same vm.stack and CallFrames as the interpreter, so
+// either one can pick up a frame where the other left off. rbx holds the
+// frame's slots and r12 the stack top; the top goes back to vm.stackTop
+// around every call into C and both are reloaded after. Instructions the
+// templates don't cover, and guards that fail, store ip and hand the
+// frame to run(), which executes the instruction itself.
+
+typedef enum {
+  RAX = 0, RCX = 1, RDX = 2, RBX = 3, RSP = 4, RBP = 5, RSI = 6, RDI = 7,
+  R12 = 12
+} Register;
+
+#define SLOTS RBX
+#define TOP   R12
+
+typedef enum {
+  CC_E = 0x4, CC_NE = 0x5, CC_BE = 0x6, CC_A = 0x7, CC_NP = 0xb,
+  CC_L = 0xc, CC_GE = 0xd, CC_LE = 0xe, CC_G = 0xf
+} Condition;
+
+typedef enum {
+  ALU_ADD = 0x01, ALU_OR = 0x09, ALU_AND = 0x21, ALU_SUB = 0x29,
+  ALU_CMP = 0x39
+} AluOp;
+
+typedef struct {
+  int at;       // position of the rel32 to fill in
+  int target;   // bytecode offset it has to reach
+} Patch;
+
+typedef struct {
+  Chunk* chunk;
+  uint8_t* code;
+  int count;
+  int capacity;
+  int* entries;
+  Patch* jumps;
+  int jumpCount;
+  int jumpCapacity;
+  Patch* exits;
+  int exitCount;
+  int exitCapacity;
+  int exitCommon;
+  int epilogue;
+} Assembler;
+
+typedef JitStatus (*JitFunction)(uint8_t* entry);
+
+static void emitByte(Assembler* as, uint8_t byte) {
+  if (as->count == as->capacity) {
+    int oldCapacity = as->capacity;
+    as->capacity = GROW_CAPACITY(oldCapacity);
+    as->code = GROW_ARRAY(uint8_t, as->code, oldCapacity, as->capacity);
+  }
+  as->code[as->count++] = byte;
+}
+
+static void emit32(Assembler* as, uint32_t value) {
+  for (int i = 0; i < 4; i++) emitByte(as, (value >> (8 * i)) & 0xff);
+}
+
+static void emit64(Assembler* as, uint64_t value) {
+  emit32(as, (uint32_t)value);
+  emit32(as, (uint32_t)(value >> 32));
+}
+
+static void addPatch(Patch** patches, int* count, int* capacity,
+                     int at, int target) {
+  if (*count == *capacity) {
+    int oldCapacity = *capacity;
+    *capacity = GROW_CAPACITY(oldCapacity);
+    *patches = GROW_ARRAY(Patch, *patches, oldCapacity, *capacity);
+  }
+  (*patches)[*count].at = at;
+  (*patches)[*count].target = target;
+  (*count)++;
+}
+
+static void patchRel32(Assembler* as, int at, int target) {
+  int32_t rel = target - (at + 4);
+  memcpy(as->code + at, &rel, sizeof(rel));
+}
+
+static void patchHere(Assembler* as, int at) {
+  patchRel32(as, at, as->count);
+}
+
+// Encoding. Only rax-rdi, r12 and xmm0-1 are ever used.
+
+static void rex(Assembler* as, bool wide, int reg, int base) {
+  uint8_t byte = 0x40 | (wide << 3) | ((reg & 8) >> 1) | ((base & 8) >> 3);
+  if (byte != 0x40) emitByte(as, byte);
+}
+
+static void regOperand(Assembler* as, int reg, int rm) {
+  emitByte(as, 0xc0 | (reg & 7) << 3 | (rm & 7));
+}
+
+static void memOperand(Assembler* as, int reg, int base, int32_t disp) {
+  int mod = 2;
+  if (disp == 0 && (base & 7) != RBP) {
+    mod = 0;
+  } else if (disp >= -128 && disp <= 127) {
+    mod = 1;
+  }
+  emitByte(as, mod << 6 | (reg & 7) << 3 | (base & 7));
+  if ((base & 7) == RSP) emitByte(as, 0x24);
+  if (mod == 1) emitByte(as, (uint8_t)disp);
+  if (mod == 2) emit32(as, (uint32_t)disp);
+}
+
+static void load(Assembler* as, Register dst, Register base, int32_t disp) {
+  rex(as, true, dst, base);
+  emitByte(as, 0x8b);
+  memOperand(as, dst, base, disp);
+}
+
+static void load32(Assembler* as, Register dst, Register base, int32_t disp) {
+  rex(as, false, dst, base);
+  emitByte(as, 0x8b);
+  memOperand(as, dst, base, disp);
+}
+
+static void store(Assembler* as, Register base, int32_t disp, Register src) {
+  rex(as, true, src, base);
+  emitByte(as, 0x89);
+  memOperand(as, src, base, disp);
+}
+
+static void move(Assembler* as, Register dst, Register src) {
+  rex(as, true, src, dst);
+  emitByte(as, 0x89);
+  regOperand(as, src, dst);
+}
+
+static void store32(Assembler* as, Register base, int32_t disp, Register src) {
+  rex(as, false, src, base);
+  emitByte(as, 0x89);
+  memOperand(as, src, base, disp);
+}
+
+static void moveImmediate(Assembler* as, Register dst, uint64_t value) {
+  rex(as, true, 0, dst);
+  emitByte(as, 0xb8 + (dst & 7));
+  emit64(as, value);
+}
+
+static void alu(Assembler* as, AluOp op, Register dst, Register src) {
+  rex(as, true, src, dst);
+  emitByte(as, op);
+  regOperand(as, src, dst);
+}
+
+static void alu32(Assembler* as, AluOp op, Register dst, Register src) {
+  rex(as, false, src, dst);
+  emitByte(as, op);
+  regOperand(as, src, dst);
+}
+
+// 0x81 group: /0 add, /5 sub, /7 cmp.
+static void aluImmediate(Assembler* as, int ext, Register dst, int32_t value) {
+  rex(as, true, 0, dst);
+  emitByte(as, 0x81);
+  regOperand(as, ext, dst);
+  emit32(as, (uint32_t)value);
+}
+
+static void adjustTop(Assembler* as, int values) {
+  if (values > 0) aluImmediate(as, 0, TOP, values * (int)sizeof(Value));
+  if (values < 0) aluImmediate(as, 5, TOP, -values * (int)sizeof(Value));
+}
+
+static void callAbsolute(Assembler* as, void* function) {
+  moveImmediate(as, RAX, (uint64_t)(uintptr_t)function);
+  emitByte(as, 0xff);
+  regOperand(as, 2, RAX);
+}
+
+static int jumpIf(Assembler* as, Condition cc) {
+  emitByte(as, 0x0f);
+  emitByte(as, 0x80 | cc);
+  emit32(as, 0);
+  return as->count - 4;
+}
+
+static int jump(Assembler* as) {
+  emitByte(as, 0xe9);
+  emit32(as, 0);
+  return as->count - 4;
+}
+
+static void setAl(Assembler* as, Condition cc) {
+  emitByte(as, 0x0f);
+  emitByte(as, 0x90 | cc);
+  emitByte(as, 0xc0);
+}
+
+static void sse(Assembler* as, uint8_t prefix, uint8_t op, int dst, int src) {
+  emitByte(as, prefix);
+  emitByte(as, 0x0f);
+  emitByte(as, op);
+  regOperand(as, dst, src);
+}
+
+static void loadDouble(Assembler* as, int xmm, Register base, int32_t disp) {
+  emitByte(as, 0xf3);
+  rex(as, false, xmm, base);
+  emitByte(as, 0x0f);
+  emitByte(as, 0x7e);
+  memOperand(as, xmm, base, disp);
+}
+
+// Control flow. Jumps to bytecode offsets not emitted yet are patched
+// once the whole chunk is done; failed guards go to out-of-line stubs
+// that exit at the guarded instruction.
+
+static void jumpTo(Assembler* as, int cc, int target) {
+  int at = cc < 0 ? jump(as) : jumpIf(as, (Condition)cc);
+  if (as->entries[target] >= 0) {
+    patchRel32(as, at, as->entries[target]);
+  } else {
+    addPatch(&as->jumps, &as->jumpCount, &as->jumpCapacity, at, target);
+  }
+}
+
+static void exitIf(Assembler* as, Condition cc, int offset) {
+  int at = jumpIf(as, cc);
+  addPatch(&as->exits, &as->exitCount, &as->exitCapacity, at, offset);
+}
+
+static void exitAt(Assembler* as, int offset) {
+  moveImmediate(as, RDI, (uint64_t)(uintptr_t)(as->chunk->code + offset));
+  patchRel32(as, jump(as), as->exitCommon);
+}
+
+static void flushTop(Assembler* as) {
+  moveImmediate(as, RAX, (uint64_t)(uintptr_t)&vm.stackTop);
+  store(as, RAX, 0, TOP);
+}
+
+// Anything called from here may have grown the stack or run other
+// frames, so both registers come back from the VM.
+static void reloadFrame(Assembler* as) {
+  moveImmediate(as, RAX, (uint64_t)(uintptr_t)&vm.stackTop);
+  load(as, TOP, RAX, 0);
+  moveImmediate(as, RAX, (uint64_t)(uintptr_t)&vm.frameCount);
+  load32(as, RCX, RAX, 0);
+  rex(as, true, RCX, RCX);
+  emitByte(as, 0x69);
+  regOperand(as, RCX, RCX);
+  emit32(as, sizeof(CallFrame));
+  moveImmediate(as, RAX, (uint64_t)(uintptr_t)&vm.frames);
+  load(as, RAX, RAX, 0);
+  alu(as, ALU_ADD, RAX, RCX);
+  load(as, SLOTS, RAX,
+       (int32_t)offsetof(CallFrame, slots) - (int32_t)sizeof(CallFrame));
+}
+
+// Calls one of the jit* entry points in vm.c with ip just past the
+// instruction. Anything but JIT_CONTINUE is returned as is, before the
+// reload, since the frame may be gone.
+static void callHelper(Assembler* as, void* helper, int next,
+                       uint64_t a, uint64_t b, uint64_t c) {
+  flushTop(as);
+  moveImmediate(as, RDI, (uint64_t)(uintptr_t)(as->chunk->code + next));
+  moveImmediate(as, RSI, a);
+  moveImmediate(as, RDX, b);
+  moveImmediate(as, RCX, c);
+  callAbsolute(as, helper);
+  emitByte(as, 0x85);                 // test eax, eax
+  regOperand(as, RAX, RAX);
+  patchRel32(as, jumpIf(as, CC_NE), as->epilogue);
+  reloadFrame(as);
+}
+
+// Value templates.
+
+static void pushRax(Assembler* as) {
+  store(as, TOP, 0, RAX);
+  adjustTop(as, 1);
+}
+
+static void pushConstant(Assembler* as, Value value) {
+  moveImmediate(as, RAX, value);
+  pushRax(as);
+}
+
+static void guardInt(Assembler* as, Register base, int32_t disp,
+                     int offset) {
+  load(as, RAX, base, disp);
+  rex(as, true, 0, RAX);
+  emitByte(as, 0xc1);
+  regOperand(as, 5, RAX);
+  emitByte(as, 48);
+  emitByte(as, 0x3d);
+  emit32(as, (uint32_t)((QNAN | INT_TAG) >> 48));
+  exitIf(as, CC_NE, offset);
+}
+
+// Compares the value's QNAN/SIGN bits with mask and exits on exitWhen,
+// leaving the value in rax and the mask in rcx.
+static void guardTag(Assembler* as, Register base, int32_t disp,
+                     Condition exitWhen, uint64_t mask, int offset) {
+  load(as, RAX, base, disp);
+  moveImmediate(as, RCX, mask);
+  move(as, RDX, RAX);
+  alu(as, ALU_AND, RDX, RCX);
+  alu(as, ALU_CMP, RDX, RCX);
+  exitIf(as, exitWhen, offset);
+}
+
+static void guardString(Assembler* as, Register base, int32_t disp,
+                        int offset) {
+  guardTag(as, base, disp, CC_NE, QNAN | SIGN_BIT, offset);
+  rex(as, true, 0, RCX);
+  emitByte(as, 0xf7);                 // not rcx
+  regOperand(as, 2, RCX);
+  alu(as, ALU_AND, RAX, RCX);
+  emitByte(as, 0x81);                 // cmp dword [rax + type], OBJ_STRING
+  memOperand(as, 7, RAX, (int32_t)offsetof(Obj, type));
+  emit32(as, OBJ_STRING);
+  exitIf(as, CC_NE, offset);
+}
+
+static void tagIntRax(Assembler* as) {
+  moveImmediate(as, RCX, QNAN | INT_TAG);
+  alu(as, ALU_OR, RAX, RCX);
+}
+
+// Turns the flag in al into TRUE_VAL or FALSE_VAL in rax.
+static void boolFromAl(Assembler* as) {
+  emitByte(as, 0x0f);
+  emitByte(as, 0xb6);
+  emitByte(as, 0xc0);
+  moveImmediate(as, RCX, FALSE_VAL);
+  alu(as, ALU_ADD, RAX, RCX);
+}
+
+// Computes value - NIL_VAL into rax and compares it with 1, so
+// "below or equal" means nil or false.
+static void testFalsey(Assembler* as, int32_t disp) {
+  load(as, RAX, TOP, disp);
+  moveImmediate(as, RCX, NIL_VAL);
+  alu(as, ALU_SUB, RAX, RCX);
+  aluImmediate(as, 7, RAX, 1);
+}
+
+static void intArithmetic(Assembler* as, uint8_t instruction, int offset) {
+  load32(as, RAX, TOP, -16);
+  load32(as, RCX, TOP, -8);
+  switch (instruction) {
+    case OP_ADD_INT: alu32(as, ALU_ADD, RAX, RCX); break;
+    case OP_SUBTRACT_INT: alu32(as, ALU_SUB, RAX, RCX); break;
+    case OP_MULTIPLY_INT:
+      rex(as, false, RAX, RCX);
+      emitByte(as, 0x0f);
+      emitByte(as, 0xaf);
+      regOperand(as, RAX, RCX);
+      break;
+    case OP_DIVIDE_INT: {
+      rex(as, false, RCX, RCX);
+      emitByte(as, 0x85);
+      regOperand(as, RCX, RCX);
+      exitIf(as, CC_E, offset);  // run() reports the division by zero
+      // idiv traps on INT32_MIN / -1, so -1 negates like INT_DIVIDE.
+      emitByte(as, 0x83);                 // cmp ecx, -1
+      regOperand(as, 7, RCX);
+      emitByte(as, 0xff);
+      int divide = jumpIf(as, CC_NE);
+      emitByte(as, 0xf7);                 // neg eax
+      regOperand(as, 3, RAX);
+      int done = jump(as);
+      patchHere(as, divide);
+      emitByte(as, 0x99);
+      emitByte(as, 0xf7);
+      regOperand(as, 7, RCX);
+      patchHere(as, done);
+      break;
+    }
+  }
+  tagIntRax(as);
+  store(as, TOP, -16, RAX);
+  adjustTop(as, -1);
+}
+
+static void intCompare(Assembler* as, Condition cc) {
+  load32(as, RCX, TOP, -16);
+  load32(as, RAX, TOP, -8);
+  alu32(as, ALU_CMP, RCX, RAX);
+  setAl(as, cc);
+  boolFromAl(as);
+  store(as, TOP, -16, RAX);
+  adjustTop(as, -1);
+}
+
+// Pops both ints and branches to target unless the comparison holds.
+static void intCompareJump(Assembler* as, Condition otherwise, int target) {
+  load32(as, RCX, TOP, -16);
+  load32(as, RAX, TOP, -8);
+  adjustTop(as, -2);
+  alu32(as, ALU_CMP, RCX, RAX);
+  jumpTo(as, otherwise, target);
+}
+
+// Floats are stored widened to double. The arithmetic is done in double
+// and rounded back through float exactly like FLOAT_OP, and a NaN result
+// is canonicalized like floatToValue.
+static void floatArithmetic(Assembler* as, uint8_t op) {
+  loadDouble(as, 0, TOP, -16);
+  loadDouble(as, 1, TOP, -8);
+  sse(as, 0xf2, op, 0, 1);
+  sse(as, 0xf2, 0x5a, 0, 0);
+  sse(as, 0xf3, 0x5a, 0, 0);
+  sse(as, 0x66, 0x2e, 0, 0);
+  emitByte(as, 0x66);
+  rex(as, true, 0, RAX);
+  emitByte(as, 0x0f);
+  emitByte(as, 0x7e);
+  regOperand(as, 0, RAX);
+  int ordered = jumpIf(as, CC_NP);
+  moveImmediate(as, RAX, CANONICAL_NAN);
+  patchHere(as, ordered);
+  store(as, TOP, -16, RAX);
+  adjustTop(as, -1);
+}
+
+// "Above" is false for unordered operands, so NaN compares false.
+static void floatCompare(Assembler* as, bool less) {
+  loadDouble(as, 0, TOP, -16);
+  loadDouble(as, 1, TOP, -8);
+  if (less) {
+    sse(as, 0x66, 0x2e, 1, 0);
+  } else {
+    sse(as, 0x66, 0x2e, 0, 1);
+  }
+  setAl(as, CC_A);
+  boolFromAl(as);
+  store(as, TOP, -16, RAX);
+  adjustTop(as, -1);
+}
+
+static void negateInt(Assembler* as) {
+  load32(as, RAX, TOP, -8);
+  emitByte(as, 0xf7);
+  regOperand(as, 3, RAX);
+  tagIntRax(as);
+  store(as, TOP, -8, RAX);
+}
+
+static void negateFloat(Assembler* as) {
+  load(as, RAX, TOP, -8);
+  moveImmediate(as, RCX, CANONICAL_NAN);
+  alu(as, ALU_CMP, RAX, RCX);
+  int nan = jumpIf(as, CC_E);
+  moveImmediate(as, RCX, SIGN_BIT);
+  rex(as, true, RCX, RAX);
+  emitByte(as, 0x31);
+  regOperand(as, RCX, RAX);
+  store(as, TOP, -8, RAX);
+  patchHere(as, nan);
+}
+
+// With no upvalues open and a caller to return to, a return is just
+// popping the frame, so it stays out of C. Otherwise jitReturn does it.
+static void compileReturn(Assembler* as, int next) {
+  moveImmediate(as, RAX, (uint64_t)(uintptr_t)&vm.openUpvalues);
+  load(as, RAX, RAX, 0);
+  rex(as, true, RAX, RAX);
+  emitByte(as, 0x85);                 // test rax, rax
+  regOperand(as, RAX, RAX);
+  int upvalues = jumpIf(as, CC_NE);
+  moveImmediate(as, RAX, (uint64_t)(uintptr_t)&vm.frameCount);
+  load32(as, RCX, RAX, 0);
+  aluImmediate(as, 7, RCX, 1);
+  int script = jumpIf(as, CC_E);
+  aluImmediate(as, 5, RCX, 1);
+  store32(as, RAX, 0, RCX);
+
+  load(as, RAX, TOP, -8);
+  store(as, SLOTS, 0, RAX);
+  move(as, TOP, SLOTS);
+  adjustTop(as, 1);
+  flushTop(as);
+  moveImmediate(as, RAX, JIT_INTERPRET);
+  patchRel32(as, jump(as), as->epilogue);
+
+  patchHere(as, upvalues);
+  patchHere(as, script);
+  // jitReturn never answers JIT_CONTINUE, so callHelper always leaves.
+  callHelper(as, jitReturn, next, 0, 0, 0);
+}
+
+static void globalsBase(Assembler* as) {
+  moveImmediate(as, RCX, (uint64_t)(uintptr_t)&vm.globalValues.values);
+  load(as, RCX, RCX, 0);
+}
+
+// Stores into a typed global are guarded like OP_CHECK_*. A slot with no
+// type yet may still get one from a later REPL line, so that is checked
+// when the store runs, and run() takes over once it has a type.
+static void guardGlobalType(Assembler* as, uint16_t slot, int offset) {
+  Value type = vm.globalTypes.values[slot];
+  if (IS_NIL(type)) {
+    moveImmediate(as, RCX, (uint64_t)(uintptr_t)&vm.globalTypes.values);
+    load(as, RCX, RCX, 0);
+    load(as, RAX, RCX, slot * (int)sizeof(Value));
+    moveImmediate(as, RDX, NIL_VAL);
+    alu(as, ALU_CMP, RAX, RDX);
+    exitIf(as, CC_NE, offset);
+    return;
+  }
+  switch (AS_INT(type)) {
+    case VAL_INT: guardInt(as, TOP, -8, offset); break;
+    case VAL_FLOAT: guardTag(as, TOP, -8, CC_E, QNAN, offset); break;
+    case VAL_OBJ: guardString(as, TOP, -8, offset); break;
+  }
+}
+
+static uint16_t readShort(uint8_t* code) {
+  return (uint16_t)((code[0] << 8) | code[1]);
+}
+
+static void compileInstruction(Assembler* as, int offset, int next) {
+  Chunk* chunk = as->chunk;
+  uint8_t* code = chunk->code + offset;
+  Value* constants = chunk->constants.values;
+
+  switch (code[0]) {
+    case OP_CONSTANT:
+    case OP_CONSTANT_INT:
+    case OP_CONSTANT_FLOAT:
+    case OP_CONSTANT_STRING:
+      pushConstant(as, constants[code[1]]);
+      break;
+    case OP_NIL: pushConstant(as, NIL_VAL); break;
+    case OP_TRUE: pushConstant(as, TRUE_VAL); break;
+    case OP_FALSE: pushConstant(as, FALSE_VAL); break;
+    case OP_POP: adjustTop(as, -1); break;
+    case OP_GET_LOCAL:
+      load(as, RAX, SLOTS, code[1] * (int)sizeof(Value));
+      pushRax(as);
+      break;
+    case OP_SET_LOCAL:
+      load(as, RAX, TOP, -8);
+      store(as, SLOTS, code[1] * (int)sizeof(Value), RAX);
+      break;
+    case OP_GET_LOCAL_GET_LOCAL:
+      load(as, RAX, SLOTS, code[1] * (int)sizeof(Value));
+      store(as, TOP, 0, RAX);
+      load(as, RAX, SLOTS, code[2] * (int)sizeof(Value));
+      store(as, TOP, 8, RAX);
+      adjustTop(as, 2);
+      break;
+    case OP_INC_LOCAL_INT:
+      // Only the low 32 bits hold the int, so the tag is left alone.
+      rex(as, false, 0, SLOTS);
+      emitByte(as, 0x81);
+      memOperand(as, 0, SLOTS, code[1] * (int)sizeof(Value));
+      emit32(as, (uint32_t)AS_INT(constants[code[2]]));
+      break;
+    case OP_GET_GLOBAL_SLOT: {
+      int32_t disp = readShort(code + 1) * (int)sizeof(Value);
+      globalsBase(as);
+      load(as, RAX, RCX, disp);
+      moveImmediate(as, RDX, UNDEFINED_VAL);
+      alu(as, ALU_CMP, RAX, RDX);
+      exitIf(as, CC_E, offset);
+      pushRax(as);
+      break;
+    }
+    case OP_SET_GLOBAL_SLOT: {
+      int32_t disp = readShort(code + 1) * (int)sizeof(Value);
+      guardGlobalType(as, readShort(code + 1), offset);
+      globalsBase(as);
+      load(as, RAX, RCX, disp);
+      moveImmediate(as, RDX, UNDEFINED_VAL);
+      alu(as, ALU_CMP, RAX, RDX);
+      exitIf(as, CC_E, offset);
+      load(as, RAX, TOP, -8);
+      store(as, RCX, disp, RAX);
+      break;
+    }
+    case OP_DEFINE_GLOBAL_SLOT:
+      guardGlobalType(as, readShort(code + 1), offset);
+      globalsBase(as);
+      load(as, RAX, TOP, -8);
+      store(as, RCX, readShort(code + 1) * (int)sizeof(Value), RAX);
+      adjustTop(as, -1);
+      break;
+    case OP_GET_UPVALUE:
+      callHelper(as, jitGetUpvalue, next, code[1], 0, 0);
+      break;
+    case OP_SET_UPVALUE:
+      callHelper(as, jitSetUpvalue, next, code[1], 0, 0);
+      break;
+    case OP_GET_PROPERTY:
+    case OP_SET_PROPERTY:
+      callHelper(as, code[0] == OP_GET_PROPERTY ? (void*)jitGetProperty
+                                                : (void*)jitSetProperty,
+                 next, (uint64_t)(uintptr_t)AS_STRING(constants[code[1]]),
+                 (uint64_t)(uintptr_t)&chunk->caches[readShort(code + 2)],
+                 0);
+      break;
+    case OP_EQUAL: callHelper(as, jitEqual, next, 0, 0, 0); break;
+    case OP_ADD:
+    case OP_SUBTRACT:
+    case OP_MULTIPLY:
+    case OP_DIVIDE:
+      // Only the int case is inline; run() handles floats, strings and
+      // the errors.
+      guardInt(as, TOP, -16, offset);
+      guardInt(as, TOP, -8, offset);
+      intArithmetic(as, code[0] - OP_ADD + OP_ADD_INT, offset);
+      break;
+    case OP_ADD_INT:
+    case OP_SUBTRACT_INT:
+    case OP_MULTIPLY_INT:
+    case OP_DIVIDE_INT:
+      intArithmetic(as, code[0], offset);
+      break;
+    case OP_ADD_FLOAT: floatArithmetic(as, 0x58); break;
+    case OP_SUBTRACT_FLOAT: floatArithmetic(as, 0x5c); break;
+    case OP_MULTIPLY_FLOAT: floatArithmetic(as, 0x59); break;
+    case OP_DIVIDE_FLOAT: floatArithmetic(as, 0x5e); break;
+    case OP_GREATER:
+    case OP_LESS:
+      guardInt(as, TOP, -16, offset);
+      guardInt(as, TOP, -8, offset);
+      intCompare(as, code[0] == OP_LESS ? CC_L : CC_G);
+      break;
+    case OP_GREATER_INT: intCompare(as, CC_G); break;
+    case OP_LESS_INT: intCompare(as, CC_L); break;
+    case OP_GREATER_FLOAT: floatCompare(as, false); break;
+    case OP_LESS_FLOAT: floatCompare(as, true); break;
+    case OP_NOT:
+      testFalsey(as, -8);
+      setAl(as, CC_BE);
+      boolFromAl(as);
+      store(as, TOP, -8, RAX);
+      break;
+    case OP_NEGATE:
+      guardInt(as, TOP, -8, offset);
+      negateInt(as);
+      break;
+    case OP_NEGATE_INT: negateInt(as); break;
+    case OP_NEGATE_FLOAT: negateFloat(as); break;
+    case OP_PRINT: callHelper(as, jitPrint, next, 0, 0, 0); break;
+    // A failed check exits, and run() reports it.
+    case OP_CHECK_INT: guardInt(as, TOP, -8, offset); break;
+    case OP_CHECK_FLOAT: guardTag(as, TOP, -8, CC_E, QNAN, offset); break;
+    case OP_CHECK_STRING: guardString(as, TOP, -8, offset); break;
+    case OP_JUMP:
+      jumpTo(as, -1, next + readShort(code + 1));
+      break;
+    case OP_LOOP:
+      jumpTo(as, -1, next - readShort(code + 1));
+      break;
+    case OP_JUMP_IF_FALSE:
+      testFalsey(as, -8);
+      jumpTo(as, CC_BE, next + readShort(code + 1));
+      break;
+    case OP_LESS_JUMP_IF_FALSE:
+    case OP_GREATER_JUMP_IF_FALSE:
+      guardInt(as, TOP, -16, offset);
+      guardInt(as, TOP, -8, offset);
+      // Fall through.
+    case OP_LESS_INT_JUMP_IF_FALSE:
+    case OP_GREATER_INT_JUMP_IF_FALSE: {
+      bool less = code[0] == OP_LESS_JUMP_IF_FALSE ||
+                  code[0] == OP_LESS_INT_JUMP_IF_FALSE;
+      intCompareJump(as, less ? CC_GE : CC_LE, next + readShort(code + 1));
+      break;
+    }
+    case OP_CALL:
+      callHelper(as, jitCall, next, code[1], 0, 0);
+      break;
+    case OP_TAIL_CALL:
+      callHelper(as, jitTailCall, next, code[1], 0, 0);
+      break;
+    case OP_INVOKE:
+      callHelper(as, jitInvoke, next,
+                 (uint64_t)(uintptr_t)AS_STRING(constants[code[1]]), code[2],
+                 (uint64_t)(uintptr_t)&chunk->caches[readShort(code + 3)]);
+      break;
+    case OP_CLOSE_UPVALUE:
+      callHelper(as, jitCloseUpvalue, next, 0, 0, 0);
+      break;
+    case OP_RETURN: compileReturn(as, next); break;
+    default:
+      exitAt(as, offset);
+      break;
+  }
+}
+
+// Entry: save the callee-saved registers we use (which also realigns the
+// stack for calls), load the frame and jump to the requested instruction.
+// The shared exit and the epilogue follow, so every later branch to them
+// is backwards.
+static void compilePrologue(Assembler* as) {
+  emitByte(as, 0x55);                 // push rbp
+  emitByte(as, 0x53);                 // push rbx
+  emitByte(as, 0x41);                 // push r12
+  emitByte(as, 0x54);
+  reloadFrame(as);
+  emitByte(as, 0xff);                 // jmp rdi
+  regOperand(as, 4, RDI);
+
+  as->exitCommon = as->count;
+  flushTop(as);
+  callAbsolute(as, jitExit);
+
+  as->epilogue = as->count;
+  emitByte(as, 0x41);                 // pop r12
+  emitByte(as, 0x5c);
+  emitByte(as, 0x5b);                 // pop rbx
+  emitByte(as, 0x5d);                 // pop rbp
+  emitByte(as, 0xc3);
+}
+
+static void freeAssembler(Assembler* as) {
+  FREE_ARRAY(uint8_t, as->code, as->capacity);
+  FREE_ARRAY(Patch, as->jumps, as->jumpCapacity);
+  FREE_ARRAY(Patch, as->exits, as->exitCapacity);
+}
+
+// Emits the exit stubs and copies the finished code into memory of its
+// own, written while still writable and then flipped to executable.
+static uint8_t* installCode(Assembler* as) {
+  for (int i = 0; i < as->exitCount; i++) {
+    patchHere(as, as->exits[i].at);
+    exitAt(as, as->exits[i].target);
+  }
+
+  void* memory = mmap(NULL, as->count, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (memory == MAP_FAILED) return NULL;
+  memcpy(memory, as->code, as->count);
+  if (mprotect(memory, as->count, PROT_READ | PROT_EXEC) != 0) {
+    munmap(memory, as->count);
+    return NULL;
+  }
+  return memory;
+}
+
+static bool compileFunction(ObjFunction* function) {
+  Chunk* chunk = &function->chunk;
+  Assembler as;
+  memset(&as, 0, sizeof(as));
+  as.chunk = chunk;
+  as.entries = ALLOCATE(int, chunk->count);
+  for (int i = 0; i < chunk->count; i++) as.entries[i] = -1;
+
+  compilePrologue(&as);
+  for (int offset = 0; offset < chunk->count;) {
+    int next = offset + instructionLength(chunk, offset);
+    as.entries[offset] = as.count;
+    compileInstruction(&as, offset, next);
+    offset = next;
+  }
+  for (int i = 0; i < as.jumpCount; i++) {
+    patchRel32(&as, as.jumps[i].at, as.entries[as.jumps[i].target]);
+  }
+
+  uint8_t* code = installCode(&as);
+  if (code == NULL) {
+    freeAssembler(&as);
+    FREE_ARRAY(int, as.entries, chunk->count);
+    return false;
+  }
+
+  JitCode* jit = ALLOCATE(JitCode, 1);
+  jit->code = code;
+  jit->size = as.count;
+  jit->entries = as.entries;
+  jit->entryCount = chunk->count;
+  function->jit = jit;
+  freeAssembler(&as);
+  return true;
+}
+
+// Runs the top frame natively from its current ip, compiling its function
+// first if this entry makes it hot. A tail call swaps the frame's closure
+// and comes back here to dispatch on the new one.
+JitStatus jitEnter() {
+  if (vm.jitDepth >= JIT_MAX_NESTING) return JIT_INTERPRET;
+  for (;;) {
+    CallFrame* frame = &vm.frames[vm.frameCount - 1];
+    ObjFunction* function = frame->closure->function;
+    if (function->jit == NULL) {
+      if (++function->hotness < vm.jitThreshold) return JIT_INTERPRET;
+      if (!compileFunction(function)) {
+        function->hotness = INT_MIN;  // Don't try again.
+        return JIT_INTERPRET;
+      }
+    }
+
+    JitCode* jit = function->jit;
+    int entry = jit->entries[frame->ip - function->chunk.code];
+    vm.jitDepth++;
+    JitStatus status = ((JitFunction)(void*)jit->code)(jit->code + entry);
+    vm.jitDepth--;
+    if (status != JIT_REENTER) return status;
+  }
+}
+
+void freeJitCode(JitCode* jit) {
+  munmap(jit->code, jit->size);
+  FREE_ARRAY(int, jit->entries, jit->entryCount);
+  FREE(JitCode, jit);
+}
+
+// Tracing. A loop header whose back edge is taken often enough gets one
+// iteration recorded as the interpreter runs it: every instruction the
+// loop's own frame executes, with the types it found on top of the stack.
+// That straight line is compiled with the branches not taken turned into
+// side exits, and generic arithmetic specialized to the types seen. Type
+// guards whose answer is already known are dropped, and those on locals
+// the iteration hasn't written yet are hoisted to the trace's entry, so a
+// loop whose types stay put checks them once rather than every time round.
+
+static struct {
+  ObjFunction* function;
+  int frame;        // index of the recorded frame in vm.frames
+  int header;
+  int depth;        // stack values above the frame's slots at the header
+  TraceStep steps[TRACE_MAX_STEPS];
+  int stepCount;
+} recorder;
+
+static int8_t observedType(Value value) {
+  if (IS_STRING(value)) return TYPE_STRING;
+  return (int8_t)VALUE_TYPE(value);
+}
+
+static bool sameNumbers(TraceStep* step) {
+  return (step->types[0] == VAL_INT && step->types[1] == VAL_INT) ||
+         (step->types[0] == VAL_FLOAT && step->types[1] == VAL_FLOAT);
+}
+
+// Rejects what a trace can't compile, so recording stops early instead
+// of at the end of the iteration.
+static bool traceable(uint8_t* code, TraceStep* step) {
+  switch (code[0]) {
+    case OP_ADD:
+    case OP_SUBTRACT:
+    case OP_MULTIPLY:
+    case OP_DIVIDE:
+    case OP_LESS:
+    case OP_GREATER:
+    case OP_LESS_JUMP_IF_FALSE:
+    case OP_GREATER_JUMP_IF_FALSE:
+      return sameNumbers(step);
+    case OP_NEGATE:
+      return step->types[0] == VAL_INT || step->types[0] == VAL_FLOAT;
+    case OP_GET_SUPER:
+    case OP_TAIL_CALL:
+    case OP_SUPER_INVOKE:
+    case OP_CLOSURE:
+    case OP_RETURN:
+    case OP_CLASS:
+    case OP_INHERIT:
+    case OP_METHOD:
+    case OP_TYPE_ERROR:
+    case OP_RUNTIME_ERROR:
+      return false;
+    default:
+      return true;
+  }
+}
+
+static void stopRecording(bool failed) {
+  if (failed) recorder.function->loopHits[recorder.header] = INT_MIN;
+  vm.recording = false;
+}
+
+void recordInstruction(uint8_t* ip) {
+  int frame = vm.frameCount - 1;
+  if (frame > recorder.frame) return;  // inside a call the loop made
+  ObjFunction* function = vm.frames[frame].closure->function;
+  if (frame < recorder.frame || function != recorder.function ||
+      recorder.stepCount == TRACE_MAX_STEPS) {
+    stopRecording(true);
+    return;
+  }
+
+  TraceStep* step = &recorder.steps[recorder.stepCount++];
+  step->offset = (int)(ip - function->chunk.code);
+  int height = (int)(vm.stackTop - vm.frames[frame].slots);
+  for (int i = 0; i < 2; i++) {
+    step->types[i] = height > i ? observedType(vm.stackTop[-1 - i])
+                                : TYPE_UNKNOWN;
+  }
+  if (!traceable(ip, step)) stopRecording(true);
+}
+
+typedef struct {
+  Assembler as;
+  ObjFunction* function;
+  Trace* trace;
+  int depth;
+  int top;
+  int capacity;
+  int8_t* types;        // per stack slot above the frame's slots
+  int* sources;         // the local a value was loaded from, or -1
+  bool* written;        // stored to since the iteration began
+  int8_t* entryTypes;   // guarded once, at the trace's entry
+  bool hoisting;        // first pass: only collecting entryTypes
+  bool hasClosures;
+  bool failed;
+} TraceCompiler;
+
+static void pushType(TraceCompiler* tc, int8_t type, int source) {
+  if (tc->top == tc->capacity) {
+    tc->failed = true;
+    return;
+  }
+  tc->types[tc->top] = type;
+  tc->sources[tc->top] = source;
+  tc->top++;
+}
+
+static void popTypes(TraceCompiler* tc, int count) {
+  tc->top -= count;
+  if (tc->top < 0) {
+    tc->failed = true;
+    tc->top = 0;
+  }
+}
+
+static void writeLocal(TraceCompiler* tc, int slot, int8_t type) {
+  if (slot >= tc->top) {
+    tc->failed = true;
+    return;
+  }
+  tc->types[slot] = type;
+  tc->written[slot] = true;
+  for (int i = 0; i < tc->top; i++) {
+    if (tc->sources[i] == slot) tc->sources[i] = -1;
+  }
+}
+
+// A closure over one of the frame's locals can change it from any call.
+static void forgetLocals(TraceCompiler* tc) {
+  if (!tc->hasClosures) return;
+  for (int i = 0; i < tc->top; i++) {
+    tc->types[i] = TYPE_UNKNOWN;
+    tc->sources[i] = -1;
+    tc->written[i] = true;
+  }
+}
+
+static void emitGuard(Assembler* as, Register base, int32_t disp,
+                      int8_t type, int offset) {
+  switch (type) {
+    case VAL_INT: guardInt(as, base, disp, offset); break;
+    case VAL_FLOAT: guardTag(as, base, disp, CC_E, QNAN, offset); break;
+    case TYPE_STRING: guardString(as, base, disp, offset); break;
+  }
+}
+
+// Makes sure the value distance below the top has the given type, exiting
+// at offset if not.
+static void guardValue(TraceCompiler* tc, int distance, int8_t type,
+                       int offset) {
+  int slot = tc->top - 1 - distance;
+  if (slot < 0) {
+    tc->failed = true;
+    return;
+  }
+  int source = tc->sources[slot];
+  if (tc->types[slot] == type) {
+    tc->trace->guardsRemoved++;
+  } else if (tc->hoisting && source >= 0 && source < tc->depth &&
+             !tc->written[source] && tc->types[source] == TYPE_UNKNOWN) {
+    tc->entryTypes[source] = type;
+  } else {
+    emitGuard(&tc->as, TOP, -8 * (distance + 1), type, offset);
+    tc->trace->guards++;
+  }
+  tc->types[slot] = type;
+  if (source >= 0) tc->types[source] = type;
+}
+
+// Type and stack effects of everything compileInstruction emits.
+static void simulate(TraceCompiler* tc, uint8_t* code) {
+  Value* constants = tc->function->chunk.constants.values;
+  switch (code[0]) {
+    case OP_CONSTANT:
+    case OP_CONSTANT_INT:
+    case OP_CONSTANT_FLOAT:
+    case OP_CONSTANT_STRING:
+      pushType(tc, observedType(constants[code[1]]), -1);
+      break;
+    case OP_NIL: pushType(tc, VAL_NIL, -1); break;
+    case OP_TRUE:
+    case OP_FALSE:
+      pushType(tc, VAL_BOOL, -1);
+      break;
+    case OP_POP:
+    case OP_DEFINE_GLOBAL_SLOT:
+    case OP_PRINT:
+    case OP_CLOSE_UPVALUE:
+      popTypes(tc, 1);
+      break;
+    case OP_GET_LOCAL:
+      if (code[1] >= tc->top) {
+        tc->failed = true;
+        break;
+      }
+      pushType(tc, tc->types[code[1]], code[1]);
+      break;
+    case OP_SET_LOCAL:
+      if (tc->top == 0) {
+        tc->failed = true;
+        break;
+      }
+      writeLocal(tc, code[1], tc->types[tc->top - 1]);
+      break;
+    case OP_GET_LOCAL_GET_LOCAL:
+      if (code[1] >= tc->top || code[2] >= tc->top) {
+        tc->failed = true;
+        break;
+      }
+      pushType(tc, tc->types[code[1]], code[1]);
+      pushType(tc, tc->types[code[2]], code[2]);
+      break;
+    case OP_INC_LOCAL_INT: writeLocal(tc, code[1], VAL_INT); break;
+    case OP_GET_GLOBAL_SLOT:
+    case OP_GET_UPVALUE:
+      pushType(tc, TYPE_UNKNOWN, -1);
+      break;
+    case OP_SET_GLOBAL_SLOT:
+    case OP_SET_UPVALUE:
+      break;
+    case OP_GET_PROPERTY:
+      popTypes(tc, 1);
+      pushType(tc, TYPE_UNKNOWN, -1);
+      break;
+    case OP_SET_PROPERTY: {
+      int8_t type = tc->top > 0 ? tc->types[tc->top - 1] : TYPE_UNKNOWN;
+      popTypes(tc, 2);
+      pushType(tc, type, -1);
+      break;
+    }
+    case OP_EQUAL:
+    case OP_GREATER_INT:
+    case OP_LESS_INT:
+    case OP_GREATER_FLOAT:
+    case OP_LESS_FLOAT:
+      popTypes(tc, 2);
+      pushType(tc, VAL_BOOL, -1);
+      break;
+    case OP_ADD_INT:
+    case OP_SUBTRACT_INT:
+    case OP_MULTIPLY_INT:
+    case OP_DIVIDE_INT:
+      popTypes(tc, 2);
+      pushType(tc, VAL_INT, -1);
+      break;
+    case OP_ADD_FLOAT:
+    case OP_SUBTRACT_FLOAT:
+    case OP_MULTIPLY_FLOAT:
+    case OP_DIVIDE_FLOAT:
+      popTypes(tc, 2);
+      pushType(tc, VAL_FLOAT, -1);
+      break;
+    case OP_NOT:
+      popTypes(tc, 1);
+      pushType(tc, VAL_BOOL, -1);
+      break;
+    case OP_NEGATE_INT:
+    case OP_NEGATE_FLOAT:
+      popTypes(tc, 1);
+      pushType(tc, code[0] == OP_NEGATE_INT ? VAL_INT : VAL_FLOAT, -1);
+      break;
+    case OP_CALL:
+      popTypes(tc, code[1] + 1);
+      forgetLocals(tc);
+      pushType(tc, TYPE_UNKNOWN, -1);
+      break;
+    case OP_INVOKE:
+      popTypes(tc, code[2] + 1);
+      forgetLocals(tc);
+      pushType(tc, TYPE_UNKNOWN, -1);
+      break;
+    default:
+      tc->failed = true;
+      break;
+  }
+}
+
+// Leaves the trace for whichever successor the recording didn't take.
+static void exitUnlessTaken(Assembler* as, Condition holds, int taken,
+                            int next, int target) {
+  if (taken == next) {
+    exitIf(as, (Condition)(holds ^ 1), target);
+  } else {
+    exitIf(as, holds, next);
+  }
+}
+
+// A fused compare-and-branch on two ints or two floats. Both operands are
+// popped before the exit, as the instruction itself does.
+static void compareExit(Assembler* as, bool less, bool floats, int taken,
+                        int next, int target) {
+  Condition holds;
+  if (floats) {
+    loadDouble(as, 0, TOP, -16);
+    loadDouble(as, 1, TOP, -8);
+    adjustTop(as, -2);
+    if (less) {
+      sse(as, 0x66, 0x2e, 1, 0);
+    } else {
+      sse(as, 0x66, 0x2e, 0, 1);
+    }
+    holds = CC_A;
+  } else {
+    load32(as, RCX, TOP, -16);
+    load32(as, RAX, TOP, -8);
+    adjustTop(as, -2);
+    alu32(as, ALU_CMP, RCX, RAX);
+    holds = less ? CC_L : CC_G;
+  }
+  exitUnlessTaken(as, holds, taken, next, target);
+}
+
+static uint8_t floatOp(uint8_t instruction) {
+  switch (instruction) {
+    case OP_ADD: return 0x58;
+    case OP_SUBTRACT: return 0x5c;
+    case OP_MULTIPLY: return 0x59;
+    default: return 0x5e;
+  }
+}
+
+static void compileStep(TraceCompiler* tc, TraceStep* step, int taken) {
+  Assembler* as = &tc->as;
+  Chunk* chunk = &tc->function->chunk;
+  int offset = step->offset;
+  uint8_t* code = chunk->code + offset;
+  int next = offset + instructionLength(chunk, offset);
+
+  switch (code[0]) {
+    case OP_JUMP:
+    case OP_LOOP:
+      break;
+    case OP_JUMP_IF_FALSE:
+      testFalsey(as, -8);
+      exitUnlessTaken(as, CC_A, taken, next, next + readShort(code + 1));
+      break;
+    case OP_LESS_JUMP_IF_FALSE:
+    case OP_GREATER_JUMP_IF_FALSE:
+    case OP_LESS_INT_JUMP_IF_FALSE:
+    case OP_GREATER_INT_JUMP_IF_FALSE: {
+      bool floats = false;
+      if (code[0] == OP_LESS_JUMP_IF_FALSE ||
+          code[0] == OP_GREATER_JUMP_IF_FALSE) {
+        floats = step->types[0] == VAL_FLOAT;
+        guardValue(tc, 1, step->types[1], offset);
+        guardValue(tc, 0, step->types[0], offset);
+      }
+      bool less = code[0] == OP_LESS_JUMP_IF_FALSE ||
+                  code[0] == OP_LESS_INT_JUMP_IF_FALSE;
+      compareExit(as, less, floats, taken, next, next + readShort(code + 1));
+      popTypes(tc, 2);
+      break;
+    }
+    case OP_ADD:
+    case OP_SUBTRACT:
+    case OP_MULTIPLY:
+    case OP_DIVIDE:
+      guardValue(tc, 1, step->types[1], offset);
+      guardValue(tc, 0, step->types[0], offset);
+      if (step->types[0] == VAL_INT) {
+        intArithmetic(as, code[0] - OP_ADD + OP_ADD_INT, offset);
+      } else {
+        floatArithmetic(as, floatOp(code[0]));
+      }
+      popTypes(tc, 2);
+      pushType(tc, step->types[0], -1);
+      break;
+    case OP_LESS:
+    case OP_GREATER:
+      guardValue(tc, 1, step->types[1], offset);
+      guardValue(tc, 0, step->types[0], offset);
+      if (step->types[0] == VAL_INT) {
+        intCompare(as, code[0] == OP_LESS ? CC_L : CC_G);
+      } else {
+        floatCompare(as, code[0] == OP_LESS);
+      }
+      popTypes(tc, 2);
+      pushType(tc, VAL_BOOL, -1);
+      break;
+    case OP_NEGATE:
+      guardValue(tc, 0, step->types[0], offset);
+      if (step->types[0] == VAL_INT) {
+        negateInt(as);
+      } else {
+        negateFloat(as);
+      }
+      popTypes(tc, 1);
+      pushType(tc, step->types[0], -1);
+      break;
+    case OP_CHECK_INT: guardValue(tc, 0, VAL_INT, offset); break;
+    case OP_CHECK_FLOAT: guardValue(tc, 0, VAL_FLOAT, offset); break;
+    case OP_CHECK_STRING: guardValue(tc, 0, TYPE_STRING, offset); break;
+    default:
+      compileInstruction(as, offset, next);
+      simulate(tc, code);
+      break;
+  }
+}
+
+// One pass over the recorded iteration, starting from the types the entry
+// guards establish.
+static void compileSteps(TraceCompiler* tc, TraceStep* steps, int count) {
+  for (int i = 0; i < tc->capacity; i++) {
+    tc->types[i] = i < tc->depth ? tc->entryTypes[i] : TYPE_UNKNOWN;
+    tc->sources[i] = -1;
+    tc->written[i] = false;
+  }
+  tc->top = tc->depth;
+  tc->trace->guards = 0;
+  tc->trace->guardsRemoved = 0;
+  for (int i = 0; i < count - 1 && !tc->failed; i++) {
+    compileStep(tc, &steps[i], steps[i + 1].offset);
+  }
+  if (tc->top != tc->depth) tc->failed = true;
+}
+
+static Trace* compileTrace(TraceStep* steps, int count) {
+  ObjFunction* function = recorder.function;
+  Chunk* chunk = &function->chunk;
+  Trace* trace = ALLOCATE(Trace, 1);
+  trace->header = recorder.header;
+  trace->steps = NULL;
+  trace->stepCount = 0;
+  trace->code = NULL;
+  trace->next = NULL;
+
+  TraceCompiler tc;
+  memset(&tc, 0, sizeof(tc));
+  tc.function = function;
+  tc.trace = trace;
+  tc.depth = recorder.depth;
+  tc.capacity = function->maxStack + 1;
+  if (tc.capacity < tc.depth) tc.capacity = tc.depth;
+  tc.types = ALLOCATE(int8_t, tc.capacity);
+  tc.sources = ALLOCATE(int, tc.capacity);
+  tc.written = ALLOCATE(bool, tc.capacity);
+  tc.entryTypes = ALLOCATE(int8_t, tc.capacity);
+  for (int i = 0; i < tc.capacity; i++) tc.entryTypes[i] = TYPE_UNKNOWN;
+  for (int offset = 0; offset < chunk->count;
+       offset += instructionLength(chunk, offset)) {
+    if (chunk->code[offset] == OP_CLOSURE) tc.hasClosures = true;
+  }
+
+  tc.as.chunk = chunk;
+  tc.hoisting = true;
+  compileSteps(&tc, steps, count);
+  freeAssembler(&tc.as);
+  memset(&tc.as, 0, sizeof(tc.as));
+  tc.as.chunk = chunk;
+  tc.hoisting = false;
+
+  compilePrologue(&tc.as);
+  int start = tc.as.count;
+  int hoisted = 0;
+  for (int i = 0; i < tc.depth; i++) {
+    if (tc.entryTypes[i] == TYPE_UNKNOWN) continue;
+    emitGuard(&tc.as, SLOTS, i * (int)sizeof(Value), tc.entryTypes[i],
+              trace->header);
+    hoisted++;
+  }
+  int body = tc.as.count;
+  if (!tc.failed) compileSteps(&tc, steps, count);
+  trace->guards += hoisted;
+
+  // Round again past the entry guards if the iteration left every guarded
+  // local with the type it came in with.
+  bool stable = true;
+  for (int i = 0; i < tc.depth; i++) {
+    if (tc.entryTypes[i] != TYPE_UNKNOWN &&
+        tc.types[i] != tc.entryTypes[i]) {
+      stable = false;
+    }
+  }
+  patchRel32(&tc.as, jump(&tc.as), stable ? body : start);
+
+  uint8_t* code = tc.failed ? NULL : installCode(&tc.as);
+  if (code != NULL) {
+    trace->code = code;
+    trace->size = tc.as.count;
+    trace->entry = start;
+    trace->steps = ALLOCATE(TraceStep, count);
+    memcpy(trace->steps, steps, sizeof(TraceStep) * count);
+    trace->stepCount = count;
+  } else {
+    FREE(Trace, trace);
+    trace = NULL;
+  }
+
+  freeAssembler(&tc.as);
+  FREE_ARRAY(int8_t, tc.types, tc.capacity);
+  FREE_ARRAY(int, tc.sources, tc.capacity);
+  FREE_ARRAY(bool, tc.written, tc.capacity);
+  FREE_ARRAY(int8_t, tc.entryTypes, tc.capacity);
+  return trace;
+}
+
+static void finishRecording() {
+  ObjFunction* function = recorder.function;
+  Trace* trace = compileTrace(recorder.steps, recorder.stepCount);
+  if (trace == NULL) {
+    stopRecording(true);
+    return;
+  }
+  trace->next = function->traces;
+  function->traces = trace;
+  stopRecording(false);
+  if (vm.dumpTraces) {
+    disassembleTrace(&function->chunk, trace,
+                     function->name == NULL ? "script"
+                                            : function->name->chars);
+  }
+}
+
+static void startRecording(ObjFunction* function, int frame, int header) {
+  recorder.function = function;
+  recorder.frame = frame;
+  recorder.header = header;
+  recorder.depth = (int)(vm.stackTop - vm.frames[frame].slots);
+  recorder.stepCount = 0;
+  vm.recording = true;
+}
+
+// Called with the top frame's ip on a loop header it just jumped back
+// to. Closes the iteration being recorded, runs the loop's trace if it has
+// one, or counts the back edge towards recording one.
+JitStatus traceLoop() {
+  int frame = vm.frameCount - 1;
+  ObjFunction* function = vm.frames[frame].closure->function;
+  int header = (int)(vm.frames[frame].ip - function->chunk.code);
+
+  if (vm.recording && frame <= recorder.frame) {
+    if (frame == recorder.frame && function == recorder.function) {
+      // Another back edge is just a jump within the iteration (a for
+      // loop's increment goes back to its condition), unless it goes
+      // round an inner loop. Those get traces of their own instead.
+      if (header != recorder.header) {
+        for (int i = 0; i < recorder.stepCount; i++) {
+          if (recorder.steps[i].offset == header) {
+            stopRecording(true);
+            break;
+          }
+        }
+        return JIT_INTERPRET;
+      }
+      finishRecording();
+    } else {
+      stopRecording(true);
+    }
+  }
+
+  Trace* trace = function->traces;
+  while (trace != NULL && trace->header != header) trace = trace->next;
+  if (trace != NULL) {
+    if (vm.jitDepth >= JIT_MAX_NESTING) return JIT_INTERPRET;
+    vm.jitDepth++;
+    JitStatus status =
+        ((JitFunction)(void*)trace->code)(trace->code + trace->entry);
+    vm.jitDepth--;
+    return status;
+  }
+
+  if (vm.recording) return JIT_INTERPRET;
+  if (function->loopHits == NULL) {
+    function->loopHits = ALLOCATE(int, function->chunk.count);
+    memset(function->loopHits, 0, sizeof(int) * function->chunk.count);
+  }
+  if (++function->loopHits[header] >= vm.traceThreshold) {
+    startRecording(function, frame, header);
+  }
+  return JIT_INTERPRET;
+}
+
+void freeTraces(Trace* trace) {
+  while (trace != NULL) {
+    Trace* next = trace->next;
+    munmap(trace->code, trace->size);
+    FREE_ARRAY(TraceStep, trace->steps, trace->stepCount);
+    FREE(Trace, trace);
+    trace = next;
+  }
+}
+
+#endif
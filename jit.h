@@ -0,0 +1,79 @@
+#ifndef clox_jit_h
+#define clox_jit_h
+
+#include "common.h"
+#include "object.h"
+
+// Entries into a function's code (calls, loop back edges, returns into
+// it) the interpreter sees before the function is compiled.
+#define JIT_DEFAULT_THRESHOLD 1000
+// Native code, nested run()s and the helpers between them all use the C
+// stack, so deeper call chains are left to the interpreter's own loop.
+#define JIT_MAX_NESTING 1000
+// Back edges a loop header takes before the next iteration is recorded.
+#define TRACE_DEFAULT_THRESHOLD 50
+#define TRACE_MAX_STEPS 512
+
+// Types a trace reasons about: a ValueType, with strings told apart from
+// other objects, or unknown.
+#define TYPE_UNKNOWN -1
+#define TYPE_STRING (VAL_OBJ + 1)
+
+typedef enum {
+  JIT_CONTINUE,   // helper done, keep running native code
+  JIT_INTERPRET,  // hand the top frame back to the interpreter
+  JIT_REENTER,    // the top frame now holds another closure (tail call)
+  JIT_FINISHED,   // the script's own frame returned
+  JIT_ERROR       // a runtime error was reported and the stack reset
+} JitStatus;
+
+struct JitCode {
+  uint8_t* code;
+  size_t size;
+  int* entries;     // native offset per bytecode offset, -1 mid-instruction
+  int entryCount;
+};
+
+// One instruction of a recorded loop iteration, with the types of the
+// top two stack values as it found them.
+typedef struct {
+  int offset;
+  int8_t types[2];  // peek(0), peek(1)
+} TraceStep;
+
+struct Trace {
+  int header;       // bytecode offset of the loop's first instruction
+  TraceStep* steps;
+  int stepCount;
+  uint8_t* code;
+  size_t size;
+  int entry;
+  int guards;       // type guards in the compiled trace
+  int guardsRemoved;
+  struct Trace* next;
+};
+
+JitStatus jitEnter();
+void freeJitCode(JitCode* jit);
+JitStatus traceLoop();
+void recordInstruction(uint8_t* ip);
+void freeTraces(Trace* trace);
+
+// Called back from generated code; defined in vm.c. Each first stores ip
+// in the top frame: just past the instruction, so errors report the right
+// line, or for jitExit the instruction itself, for run() to execute.
+JitStatus jitExit(uint8_t* ip);
+JitStatus jitCall(uint8_t* ip, int argCount);
+JitStatus jitTailCall(uint8_t* ip, int argCount);
+JitStatus jitInvoke(uint8_t* ip, ObjString* name, int argCount,
+                    InlineCache* cache);
+JitStatus jitGetProperty(uint8_t* ip, ObjString* name, InlineCache* cache);
+JitStatus jitSetProperty(uint8_t* ip, ObjString* name, InlineCache* cache);
+JitStatus jitGetUpvalue(uint8_t* ip, int slot);
+JitStatus jitSetUpvalue(uint8_t* ip, int slot);
+JitStatus jitCloseUpvalue(uint8_t* ip);
+JitStatus jitEqual(uint8_t* ip);
+JitStatus jitPrint(uint8_t* ip);
+JitStatus jitReturn(uint8_t* ip);
+
+#endif
@@ -4,6 +4,7 @@
 #include "common.h"
 #include "chunk.h"
 #include "debug.h"
+#include "jit.h"
 #include "vm.h"
 
 static void repl() {
@@ -61,13 +62,87 @@ static void runFile(const char* path) {
   if (result == INTERPRET_RUNTIME_ERROR) exit(70);
 }
 
+// Options come before the script paths:
+//   --max-depth=N   allow up to N nested calls before "Stack overflow."
+//   --jit[=N]       compile functions to native code once they are
+//                   entered N times (default JIT_DEFAULT_THRESHOLD)
+//   --trace[=N]     record and compile loops that jump back N times
+//                   (default TRACE_DEFAULT_THRESHOLD)
+//   --dump-traces   disassemble each trace as it is compiled
+//   --gc-pause=US   stop each incremental marking step after US
+//                   microseconds (default GC_DEFAULT_PAUSE_US)
+//   --gc-stats      print a histogram of collector pauses on exit
+//   --concurrent-gc mark the old space on a background thread
+//   --gc-compact[=P] compact the old space after a full collection that
+//                   leaves P percent of it free (default
+//                   GC_DEFAULT_COMPACT_PERCENT)
+//   --gc-min-heap=KB don't start a collection below KB kilobytes of heap
+//   --gc-max-heap=KB collect everything past KB kilobytes, and exit if
+//                   that isn't enough
+//   --gc-cpu=P      pace collections to take about P percent of the time
+//                   (default GC_DEFAULT_CPU_PERCENT)
+//   --gc-log        print a line per collection cycle
+//   --string-stats  on exit, time the string hash against FNV-1a and show
+//                   how far lookups in vm.strings probe with each
+static int parseOptions(int argc, const char* argv[]) {
+  int i = 1;
+  for (; i < argc && strncmp(argv[i], "--", 2) == 0; i++) {
+    if (strncmp(argv[i], "--max-depth=", 12) == 0) {
+      setMaxCallDepth(atoi(argv[i] + 12));
+    } else if (strcmp(argv[i], "--jit") == 0 ||
+               strncmp(argv[i], "--jit=", 6) == 0) {
+      int threshold = argv[i][5] == '=' ? atoi(argv[i] + 6)
+                                        : JIT_DEFAULT_THRESHOLD;
+      if (!enableJit(threshold)) {
+        fprintf(stderr, "No JIT for this platform; interpreting.\n");
+      }
+    } else if (strcmp(argv[i], "--trace") == 0 ||
+               strncmp(argv[i], "--trace=", 8) == 0) {
+      int threshold = argv[i][7] == '=' ? atoi(argv[i] + 8)
+                                        : TRACE_DEFAULT_THRESHOLD;
+      if (!enableTracing(threshold)) {
+        fprintf(stderr, "No JIT for this platform; interpreting.\n");
+      }
+    } else if (strcmp(argv[i], "--dump-traces") == 0) {
+      setDumpTraces(true);
+    } else if (strncmp(argv[i], "--gc-pause=", 11) == 0) {
+      setGcPauseTarget(atoi(argv[i] + 11));
+    } else if (strcmp(argv[i], "--gc-stats") == 0) {
+      setGcStats(true);
+    } else if (strcmp(argv[i], "--gc-compact") == 0 ||
+               strncmp(argv[i], "--gc-compact=", 13) == 0) {
+      setGcCompaction(argv[i][12] == '=' ? atoi(argv[i] + 13)
+                                         : GC_DEFAULT_COMPACT_PERCENT);
+    } else if (strncmp(argv[i], "--gc-min-heap=", 14) == 0) {
+      setGcMinHeap((size_t)atol(argv[i] + 14) * 1024);
+    } else if (strncmp(argv[i], "--gc-max-heap=", 14) == 0) {
+      setGcMaxHeap((size_t)atol(argv[i] + 14) * 1024);
+    } else if (strncmp(argv[i], "--gc-cpu=", 9) == 0) {
+      setGcCpuTarget(atoi(argv[i] + 9));
+    } else if (strcmp(argv[i], "--gc-log") == 0) {
+      setGcLog(true);
+    } else if (strcmp(argv[i], "--string-stats") == 0) {
+      setStringStats(true);
+    } else if (strcmp(argv[i], "--concurrent-gc") == 0) {
+      if (!enableConcurrentGc()) {
+        fprintf(stderr, "No concurrent marking on this platform.\n");
+      }
+    } else {
+      fprintf(stderr, "Unknown option \"%s\".\n", argv[i]);
+      exit(64);
+    }
+  }
+  return i;
+}
+
 int main(int argc, const char* argv[]) {
   initVM();
+  int first = parseOptions(argc, argv);
 
-  if (argc == 1) {
+  if (first == argc) {
     repl();
   } else {
-    for(int i=1; i<argc; i++){
+    for(int i=first; i<argc; i++){
       runFile(argv[i]); 
     }
   }
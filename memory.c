@@ -1,43 +1,552 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 #include "compiler.h"
+#include "jit.h"
 #include "memory.h"
 #include "vm.h"
+#ifdef CONCURRENT_GC
+#include <pthread.h>
+#endif
+#if defined(__linux__) || defined(__APPLE__)
+#include <sys/mman.h>
+#endif
+#ifdef _WIN32
+#include <malloc.h>
+#endif
 #ifdef DEBUG_LOG_GC
 #include <stdio.h>
 #include "debug.h"
 #endif
-#define GC_HEAP_GROW_FACTOR 2
+#define ALIGN(size) (((size) + 7) & ~(size_t)7)
+#define ALIGN16(size) (((size) + 15) & ~(size_t)15)
+
+// The heap has two generations. Objects are born in the nursery, blocks
+// carved up by bumping a pointer. A minor collection copies whatever is
+// still reachable from the roots and the remembered set into the old
+// space, the mark-sweep heap of size-class pages, and then reuses the
+// blocks wholesale. Since copying moves objects, collections
+// only start at safepoints (see gcSafepoint); running out of nursery just
+// adds a block and asks for one.
+//
+// The old space is marked from a snapshot: the roots are marked in one
+// pause, and what they reached then is traced either in slices at later
+// safepoints, each cut off at vm.gcPauseTarget, or by a background
+// thread. snapshotBarrier shades whatever the mutator unlinks in between
+// and new objects are born marked, so the final pause only drains what's
+// left before sweeping.
+struct NurseryBlock {
+  struct NurseryBlock* next;
+  uint8_t* top;        // end of the objects, once a newer block took over
+  uint8_t* end;
+  uint8_t data[];
+};
+
+// Small blocks come from size classes carved out of aligned pages: 16
+// bytes apart up to 128, then 32 apart. Callers always pass a block's
+// size back to reallocate, so the class needs no header to find. A freed
+// block goes on its class's free list; pages are only released on exit.
+// Pages are cut from larger chunks, since aligning each one on its own
+// costs the allocator up to a page of padding apiece.
+#define SLAB_PAGE_SIZE (32 * 1024)
+#define SLAB_CHUNK_PAGES 32
+#define SLAB_MAX_SIZE 256
+#define SLAB_CLASSES 12
+
+// Slab chunks and large-object pages are aligned to SLAB_PAGE_SIZE, so an
+// object finds its page by masking its address. MinGW's C runtimes have
+// no aligned_alloc, and what _aligned_malloc returns must go back through
+// _aligned_free. Where neither that nor posix_memalign is declared (a
+// strict -std=c99 build), the block is over-allocated and the original
+// pointer kept just below the aligned one.
+#if defined(_WIN32)
+#define ALIGNED_WIN32
+#elif defined(__APPLE__) || \
+    (defined(_POSIX_C_SOURCE) && _POSIX_C_SOURCE >= 200112L)
+#define ALIGNED_POSIX
+#endif
+
+static void* alignedAlloc(size_t alignment, size_t size) {
+#if defined(ALIGNED_WIN32)
+  return _aligned_malloc(size, alignment);
+#elif defined(ALIGNED_POSIX)
+  void* pointer;
+  if (posix_memalign(&pointer, alignment, size) != 0) return NULL;
+  return pointer;
+#else
+  uint8_t* block = (uint8_t*)malloc(size + alignment + sizeof(void*));
+  if (block == NULL) return NULL;
+  uintptr_t start = (uintptr_t)(block + sizeof(void*));
+  void** aligned = (void**)((start + alignment - 1) &
+                            ~(uintptr_t)(alignment - 1));
+  aligned[-1] = block;
+  return aligned;
+#endif
+}
+
+static void alignedFree(void* pointer) {
+#if defined(ALIGNED_WIN32)
+  _aligned_free(pointer);
+#elif defined(ALIGNED_POSIX)
+  free(pointer);
+#else
+  if (pointer != NULL) free(((void**)pointer)[-1]);
+#endif
+}
+
+typedef struct SlabPage {
+  struct SlabPage* next;
+  size_t cellSize;
+} SlabPage;
+
+typedef struct {
+  void* free;
+  uint8_t* top;         // bump allocation in the newest page
+  uint8_t* end;
+  SlabPage* pages;
+} SizeClass;
+
+static SizeClass sizeClasses[SLAB_CLASSES];
+
+static struct {
+  uint8_t* top;         // next unused page in the newest chunk
+  uint8_t* end;
+  uint8_t** free;       // pages given back
+  int freeCount;
+  int freeCapacity;
+  void** chunks;
+  int count;
+  int capacity;
+} slabChunks;
+
+// Old objects get pages of their own, one size class to a page, and an
+// object too big for a cell gets a page to itself. Which cells hold
+// objects, and which of those are marked, is kept in bitmaps beside the
+// page, a bit per 16 bytes, found through the page's first word. Marking
+// and sweeping never write to the objects, so pages a forked process
+// shares with its parent stay shared.
+#define PAGE_GRANULES (SLAB_PAGE_SIZE / 16)
+#define PAGE_WORDS (PAGE_GRANULES / 64)
+#define PAGE_HEADER 16
+
+typedef struct HeapPage {
+  struct HeapPage* next;
+  uint8_t* base;
+  size_t cellSize;
+  bool large;
+  bool pinned;          // holds something the compiler made
+  bool unswept;         // marks are from the last cycle, garbage not freed
+  uint64_t live[PAGE_WORDS];
+  uint64_t marks[PAGE_WORDS];
+} HeapPage;
+
+typedef struct {
+  HeapPage* pages;
+  HeapPage* last;
+  HeapPage* current;    // pages before it have no free cells
+  int word;             // nor do the words before this one
+  uint64_t starts[PAGE_WORDS];  // where cells begin
+} ObjectClass;
+
+static ObjectClass objectClasses[SLAB_CLASSES];
+static HeapPage* largePages;
+
+typedef struct {
+  void* pointer;
+  size_t size;
+} Block;
+
+#ifdef CONCURRENT_GC
+// Objects the marker blackens before it checks for a waiting mutator.
+#define MARKER_BATCH 256
+#define SATB_BUFFER_SIZE 256
+
+// While the marker thread runs it owns the gray stack and reads old
+// objects as the mutator changes them. The mutator takes the lock to
+// move objects in a minor collection and to hand over what its barriers
+// shaded, and keeps any memory it frees until the marker has stopped.
+typedef struct {
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  bool running;
+  bool held;            // by the mutator
+  bool stop;
+  bool idle;            // nothing gray, nothing handed over
+  uint64_t cpuNanos;    // the thread's, once it stops
+  int waiting;          // mutator blocked on the lock
+  Obj** handoff;
+  int handoffCount;
+  int handoffCapacity;
+  Obj* satb[SATB_BUFFER_SIZE];  // shaded, not yet handed over
+  int satbCount;
+  Block* deferred;
+  int deferredCount;
+  int deferredCapacity;
+} Marker;
+
+static Marker marker = {
+  .lock = PTHREAD_MUTEX_INITIALIZER,
+  .wake = PTHREAD_COND_INITIALIZER
+};
+#endif
+
+static bool markingOnThread() {
+#ifdef CONCURRENT_GC
+  return marker.running;
+#else
+  return false;
+#endif
+}
+
+// What the pacer has seen of the program and the collector. A cycle runs
+// from the start of a mark to the end of its sweep; collector time is
+// charged to it or to the idle stretch before it, whichever was open.
+static struct {
+  uint64_t pauseStart;
+  uint64_t workStart;       // collector time before this is charged
+  uint64_t idleStart;       // when the last cycle ended
+  uint64_t idleWork;
+  uint64_t cycleStart;
+  uint64_t cycleWork;
+  uint64_t cyclePauseMax;
+  size_t heapBefore;        // when the mark opened
+  size_t live;              // after the last sweep
+  double allocationRate;    // bytes per nanosecond of mutator time
+  double markCost;          // collector nanoseconds per surviving byte
+  double survival;          // share of the heap a cycle keeps
+} pacer;
+
+static int sizeClass(size_t size) {
+  if (size <= 128) return (int)((size + 15) / 16) - 1;
+  return 8 + (int)((size - 129) / 32);
+}
+
+static size_t cellSize(int sizeClass) {
+  return sizeClass < 8 ? (size_t)(sizeClass + 1) * 16
+                       : 128 + (size_t)(sizeClass - 7) * 32;
+}
+
+static uint8_t* takePage() {
+  if (slabChunks.freeCount > 0) {
+    return slabChunks.free[--slabChunks.freeCount];
+  }
+  if (slabChunks.top == slabChunks.end) {
+    if (slabChunks.capacity < slabChunks.count + 1) {
+      slabChunks.capacity = GROW_CAPACITY(slabChunks.capacity);
+      slabChunks.chunks = (void**)realloc(
+          slabChunks.chunks, sizeof(void*) * slabChunks.capacity);
+      if (slabChunks.chunks == NULL) return NULL;
+    }
+    uint8_t* chunk = (uint8_t*)alignedAlloc(
+        SLAB_PAGE_SIZE, SLAB_PAGE_SIZE * SLAB_CHUNK_PAGES);
+    if (chunk == NULL) return NULL;
+    slabChunks.chunks[slabChunks.count++] = chunk;
+    slabChunks.top = chunk;
+    slabChunks.end = chunk + SLAB_PAGE_SIZE * SLAB_CHUNK_PAGES;
+  }
+  uint8_t* page = slabChunks.top;
+  slabChunks.top += SLAB_PAGE_SIZE;
+  return page;
+}
+
+// The list is kept apart from the pages so that their memory can go back
+// to the system while they wait: always after a compaction, and past a
+// chunk's worth of pages otherwise.
+static void givePage(uint8_t* page, bool release) {
+  if (slabChunks.freeCapacity < slabChunks.freeCount + 1) {
+    slabChunks.freeCapacity = GROW_CAPACITY(slabChunks.freeCapacity);
+    slabChunks.free = (uint8_t**)realloc(
+        slabChunks.free, sizeof(uint8_t*) * slabChunks.freeCapacity);
+    if (slabChunks.free == NULL) exit(1);
+  }
+  slabChunks.free[slabChunks.freeCount++] = page;
+#ifdef MADV_DONTNEED
+  if (release || slabChunks.freeCount > SLAB_CHUNK_PAGES) {
+    madvise(page, SLAB_PAGE_SIZE, MADV_DONTNEED);
+  }
+#else
+  (void)release;
+#endif
+}
+
+static bool addSlabPage(SizeClass* sizes, size_t size) {
+  SlabPage* page = (SlabPage*)takePage();
+  if (page == NULL) return false;
+  page->next = sizes->pages;
+  page->cellSize = size;
+  sizes->pages = page;
+  sizes->top = (uint8_t*)page + ALIGN16(sizeof(SlabPage));
+  sizes->end = (uint8_t*)page + SLAB_PAGE_SIZE;
+  return true;
+}
+
+static void* allocateBlock(size_t size) {
+  if (size > SLAB_MAX_SIZE) return malloc(size);
+
+  int index = sizeClass(size);
+  SizeClass* sizes = &sizeClasses[index];
+  if (sizes->free != NULL) {
+    void* block = sizes->free;
+    sizes->free = *(void**)block;
+    return block;
+  }
+  size = cellSize(index);
+  if ((size_t)(sizes->end - sizes->top) < size &&
+      !addSlabPage(sizes, size)) {
+    return NULL;
+  }
+  void* block = sizes->top;
+  sizes->top += size;
+  return block;
+}
 
+static void freeBlock(void* pointer, size_t size) {
+  if (size > SLAB_MAX_SIZE) {
+    free(pointer);
+    return;
+  }
+  SizeClass* sizes = &sizeClasses[sizeClass(size)];
+  *(void**)pointer = sizes->free;
+  sizes->free = pointer;
+}
+
+static void releaseBlock(void* pointer, size_t size) {
+  if (pointer == NULL) return;
+#ifdef CONCURRENT_GC
+  if (marker.running && !marker.held) {
+    if (marker.deferredCapacity < marker.deferredCount + 1) {
+      marker.deferredCapacity = GROW_CAPACITY(marker.deferredCapacity);
+      marker.deferred = (Block*)realloc(
+          marker.deferred, sizeof(Block) * marker.deferredCapacity);
+      if (marker.deferred == NULL) exit(1);
+    }
+    marker.deferred[marker.deferredCount++] = (Block){pointer, size};
+    return;
+  }
+#endif
+  freeBlock(pointer, size);
+}
+
+static int lowestBit(uint64_t bits) {
+#if defined(__GNUC__) || defined(__clang__)
+  return __builtin_ctzll(bits);
+#else
+  int bit = 0;
+  while ((bits & 1) == 0) {
+    bits >>= 1;
+    bit++;
+  }
+  return bit;
+#endif
+}
+
+static HeapPage* pageOf(Obj* object) {
+  return *(HeapPage**)((uintptr_t)object & ~(uintptr_t)(SLAB_PAGE_SIZE - 1));
+}
+
+static size_t granuleOf(HeapPage* page, Obj* object) {
+  return (size_t)((uint8_t*)object - page->base) / 16;
+}
+
+static HeapPage* newHeapPage(uint8_t* base, size_t size) {
+  HeapPage* page = (HeapPage*)calloc(1, sizeof(HeapPage));
+  if (base == NULL || page == NULL) exit(1);
+  *(HeapPage**)base = page;
+  page->base = base;
+  page->cellSize = size;
+  return page;
+}
+
+static HeapPage* addObjectPage(ObjectClass* objects, size_t size) {
+  if (objects->pages == NULL) {
+    for (size_t i = PAGE_HEADER / 16; i + size / 16 <= PAGE_GRANULES;
+         i += size / 16) {
+      objects->starts[i / 64] |= (uint64_t)1 << (i % 64);
+    }
+  }
+  HeapPage* page = newHeapPage(takePage(), size);
+  if (objects->last != NULL) {
+    objects->last->next = page;
+  } else {
+    objects->pages = page;
+  }
+  objects->last = page;
+  objects->current = page;
+  objects->word = 0;
+  return page;
+}
+
+static bool sweepPage(HeapPage* page);
+
+// Scans the class's pages from where it last stopped for a clear bit,
+// sweeping each page first if the last collection left it unswept.
+static HeapPage* findCell(int index, size_t* granule) {
+  ObjectClass* objects = &objectClasses[index];
+  HeapPage* page = objects->current;
+  while (page != NULL) {
+    if (page->unswept) {
+      sweepPage(page);
+      vm.gcPagesSwept++;
+      vm.gcPagesSweptOnAllocation++;
+    }
+    for (; objects->word < PAGE_WORDS; objects->word++) {
+      uint64_t free = objects->starts[objects->word] &
+                      ~page->live[objects->word];
+      if (free != 0) {
+        *granule = (size_t)objects->word * 64 + lowestBit(free);
+        return page;
+      }
+    }
+    page = page->next;
+    objects->current = page;
+    objects->word = 0;
+  }
+  *granule = PAGE_HEADER / 16;
+  return addObjectPage(objects, cellSize(index));
+}
+
+static void setMark(HeapPage* page, size_t granule) {
+  uint64_t bit = (uint64_t)1 << (granule % 64);
+#ifdef CONCURRENT_GC
+  // Old objects may be born marked while the marker sets other bits.
+  if (marker.running) {
+    __atomic_fetch_or(&page->marks[granule / 64], bit, __ATOMIC_RELAXED);
+    return;
+  }
+#endif
+  page->marks[granule / 64] |= bit;
+}
+
+bool isMarked(Obj* object) {
+  HeapPage* page = pageOf(object);
+  size_t granule = granuleOf(page, object);
+#ifdef CONCURRENT_GC
+  if (marker.running) {
+    return (__atomic_load_n(&page->marks[granule / 64], __ATOMIC_RELAXED) >>
+            (granule % 64)) & 1;
+  }
+#endif
+  return (page->marks[granule / 64] >> (granule % 64)) & 1;
+}
+
+// Old-space memory for an object, marked if a mark is open.
+void* allocateOld(size_t size) {
+  HeapPage* page;
+  size_t granule;
+  if (size > SLAB_MAX_SIZE) {
+    size_t pageSize = (PAGE_HEADER + size + SLAB_PAGE_SIZE - 1) &
+                      ~(size_t)(SLAB_PAGE_SIZE - 1);
+    page = newHeapPage(
+        (uint8_t*)alignedAlloc(SLAB_PAGE_SIZE, pageSize), size);
+    page->large = true;
+    page->next = largePages;
+    largePages = page;
+    granule = PAGE_HEADER / 16;
+  } else {
+    page = findCell(sizeClass(size), &granule);
+  }
+  page->live[granule / 64] |= (uint64_t)1 << (granule % 64);
+  if (vm.marking) setMark(page, granule);
+  if (vm.pretenure) page->pinned = true;
+
+  vm.bytesAllocated += page->cellSize;
+  if (vm.bytesAllocated > (vm.marking ? vm.gcMaxHeap : vm.nextGC)) {
+    vm.gcRequested = true;
+  }
+  return page->base + granule * 16;
+}
+
+// Counts every byte it hands out, and asks for a collection once the
+// count passes vm.nextGC. An open mark paces itself instead, short of
+// the hard cap.
 void* reallocate(void* pointer, size_t oldSize, size_t newSize) {
+  vm.bytesAllocated += newSize - oldSize;
+  if (newSize > oldSize &&
+      vm.bytesAllocated > (vm.marking ? vm.gcMaxHeap : vm.nextGC)) {
+    vm.gcRequested = true;
+  }
+
   if (newSize == 0) {
-    free(pointer);
+    releaseBlock(pointer, oldSize);
     return NULL;
   }
-  if (oldSize == 0) {
-    return malloc(newSize);
+  if (oldSize == 0) return allocateBlock(newSize);
+
+  if (oldSize <= SLAB_MAX_SIZE && newSize <= SLAB_MAX_SIZE &&
+      sizeClass(oldSize) == sizeClass(newSize)) {
+    return pointer;
+  }
+  // A marker may still be reading the old block, so it can't move.
+  if (oldSize > SLAB_MAX_SIZE && newSize > SLAB_MAX_SIZE &&
+      !markingOnThread()) {
+    return realloc(pointer, newSize);
   }
-  void* newPointer = malloc(newSize);
+  void* newPointer = allocateBlock(newSize);
   if (newPointer == NULL) {
     return NULL; // Out of memory
   }
-  memcpy(newPointer, pointer, oldSize);
-  free(pointer);
+  memcpy(newPointer, pointer, oldSize < newSize ? oldSize : newSize);
+  releaseBlock(pointer, oldSize);
   return newPointer;
 }
 
-void markObject(Obj* object) {
-  if (object == NULL) return;
-  if (object->isMarked) return;
+// While a mark or a sweep is open, the allocation limit stops short of
+// the block's end, so a step comes due every GC_MARK_STEP bytes.
+static void limitNursery(size_t size) {
+  vm.nurseryEnd = vm.nursery->end;
+  if (((vm.marking && !markingOnThread()) || vm.sweeping) &&
+      (size_t)(vm.nurseryEnd - vm.nurseryTop) > size + GC_MARK_STEP) {
+    vm.nurseryEnd = vm.nurseryTop + size + GC_MARK_STEP;
+  }
+}
 
-#ifdef DEBUG_LOG_GC
-  printf("%p mark ", (void*)object);
-  printValue(OBJ_VAL(object));
-  printf("\n");
-#endif
+static void addNurseryBlock() {
+  // The nursery is sized by its own limit, not counted in the heap.
+  NurseryBlock* block =
+      (NurseryBlock*)malloc(sizeof(NurseryBlock) + NURSERY_BLOCK_SIZE);
+  if (block == NULL) exit(1);
+  if (vm.nursery != NULL) {
+    vm.nursery->top = vm.nurseryTop;
+    vm.gcRequested = true;
+  }
+  block->next = vm.nursery;
+  block->top = block->data;
+  block->end = block->data + NURSERY_BLOCK_SIZE;
+  vm.nursery = block;
+  vm.nurseryTop = block->data;
+}
 
-  object->isMarked = true;
-  
+void* allocateYoung(size_t size) {
+  size = ALIGN(size);
+  if ((size_t)(vm.nurseryEnd - vm.nurseryTop) < size) {
+    if (vm.nursery != NULL &&
+        (size_t)(vm.nursery->end - vm.nurseryTop) >= size) {
+      vm.gcRequested = true;
+    } else {
+      addNurseryBlock();
+    }
+    limitNursery(size);
+  }
+  void* object = vm.nurseryTop;
+  vm.nurseryTop += size;
+  return object;
+}
+
+void rememberObject(Obj* object) {
+  if (object->isYoung || object->isRemembered) return;
+  object->isRemembered = true;
+  if (vm.rememberedCapacity < vm.rememberedCount + 1) {
+    int oldCapacity = vm.rememberedCapacity;
+    vm.rememberedCapacity = GROW_CAPACITY(oldCapacity);
+    vm.remembered = GROW_ARRAY(Obj*, vm.remembered, oldCapacity,
+                               vm.rememberedCapacity);
+  }
+  vm.remembered[vm.rememberedCount++] = object;
+}
+
+static void pushGray(Obj* object) {
   if (vm.grayCapacity < vm.grayCount + 1) {
     vm.grayCapacity = GROW_CAPACITY(vm.grayCapacity);
     vm.grayStack = (Obj**)realloc(vm.grayStack, sizeof(Obj*) * vm.grayCapacity);
@@ -48,6 +557,24 @@ void markObject(Obj* object) {
   vm.grayStack[vm.grayCount++] = object;
 }
 
+// Young objects are left alone: whatever survives the nursery during a
+// mark is marked as it's promoted.
+void markObject(Obj* object) {
+  if (object == NULL || object->isYoung) return;
+  HeapPage* page = pageOf(object);
+  size_t granule = granuleOf(page, object);
+  if ((page->marks[granule / 64] >> (granule % 64)) & 1) return;
+
+#ifdef DEBUG_LOG_GC
+  printf("%p mark ", (void*)object);
+  printValue(OBJ_VAL(object));
+  printf("\n");
+#endif
+
+  setMark(page, granule);
+  pushGray(object);
+}
+
 void markValue(Value value) {
   if (IS_OBJ(value)) markObject(AS_OBJ(value));
 }
@@ -76,6 +603,7 @@ static void blackenObject(Obj* object) {
       ObjClass* klass = (ObjClass*)object;
       markObject((Obj*)klass->name);
       markTable(&klass->methods);
+      markObject((Obj*)klass->rootShape);
       break;
     }
     case OBJ_CLOSURE: {
@@ -90,72 +618,133 @@ static void blackenObject(Obj* object) {
       ObjFunction* function = (ObjFunction*)object;
       markObject((Obj*)function->name);
       markArray(&function->chunk.constants);
+      for (int i = 0; i < function->chunk.cacheCount; i++) {
+        InlineCache* cache = &function->chunk.caches[i];
+        int count = ACQUIRE(cache->count);
+        for (int j = 0; j < count && j < INLINE_CACHE_WAYS; j++) {
+          markObject(cache->entries[j].shape);
+          markObject(cache->entries[j].target);
+        }
+      }
       break;
     }
     case OBJ_INSTANCE: {
       ObjInstance* instance = (ObjInstance*)object;
       markObject((Obj*)instance->klass);
+      // Slots are in place before the shape that counts them.
+      ObjShape* shape = ACQUIRE(instance->shape);
+      Value* slots = instance->slots;
+      if (shape != NULL && slots != NULL) {
+        markObject((Obj*)shape);
+        for (int i = 0; i < shape->fieldCount; i++) {
+          markValue(slots[i]);
+        }
+      }
       markTable(&instance->fields);
       break;
     }
+    case OBJ_SHAPE: {
+      ObjShape* shape = (ObjShape*)object;
+      markObject((Obj*)shape->parent);
+      markObject((Obj*)shape->name);
+      markTable(&shape->transitions);
+      break;
+    }
+    case OBJ_STRING: {
+      ObjString* string = (ObjString*)object;
+      markObject((Obj*)ACQUIRE(string->left));
+      markObject((Obj*)ACQUIRE(string->right));
+      break;
+    }
     case OBJ_UPVALUE:
       markValue(((ObjUpvalue*)object)->closed);
       break;
     case OBJ_NATIVE:
-    case OBJ_STRING:
       break;
   }
 }
 
-static void freeObject(Obj* object) {
-#ifdef DEBUG_LOG_GC
-  printf("%p free type %d\n", (void*)object, object->type);
-#endif
+static size_t objectSize(Obj* object) {
+  switch (object->type) {
+    case OBJ_BOUND_METHOD: return sizeof(ObjBoundMethod);
+    case OBJ_CLASS: return sizeof(ObjClass);
+    case OBJ_CLOSURE: return sizeof(ObjClosure);
+    case OBJ_FUNCTION: return sizeof(ObjFunction);
+    case OBJ_INSTANCE:
+      return sizeof(ObjInstance) +
+             sizeof(Value) * ((ObjInstance*)object)->inlineCapacity;
+    case OBJ_NATIVE: return sizeof(ObjNative);
+    case OBJ_SHAPE: return sizeof(ObjShape);
+    case OBJ_STRING: {
+      ObjString* string = (ObjString*)object;
+      if (string->chars != string->inlineChars) return sizeof(ObjString);
+      return sizeof(ObjString) + string->length + 1;
+    }
+    case OBJ_UPVALUE: return sizeof(ObjUpvalue);
+  }
+  return sizeof(Obj);
+}
 
+// Frees what an object owns out of line. A dead nursery object goes with
+// its block, so this is all a minor collection does for it.
+static void releaseObject(Obj* object) {
   switch (object->type) {
-    case OBJ_BOUND_METHOD:
-      FREE(ObjBoundMethod, object);
-      break;
-    case OBJ_CLASS: {
-      ObjClass* klass = (ObjClass*)object;
-      freeTable(&klass->methods);
-      FREE(ObjClass, object);
+    case OBJ_CLASS:
+      freeTable(&((ObjClass*)object)->methods);
       break;
-    }
     case OBJ_CLOSURE: {
       ObjClosure* closure = (ObjClosure*)object;
       FREE_ARRAY(ObjUpvalue*, closure->upvalues,
                  closure->upvalueCount);
-      FREE(ObjClosure, object);
       break;
     }
     case OBJ_FUNCTION: {
       ObjFunction* function = (ObjFunction*)object;
+#ifdef BASELINE_JIT
+      if (function->jit != NULL) freeJitCode(function->jit);
+      if (function->loopHits != NULL) {
+        FREE_ARRAY(int, function->loopHits, function->chunk.count);
+      }
+      freeTraces(function->traces);
+#endif
       freeChunk(&function->chunk);
-      FREE(ObjFunction, object);
       break;
     }
     case OBJ_INSTANCE: {
       ObjInstance* instance = (ObjInstance*)object;
+      if (instance->slots != instance->inlineSlots) {
+        FREE_ARRAY(Value, instance->slots, instance->slotCapacity);
+      }
       freeTable(&instance->fields);
-      FREE(ObjInstance, object);
       break;
     }
-    case OBJ_NATIVE:
-      FREE(ObjNative, object);
+    case OBJ_SHAPE:
+      freeTable(&((ObjShape*)object)->transitions);
       break;
     case OBJ_STRING: {
       ObjString* string = (ObjString*)object;
-      FREE_ARRAY(char, string->chars, string->length + 1);
-      FREE(ObjString, object);
+      if (string->chars != NULL && string->chars != string->inlineChars) {
+        FREE_ARRAY(char, string->chars, string->length + 1);
+      }
       break;
     }
+    case OBJ_BOUND_METHOD:
+    case OBJ_NATIVE:
     case OBJ_UPVALUE:
-      FREE(ObjUpvalue, object);
       break;
   }
 }
 
+// The cell itself is left to the caller to clear in the page's bitmap.
+static void freeObject(HeapPage* page, Obj* object) {
+#ifdef DEBUG_LOG_GC
+  printf("%p free type %d\n", (void*)object, object->type);
+#endif
+
+  releaseObject(object);
+  vm.bytesAllocated -= page->cellSize;
+}
+
 static void markRoots() {
   for (Value* slot = vm.stack; slot < vm.stackTop; slot++) {
     markValue(*slot);
@@ -171,7 +760,8 @@ static void markRoots() {
     markObject((Obj*)upvalue);
   }
 
-  markTable(&vm.globals);
+  markTable(&vm.globalSlots);
+  markArray(&vm.globalValues);
   markCompilerRoots();
   markObject((Obj*)vm.initString);
 }
@@ -183,57 +773,918 @@ static void traceReferences() {
   }
 }
 
-static void sweep() {
-  Obj* previous = NULL;
-  Obj* object = vm.objects;
-  while (object != NULL) {
-    if (object->isMarked) {
-      object->isMarked = false;
-      previous = object;
-      object = object->next;
+static uint64_t nowNanos() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
+}
+
+// Objects blackened between looks at the clock.
+#define MARK_CLOCK_INTERVAL 64
+
+// Returns true once nothing is left gray.
+static bool markSlice(uint64_t deadline) {
+  int work = 0;
+  while (vm.grayCount > 0) {
+    blackenObject(vm.grayStack[--vm.grayCount]);
+    if (++work % MARK_CLOCK_INTERVAL == 0 && nowNanos() >= deadline) break;
+  }
+  return vm.grayCount == 0;
+}
+
+#undef MARK_CLOCK_INTERVAL
+
+#ifdef CONCURRENT_GC
+static void* markerMain(void* unused) {
+  (void)unused;
+  pthread_mutex_lock(&marker.lock);
+  for (;;) {
+    while (__atomic_load_n(&marker.waiting, __ATOMIC_ACQUIRE) > 0) {
+      pthread_cond_wait(&marker.wake, &marker.lock);
+    }
+    if (marker.stop) break;
+
+    for (int i = 0; i < marker.handoffCount; i++) {
+      markObject(marker.handoff[i]);
+    }
+    marker.handoffCount = 0;
+    if (vm.grayCount == 0) {
+      __atomic_store_n(&marker.idle, true, __ATOMIC_RELEASE);
+      __atomic_store_n(&vm.gcRequested, true, __ATOMIC_RELAXED);
+      pthread_cond_wait(&marker.wake, &marker.lock);
+      continue;
+    }
+    for (int i = 0; i < MARKER_BATCH && vm.grayCount > 0; i++) {
+      blackenObject(vm.grayStack[--vm.grayCount]);
+    }
+  }
+  struct timespec cpu;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu);
+  marker.cpuNanos = (uint64_t)cpu.tv_sec * 1000000000u +
+                    (uint64_t)cpu.tv_nsec;
+  pthread_mutex_unlock(&marker.lock);
+  return NULL;
+}
+
+// The marker gives way between batches to a mutator waiting here.
+static void lockMarker() {
+  __atomic_add_fetch(&marker.waiting, 1, __ATOMIC_ACQ_REL);
+  pthread_mutex_lock(&marker.lock);
+  __atomic_sub_fetch(&marker.waiting, 1, __ATOMIC_ACQ_REL);
+  marker.held = true;
+}
+
+static void unlockMarker() {
+  marker.held = false;
+  pthread_cond_signal(&marker.wake);
+  pthread_mutex_unlock(&marker.lock);
+}
+
+static void flushSatb() {
+  lockMarker();
+  if (marker.handoffCapacity < marker.handoffCount + marker.satbCount) {
+    marker.handoffCapacity = marker.handoffCount + SATB_BUFFER_SIZE * 4;
+    marker.handoff = (Obj**)realloc(marker.handoff,
+                                    sizeof(Obj*) * marker.handoffCapacity);
+    if (marker.handoff == NULL) exit(1);
+  }
+  memcpy(marker.handoff + marker.handoffCount, marker.satb,
+         sizeof(Obj*) * marker.satbCount);
+  marker.handoffCount += marker.satbCount;
+  marker.satbCount = 0;
+  __atomic_store_n(&marker.idle, false, __ATOMIC_RELEASE);
+  unlockMarker();
+}
+
+// Falls back to marking in slices if no thread can be had.
+static void startMarker() {
+  marker.stop = false;
+  marker.idle = false;
+  // Set first, since the marker reads it too.
+  marker.running = true;
+  if (pthread_create(&marker.thread, NULL, markerMain, NULL) != 0) {
+    marker.running = false;
+  }
+}
+
+// Whatever the marker left undone goes back on the gray stack, and the
+// memory kept from it can go.
+static void stopMarker() {
+  lockMarker();
+  marker.stop = true;
+  unlockMarker();
+  pthread_join(marker.thread, NULL);
+  marker.running = false;
+  pacer.cycleWork += marker.cpuNanos;
+
+  for (int i = 0; i < marker.handoffCount; i++) {
+    markObject(marker.handoff[i]);
+  }
+  marker.handoffCount = 0;
+  for (int i = 0; i < marker.satbCount; i++) markObject(marker.satb[i]);
+  marker.satbCount = 0;
+  for (int i = 0; i < marker.deferredCount; i++) {
+    freeBlock(marker.deferred[i].pointer, marker.deferred[i].size);
+  }
+  marker.deferredCount = 0;
+}
+#endif
+
+// Marks an object the mutator unlinked or revived during a mark.
+void shadeObject(Obj* object) {
+  if (object->isYoung || isMarked(object)) return;
+#ifdef CONCURRENT_GC
+  if (marker.running) {
+    marker.satb[marker.satbCount++] = object;
+    if (marker.satbCount == SATB_BUFFER_SIZE) flushSatb();
+    return;
+  }
+#endif
+  markObject(object);
+}
+
+// Nothing is left to trace but what the final pause will drain.
+static bool markDrained() {
+#ifdef CONCURRENT_GC
+  if (marker.running) {
+    return __atomic_load_n(&marker.idle, __ATOMIC_ACQUIRE) &&
+           marker.satbCount == 0;
+  }
+#endif
+  return vm.grayCount == 0;
+}
+
+// Frees the objects whose cells are live but unmarked, and clears the
+// marks for the next cycle. Returns true if nothing on the page is left.
+static bool sweepPage(HeapPage* page) {
+  uint64_t left = 0;
+  size_t freed = 0;
+  for (int i = 0; i < PAGE_WORDS; i++) {
+    uint64_t dead = page->live[i] & ~page->marks[i];
+    while (dead != 0) {
+      int bit = lowestBit(dead);
+      dead &= dead - 1;
+      freeObject(page, (Obj*)(page->base + ((size_t)i * 64 + bit) * 16));
+      freed += page->cellSize;
+    }
+    page->live[i] &= page->marks[i];
+    page->marks[i] = 0;
+    left |= page->live[i];
+  }
+  page->unswept = false;
+
+  // The budget set at the end of the mark counted this garbage as gone.
+  if (vm.sweepPending >= freed) vm.sweepPending -= freed;
+  if (vm.nextGC >= freed) vm.nextGC -= freed;
+  return left == 0;
+}
+
+// Sweeping is lazy. The end of a mark only flags the size-class pages;
+// the allocator sweeps each before taking a cell from it, and sweepSlice
+// works through the rest at safepoints, giving empty pages back to be
+// reused by any size class. Large objects are few and swept at once.
+static struct {
+  int sizeClass;
+  HeapPage* previous;   // the last page kept, in that class's list
+} sweeper;
+
+static void beginSweep() {
+  size_t garbage = 0;
+  for (int i = 0; i < SLAB_CLASSES; i++) {
+    ObjectClass* objects = &objectClasses[i];
+    for (HeapPage* page = objects->pages; page != NULL; page = page->next) {
+      page->unswept = true;
+      for (int word = 0; word < PAGE_WORDS; word++) {
+        uint64_t dead = page->live[word] & ~page->marks[word];
+        for (; dead != 0; dead &= dead - 1) garbage += page->cellSize;
+      }
+    }
+    objects->current = objects->pages;
+    objects->word = 0;
+  }
+  sweeper.sizeClass = 0;
+  sweeper.previous = NULL;
+  vm.sweepPending = garbage;
+  vm.sweeping = true;
+
+  HeapPage** link = &largePages;
+  while (*link != NULL) {
+    HeapPage* page = *link;
+    if (sweepPage(page)) {
+      *link = page->next;
+      alignedFree(page->base);
+      free(page);
     } else {
-      Obj* unreached = object;
-      object = object->next;
+      link = &page->next;
+    }
+  }
+}
+
+// Objects swept between looks at the clock.
+#define SWEEP_CLOCK_INTERVAL 16
+
+// Returns true once every page is swept.
+static bool sweepSlice(uint64_t deadline) {
+  int work = 0;
+  while (sweeper.sizeClass < SLAB_CLASSES) {
+    ObjectClass* objects = &objectClasses[sweeper.sizeClass];
+    HeapPage* previous = sweeper.previous;
+    HeapPage* page = previous != NULL ? previous->next : objects->pages;
+    if (page == NULL) {
+      sweeper.sizeClass++;
+      sweeper.previous = NULL;
+      continue;
+    }
+    if (!page->unswept) {
+      sweeper.previous = page;
+      continue;
+    }
+
+    vm.gcPagesSwept++;
+    if (sweepPage(page)) {
       if (previous != NULL) {
-        previous->next = object;
+        previous->next = page->next;
       } else {
-        vm.objects = object;
+        objects->pages = page->next;
       }
+      if (objects->last == page) objects->last = previous;
+      if (objects->current == page) {
+        objects->current = page->next;
+        objects->word = 0;
+      }
+      givePage(page->base, false);
+      free(page);
+    } else {
+      sweeper.previous = page;
+    }
+    if (++work % SWEEP_CLOCK_INTERVAL == 0 && nowNanos() >= deadline) {
+      return false;
+    }
+  }
+  vm.sweeping = false;
+  vm.sweepPending = 0;
+  return true;
+}
+
+#undef SWEEP_CLOCK_INTERVAL
 
-      freeObject(unreached);
+// Minor collection. Survivors are copied into the old space and left
+// behind as forwarding pointers; the copies wait on the gray stack until
+// their own references have been forwarded in turn.
+
+// Copies an object and leaves a forwarding pointer behind.
+static void moveObject(Obj* object, Obj* copy, size_t size) {
+  memcpy(copy, object, size);
+  copy->isYoung = false;
+
+  // The only pointers into an object's own body.
+  if (object->type == OBJ_INSTANCE) {
+    ObjInstance* instance = (ObjInstance*)object;
+    if (instance->slots == instance->inlineSlots) {
+      ((ObjInstance*)copy)->slots = ((ObjInstance*)copy)->inlineSlots;
+    }
+  } else if (object->type == OBJ_UPVALUE) {
+    ObjUpvalue* upvalue = (ObjUpvalue*)object;
+    if (upvalue->location == &upvalue->closed) {
+      ((ObjUpvalue*)copy)->location = &((ObjUpvalue*)copy)->closed;
+    }
+  } else if (object->type == OBJ_STRING) {
+    ObjString* string = (ObjString*)object;
+    if (string->chars == string->inlineChars) {
+      ((ObjString*)copy)->chars = ((ObjString*)copy)->inlineChars;
     }
   }
+  object->forward = copy;
 }
 
-void collectGarbage() {
+static Obj* promote(Obj* object) {
+  size_t size = objectSize(object);
+  Obj* copy = (Obj*)allocateOld(size);
+  moveObject(object, copy, size);
+  pushGray(copy);
+  return copy;
+}
+
+// Old objects have a forwarding pointer only while a compaction runs.
+Obj* forwardObject(Obj* object) {
+  if (object == NULL) return object;
+  if (object->forward != NULL) return object->forward;
+  if (!object->isYoung) return object;
+  return promote(object);
+}
+
+void forwardValue(Value* value) {
+  if (IS_OBJ(*value)) *value = OBJ_VAL(forwardObject(AS_OBJ(*value)));
+}
+
+#define FORWARD(field) ((field) = (void*)forwardObject((Obj*)(field)))
+
+static void forwardArray(ValueArray* array) {
+  for (int i = 0; i < array->count; i++) {
+    forwardValue(&array->values[i]);
+  }
+}
+
+// Points an old object's references at the copies of whatever they
+// reached in the nursery.
+static void scanObject(Obj* object) {
+  switch (object->type) {
+    case OBJ_BOUND_METHOD: {
+      ObjBoundMethod* bound = (ObjBoundMethod*)object;
+      forwardValue(&bound->receiver);
+      FORWARD(bound->method);
+      break;
+    }
+    case OBJ_CLASS: {
+      ObjClass* klass = (ObjClass*)object;
+      FORWARD(klass->name);
+      forwardTable(&klass->methods);
+      FORWARD(klass->rootShape);
+      break;
+    }
+    case OBJ_CLOSURE: {
+      ObjClosure* closure = (ObjClosure*)object;
+      FORWARD(closure->function);
+      for (int i = 0; i < closure->upvalueCount; i++) {
+        FORWARD(closure->upvalues[i]);
+      }
+      break;
+    }
+    case OBJ_FUNCTION: {
+      ObjFunction* function = (ObjFunction*)object;
+      FORWARD(function->name);
+      forwardArray(&function->chunk.constants);
+      for (int i = 0; i < function->chunk.cacheCount; i++) {
+        InlineCache* cache = &function->chunk.caches[i];
+        for (int j = 0; j < cache->count && j < INLINE_CACHE_WAYS; j++) {
+          FORWARD(cache->entries[j].shape);
+          FORWARD(cache->entries[j].target);
+        }
+      }
+      break;
+    }
+    case OBJ_INSTANCE: {
+      ObjInstance* instance = (ObjInstance*)object;
+      FORWARD(instance->klass);
+      if (instance->shape != NULL) {
+        FORWARD(instance->shape);
+        for (int i = 0; i < instance->shape->fieldCount; i++) {
+          forwardValue(&instance->slots[i]);
+        }
+      }
+      forwardTable(&instance->fields);
+      break;
+    }
+    case OBJ_SHAPE: {
+      ObjShape* shape = (ObjShape*)object;
+      FORWARD(shape->parent);
+      FORWARD(shape->name);
+      forwardTable(&shape->transitions);
+      break;
+    }
+    case OBJ_STRING: {
+      ObjString* string = (ObjString*)object;
+      FORWARD(string->left);
+      FORWARD(string->right);
+      break;
+    }
+    case OBJ_UPVALUE:
+      forwardValue(&((ObjUpvalue*)object)->closed);
+      break;
+    case OBJ_NATIVE:
+      break;
+  }
+}
+
+// The compiler's roots are left out: nothing is collected while it runs,
+// and what it allocates goes straight to the old space.
+static void forwardRoots() {
+  for (Value* slot = vm.stack; slot < vm.stackTop; slot++) {
+    forwardValue(slot);
+  }
+
+  for (int i = 0; i < vm.frameCount; i++) {
+    FORWARD(vm.frames[i].closure);
+  }
+
+  for (ObjUpvalue** upvalue = &vm.openUpvalues;
+       *upvalue != NULL;
+       upvalue = &(*upvalue)->next) {
+    FORWARD(*upvalue);
+  }
+
+  forwardTable(&vm.globalSlots);
+  forwardArray(&vm.globalValues);
+  FORWARD(vm.initString);
+}
+
+// Dead young objects still own their out-of-line storage.
+static void releaseNursery() {
+  for (NurseryBlock* block = vm.nursery; block != NULL; block = block->next) {
+    uint8_t* top = block == vm.nursery ? vm.nurseryTop : block->top;
+    for (uint8_t* p = block->data; p < top;) {
+      Obj* object = (Obj*)p;
+      p += ALIGN(objectSize(object));
+      if (object->forward == NULL) releaseObject(object);
+    }
+  }
+}
+
+// Keeps the newest block for the next round of allocation.
+static void resetNursery() {
+  if (vm.nursery == NULL) return;
+  NurseryBlock* block = vm.nursery->next;
+  while (block != NULL) {
+    NurseryBlock* next = block->next;
+    free(block);
+    block = next;
+  }
+  vm.nursery->next = NULL;
+  vm.nurseryTop = vm.nursery->data;
+  limitNursery(0);
+}
+
+void collectYoung() {
+  if (vm.nursery == NULL ||
+      (vm.nurseryTop == vm.nursery->data && vm.nursery->next == NULL)) {
+    return;
+  }
 #ifdef DEBUG_LOG_GC
-  printf("-- gc begin\n");
+  printf("-- minor gc begin\n");
   size_t before = vm.bytesAllocated;
 #endif
 
+#ifdef CONCURRENT_GC
+  if (marker.running) lockMarker();
+#endif
+  // An open mark keeps its gray objects below base.
+  int base = vm.grayCount;
+  forwardRoots();
+  for (int i = 0; i < vm.rememberedCount; i++) {
+    vm.remembered[i]->isRemembered = false;
+    scanObject(vm.remembered[i]);
+  }
+  vm.rememberedCount = 0;
+  while (vm.grayCount > base) {
+    scanObject(vm.grayStack[--vm.grayCount]);
+  }
+
+  stringSetRemoveYoung(&vm.strings);
+  releaseNursery();
+  resetNursery();
+#ifdef CONCURRENT_GC
+  if (marker.running) unlockMarker();
+#endif
+
+#ifdef DEBUG_LOG_GC
+  printf("-- minor gc end\n");
+  printf("   promoted %zu bytes\n", vm.bytesAllocated - before);
+#endif
+}
+
+#undef FORWARD
+
+// Compaction, for an old space left full of holes: the sparsest pages of
+// each size class are emptied into the free cells of its fuller ones,
+// every reference is forwarded as in a minor collection, and the empty
+// pages go back to the pool. Pages holding what the compiler made stay
+// put, since compiled code embeds the addresses of constants.
+#define COMPACT_MIN_BYTES (1024 * 1024)
+
+typedef struct {
+  HeapPage* page;
+  int live;
+} PageUse;
+
+static int countBits(uint64_t bits) {
+#if defined(__GNUC__) || defined(__clang__)
+  return __builtin_popcountll(bits);
+#else
+  int count = 0;
+  for (; bits != 0; bits &= bits - 1) count++;
+  return count;
+#endif
+}
+
+static int liveCells(HeapPage* page) {
+  int count = 0;
+  for (int i = 0; i < PAGE_WORDS; i++) count += countBits(page->live[i]);
+  return count;
+}
+
+static int cellsPerPage(size_t size) {
+  return (int)((SLAB_PAGE_SIZE - PAGE_HEADER) / size);
+}
+
+static int compareUse(const void* a, const void* b) {
+  return ((const PageUse*)a)->live - ((const PageUse*)b)->live;
+}
+
+// Share of the size-class pages' bytes that hold no object, in percent.
+static int fragmentation() {
+  size_t pageBytes = 0;
+  size_t usedBytes = 0;
+  for (int i = 0; i < SLAB_CLASSES; i++) {
+    for (HeapPage* page = objectClasses[i].pages; page != NULL;
+         page = page->next) {
+      pageBytes += SLAB_PAGE_SIZE;
+      usedBytes += liveCells(page) * page->cellSize;
+    }
+  }
+  if (pageBytes < COMPACT_MIN_BYTES) return 0;
+  return (int)((pageBytes - usedBytes) * 100 / pageBytes);
+}
+
+// Picks the pages to empty, sparsest first, while the rest of the class
+// has room for what they hold. They come off the class's page list.
+static HeapPage* evacuationPages(ObjectClass* objects, int cells) {
+  int count = 0;
+  for (HeapPage* page = objects->pages; page != NULL; page = page->next) {
+    count++;
+  }
+  PageUse* uses = (PageUse*)malloc(sizeof(PageUse) * (count + 1));
+  if (uses == NULL) return NULL;
+  int freeCells = 0;
+  count = 0;
+  for (HeapPage* page = objects->pages; page != NULL; page = page->next) {
+    uses[count].page = page;
+    uses[count].live = liveCells(page);
+    freeCells += cells - uses[count].live;
+    count++;
+  }
+  qsort(uses, count, sizeof(PageUse), compareUse);
+
+  HeapPage* evacuated = NULL;
+  int moving = 0;
+  for (int i = 0; i < count && uses[i].live < cells / 2; i++) {
+    HeapPage* page = uses[i].page;
+    if (page->pinned) continue;
+    int room = freeCells - (cells - uses[i].live);
+    if (moving + uses[i].live > room) break;
+    freeCells = room;
+    moving += uses[i].live;
+
+    HeapPage** link = &objects->pages;
+    while (*link != page) link = &(*link)->next;
+    *link = page->next;
+    page->next = evacuated;
+    evacuated = page;
+  }
+  free(uses);
+
+  objects->last = NULL;
+  for (HeapPage* page = objects->pages; page != NULL; page = page->next) {
+    objects->last = page;
+  }
+  objects->current = objects->pages;
+  objects->word = 0;
+  return evacuated;
+}
+
+static void compact() {
+  collectYoung();
+
+  HeapPage* evacuated[SLAB_CLASSES];
+  size_t moved = 0;
+  for (int i = 0; i < SLAB_CLASSES; i++) {
+    evacuated[i] = evacuationPages(&objectClasses[i],
+                                   cellsPerPage(cellSize(i)));
+    for (HeapPage* page = evacuated[i]; page != NULL; page = page->next) {
+      for (int word = 0; word < PAGE_WORDS; word++) {
+        for (uint64_t bits = page->live[word]; bits != 0; bits &= bits - 1) {
+          Obj* object = (Obj*)(page->base +
+              ((size_t)word * 64 + lowestBit(bits)) * 16);
+          size_t granule;
+          HeapPage* target = findCell(i, &granule);
+          target->live[granule / 64] |= (uint64_t)1 << (granule % 64);
+          moveObject(object, (Obj*)(target->base + granule * 16),
+                     page->cellSize);
+          moved += page->cellSize;
+        }
+      }
+    }
+  }
+
+  forwardRoots();
+  forwardStringSet(&vm.strings);
+  for (int i = 0; i < SLAB_CLASSES; i++) {
+    for (HeapPage* page = objectClasses[i].pages; page != NULL;
+         page = page->next) {
+      for (int word = 0; word < PAGE_WORDS; word++) {
+        for (uint64_t bits = page->live[word]; bits != 0; bits &= bits - 1) {
+          scanObject((Obj*)(page->base +
+              ((size_t)word * 64 + lowestBit(bits)) * 16));
+        }
+      }
+    }
+  }
+  for (HeapPage* page = largePages; page != NULL; page = page->next) {
+    scanObject((Obj*)(page->base + PAGE_HEADER));
+  }
+
+  for (int i = 0; i < SLAB_CLASSES; i++) {
+    while (evacuated[i] != NULL) {
+      HeapPage* page = evacuated[i];
+      evacuated[i] = page->next;
+      givePage(page->base, true);
+      free(page);
+    }
+  }
+  vm.gcCompactions++;
+  vm.gcBytesMoved += moved;
+}
+
+// The pacer sets the heap size at which the next mark opens. A cycle
+// costs about the same per surviving byte each time, so from the last
+// few it knows that cost, the share of the heap that survives, and how
+// fast the program fills the heap between cycles. Growing the heap to g
+// times what survived gives the program (g - 1) * live / rate to run, and
+// the next cycle about cost * survival * g * live of work; the collector
+// takes vm.gcCpuPercent of the time when g = 1 / (1 - a), for
+// a = rate * cost * survival * (100 - percent) / percent.
+#define GC_MIN_GROWTH 1.25
+#define GC_MAX_GROWTH 4.0
+
+static double blend(double average, double sample) {
+  return average == 0 ? sample : (average + sample) / 2;
+}
+
+static void chargeWork(bool toCycle) {
+  uint64_t now = nowNanos();
+  if (toCycle) {
+    pacer.cycleWork += now - pacer.workStart;
+  } else {
+    pacer.idleWork += now - pacer.workStart;
+  }
+  pacer.workStart = now;
+}
+
+static size_t paceHeap(size_t live) {
+  double growth = 2.0;  // until a cycle has been timed
+  if (pacer.markCost > 0 && pacer.allocationRate > 0) {
+    double share = vm.gcCpuPercent / 100.0;
+    double a = pacer.allocationRate * pacer.markCost * pacer.survival *
+               (1 - share) / share;
+    growth = a < 1 ? 1 / (1 - a) : GC_MAX_GROWTH;
+  }
+  if (growth < GC_MIN_GROWTH) growth = GC_MIN_GROWTH;
+  if (growth > GC_MAX_GROWTH) growth = GC_MAX_GROWTH;
+
+  double next = (double)live * growth;
+  if (next < (double)vm.gcMinHeap) next = (double)vm.gcMinHeap;
+  if (next > (double)vm.gcMaxHeap) next = (double)vm.gcMaxHeap;
+  return (size_t)next;
+}
+
+static void beginCycle() {
+  chargeWork(false);
+  uint64_t mutator = pacer.workStart - pacer.idleStart - pacer.idleWork;
+  if (vm.bytesAllocated > pacer.live && mutator > 0) {
+    pacer.allocationRate = blend(pacer.allocationRate,
+        (double)(vm.bytesAllocated - pacer.live) / (double)mutator);
+  }
+  pacer.cycleStart = pacer.workStart;
+  pacer.cycleWork = 0;
+  pacer.cyclePauseMax = 0;
+  pacer.heapBefore = vm.bytesAllocated;
+}
+
+static void endCycle() {
+  chargeWork(true);
+  size_t live = vm.bytesAllocated;
+  if (live > 0) {
+    pacer.markCost = blend(pacer.markCost,
+                           (double)pacer.cycleWork / (double)live);
+  }
+  if (pacer.heapBefore > 0) {
+    pacer.survival = blend(pacer.survival,
+                           (double)live / (double)pacer.heapBefore);
+  }
+  pacer.live = live;
+  vm.nextGC = paceHeap(live);
+  vm.gcCycles++;
+
+  if (vm.gcLog) {
+    uint64_t pause = pacer.workStart - pacer.pauseStart;
+    if (pause < pacer.cyclePauseMax) pause = pacer.cyclePauseMax;
+    fprintf(stderr, "gc %zu: heap %zu KB -> %zu KB, %.2f ms, "
+            "collector %.2f ms, max pause %.3f ms, next at %zu KB\n",
+            vm.gcCycles, pacer.heapBefore / 1024, live / 1024,
+            (pacer.workStart - pacer.cycleStart) / 1e6,
+            pacer.cycleWork / 1e6, pause / 1e6, vm.nextGC / 1024);
+  }
+  pacer.idleStart = pacer.workStart;
+  pacer.idleWork = 0;
+}
+
+// With the garbage gone the budget is exact again, and the holes it
+// left can be measured.
+static void finishSweep() {
+  if (vm.gcCompactPercent > 0 && fragmentation() > vm.gcCompactPercent) {
+    compact();
+  }
+  endCycle();
+  if (vm.nursery != NULL) limitNursery(0);
+
+#ifdef DEBUG_LOG_GC
+  printf("-- sweep end\n");
+  printf("   heap %zu next at %zu\n", vm.bytesAllocated, vm.nextGC);
+#endif
+}
+
+// A new mark can't open until the last one's garbage is swept.
+static void startMark() {
+  if (vm.sweeping && sweepSlice(UINT64_MAX)) finishSweep();
+  beginCycle();
+#ifdef DEBUG_LOG_GC
+  printf("-- gc begin\n");
+#endif
+
   markRoots();
+  vm.marking = true;
+#ifdef CONCURRENT_GC
+  if (vm.concurrentGc) startMarker();
+#endif
+  if (vm.nursery != NULL) limitNursery(0);
+}
+
+static void finishMark() {
+#ifdef CONCURRENT_GC
+  if (marker.running) stopMarker();
+#endif
   traceReferences();
-  tableRemoveWhite(&vm.strings);
-  sweep();
+  stringSetRemoveWhite(&vm.strings);
 
-  vm.nextGC = vm.bytesAllocated * GC_HEAP_GROW_FACTOR;
+  vm.marking = false;
+  beginSweep();
+  // Budgeted from what survived; the garbage still counted in the heap
+  // is taken off again as it's swept.
+  vm.nextGC = paceHeap(vm.bytesAllocated - vm.sweepPending) +
+              vm.sweepPending;
+  if (vm.nursery != NULL) limitNursery(0);
 
 #ifdef DEBUG_LOG_GC
   printf("-- gc end\n");
-  printf("   collected %zu bytes (from %zu to %zu) next at %zu\n",
-         before - vm.bytesAllocated, before, vm.bytesAllocated,
-         vm.nextGC);
+  printf("   %zu bytes to sweep, heap %zu next at %zu\n",
+         vm.sweepPending, vm.bytesAllocated, vm.nextGC);
+#endif
+}
+
+static void recordPause(uint64_t nanos) {
+  if (vm.marking || vm.sweeping) {
+    chargeWork(true);
+    if (nanos > pacer.cyclePauseMax) pacer.cyclePauseMax = nanos;
+  } else {
+    chargeWork(false);
+  }
+
+  uint64_t micros = nanos / 1000;
+  int bucket = 0;
+  while (bucket < GC_PAUSE_BUCKETS - 1 && micros >= ((uint64_t)1 << bucket)) {
+    bucket++;
+  }
+  vm.gcPauses[bucket]++;
+  vm.gcPauseCount++;
+  vm.gcPauseTotal += nanos;
+  if (nanos > vm.gcPauseMax) vm.gcPauseMax = nanos;
+}
+
+// Collections only start here: the interpreter has written its frame
+// back, and no C code up the stack holds an object across the call, so
+// every reference the collector moves is one it can update.
+// Over the cap nothing waits: the open cycle, or a new one, runs to the
+// end in this pause, and if that doesn't bring the heap under, the
+// program can't go on.
+static void enforceHeapCap() {
+  collectGarbage();
+  if (sweepSlice(UINT64_MAX)) finishSweep();
+  if (vm.bytesAllocated > vm.gcMaxHeap) {
+    fprintf(stderr, "Heap limit of %zu bytes exceeded.\n", vm.gcMaxHeap);
+    exit(1);
+  }
+}
+
+void gcSafepoint() {
+  uint64_t start = nowNanos();
+  pacer.pauseStart = start;
+  pacer.workStart = start;
+  if (pacer.idleStart == 0) pacer.idleStart = start;
+  vm.gcRequested = false;
+#ifdef DEBUG_STRESS_GC
+  collectGarbage();
+#else
+  if (vm.bytesAllocated > vm.gcMaxHeap) {
+    enforceHeapCap();
+    recordPause(nowNanos() - start);
+    return;
+  }
+  // Marking steps come due before the nursery is full; the minor
+  // collection waits for that unless the mark is ready to finish.
+  bool finishing = vm.marking && markDrained();
+  if (finishing || (!vm.marking && !vm.sweeping) ||
+      (vm.nursery != NULL && vm.nursery->next != NULL)) {
+    collectYoung();
+  }
+  // Past the budget by as much again, the mark is losing to promotion.
+  size_t room = vm.nextGC > pacer.live ? vm.nextGC - pacer.live : vm.nextGC;
+  bool behind = vm.bytesAllocated > vm.nextGC + room;
+  uint64_t deadline = start + (uint64_t)vm.gcPauseTarget * 1000;
+  if (vm.sweeping) {
+    // Past the budget, a new mark is waiting on the sweep.
+    if (vm.bytesAllocated > vm.nextGC) deadline = UINT64_MAX;
+    if (sweepSlice(deadline)) finishSweep();
+  } else if (finishing) {
+    finishMark();
+  } else {
+    if (!vm.marking && vm.bytesAllocated > vm.nextGC) startMark();
+    if (markingOnThread()) {
+#ifdef CONCURRENT_GC
+      if (behind) {
+        finishMark();
+      } else if (marker.satbCount > 0) {
+        flushSatb();
+      }
 #endif
+    } else if (vm.marking) {
+      if (behind) deadline = UINT64_MAX;
+      // Finishing gets a pause of its own, at the next safepoint.
+      if (markSlice(deadline)) vm.gcRequested = true;
+    }
+  }
+#endif
+  recordPause(nowNanos() - start);
+}
+
+// A full collection, finishing any open mark at once. The nursery is
+// emptied first, so marking and sweeping only ever see the old space.
+void collectGarbage() {
+  collectYoung();
+  if (!vm.marking) startMark();
+  finishMark();
+}
+
+void printGcStats() {
+  if (vm.gcPagesSwept > 0) {
+    fprintf(stderr, "gc: %zu pages swept, %zu by the allocator\n",
+            vm.gcPagesSwept, vm.gcPagesSweptOnAllocation);
+  }
+  if (vm.gcCompactions > 0) {
+    fprintf(stderr, "gc: %zu compactions, %zu bytes moved\n",
+            vm.gcCompactions, vm.gcBytesMoved);
+  }
+  if (vm.gcPauseCount == 0) {
+    fprintf(stderr, "gc: no pauses\n");
+    return;
+  }
+  fprintf(stderr, "gc: %zu pauses, mean %.1f us, max %.1f us, target %d us\n",
+          vm.gcPauseCount, vm.gcPauseTotal / 1000.0 / vm.gcPauseCount,
+          vm.gcPauseMax / 1000.0, vm.gcPauseTarget);
+  for (int i = 0; i < GC_PAUSE_BUCKETS; i++) {
+    if (vm.gcPauses[i] == 0) continue;
+    if (i == GC_PAUSE_BUCKETS - 1) {
+      fprintf(stderr, "  >= %8llu us: %zu\n",
+              1ull << (i - 1), vm.gcPauses[i]);
+    } else {
+      fprintf(stderr, "   < %8llu us: %zu\n", 1ull << i, vm.gcPauses[i]);
+    }
+  }
 }
 
 void freeObjects() {
-  Obj* object = vm.objects;
-  while (object != NULL) {
-    Obj* next = object->next;
-    freeObject(object);
-    object = next;
+#ifdef CONCURRENT_GC
+  if (marker.running) stopMarker();
+  free(marker.handoff);
+  free(marker.deferred);
+#endif
+  vm.marking = false;
+  // With no marks left, a sweep frees everything.
+  for (int i = 0; i < SLAB_CLASSES; i++) {
+    for (HeapPage* page = objectClasses[i].pages; page != NULL;
+         page = page->next) {
+      memset(page->marks, 0, sizeof(page->marks));
+    }
   }
+  for (HeapPage* page = largePages; page != NULL; page = page->next) {
+    memset(page->marks, 0, sizeof(page->marks));
+  }
+  beginSweep();
+  sweepSlice(UINT64_MAX);
 
+  releaseNursery();
+  resetNursery();
+  free(vm.nursery);
+  vm.nursery = NULL;
+  FREE_ARRAY(Obj*, vm.remembered, vm.rememberedCapacity);
   free(vm.grayStack);
+
+  // The stack and frames freed after this are too big for a slab.
+  for (int i = 0; i < slabChunks.count; i++) {
+    alignedFree(slabChunks.chunks[i]);
+  }
+  free(slabChunks.chunks);
+  free(slabChunks.free);
+  memset(&slabChunks, 0, sizeof(slabChunks));
+  memset(sizeClasses, 0, sizeof(sizeClasses));
+  memset(objectClasses, 0, sizeof(objectClasses));
 }
 
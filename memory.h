@@ -2,6 +2,7 @@
 #define clox_memory_h
 #include "common.h"
 #include "object.h"
+#include "vm.h"
 
 #define ALLOCATE(type, count) \
     (type*)reallocate(NULL, 0, sizeof(type) * (count))
@@ -17,9 +18,55 @@
 #define FREE_ARRAY(type, pointer, oldCount) \
     reallocate(pointer, sizeof(type) * (oldCount), 0)
     
+// Fields a background marker reads while the mutator changes them: what a
+// new value refers to is written before it's published.
+#ifdef CONCURRENT_GC
+#define PUBLISH(field, value) \
+    __atomic_store_n(&(field), (value), __ATOMIC_RELEASE)
+#define ACQUIRE(field) __atomic_load_n(&(field), __ATOMIC_ACQUIRE)
+#else
+#define PUBLISH(field, value) ((field) = (value))
+#define ACQUIRE(field) (field)
+#endif
+
+// Payload of each nursery block. Every object but a long string fits in
+// one many times over; longer strings start out old.
+#define NURSERY_BLOCK_SIZE (256 * 1024)
+#define NURSERY_MAX_OBJECT (NURSERY_BLOCK_SIZE / 8)
+// Nursery bytes allocated between incremental marking steps.
+#define GC_MARK_STEP (32 * 1024)
+
 void* reallocate(void* pointer, size_t oldSize, size_t newSize);
+void* allocateYoung(size_t size);
+void* allocateOld(size_t size);
+bool isMarked(Obj* object);
+void rememberObject(Obj* object);
 void markObject(Obj* object);
 void markValue(Value value);
+Obj* forwardObject(Obj* object);
+void forwardValue(Value* value);
+void collectYoung();
 void collectGarbage();
+void gcSafepoint();
+void shadeObject(Obj* object);
+void printGcStats();
 void freeObjects();
+
+// Every store of a reference into an existing heap object goes through
+// here, so a minor collection finds the old objects that point into the
+// nursery without scanning the old space.
+static inline void writeBarrier(Obj* owner, Value value) {
+  if (!owner->isYoung && IS_OBJ(value) && AS_OBJ(value)->isYoung) {
+    rememberObject(owner);
+  }
+}
+
+// And every overwrite of one, before the store. Marking traces the heap
+// as it was when the mark opened; what the mutator unlinks since then is
+// shaded here, so marking finds it whatever order it visits objects in.
+static inline void snapshotBarrier(Obj* owner, Value overwritten) {
+  if (vm.marking && !owner->isYoung && IS_OBJ(overwritten)) {
+    shadeObject(AS_OBJ(overwritten));
+  }
+}
 #endif
@@ -1,4 +1,5 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include "memory.h"
 #include "object.h"
@@ -9,12 +10,26 @@
 #define ALLOCATE_OBJ(type, objectType) \
     (type*)allocateObject(sizeof(type), objectType)
 
+// New objects go in the nursery, except while vm.pretenure is set: what
+// the compiler and initVM create lives for the whole run anyway. Long
+// strings go there too, as they may not fit in a nursery block.
 static Obj* allocateObject(size_t size, ObjType type) {
-  Obj* object = (Obj*)reallocate(NULL, 0, size);
+  Obj* object;
+  bool old = vm.pretenure ||
+             (type == OBJ_STRING && size > NURSERY_MAX_OBJECT);
+  // Allocated black: a mark only traces what was there when it opened.
+  if (old) {
+    object = (Obj*)allocateOld(size);
+  } else {
+    object = (Obj*)allocateYoung(size);
+  }
   object->type = type;
-  object->isMarked = false; 
-  object->next = vm.objects;
-  vm.objects = object;
+  object->forward = NULL;
+  object->isYoung = !old;
+  object->isRemembered = false;
+#ifdef DEBUG_STRESS_GC
+  vm.gcRequested = true;
+#endif
   #ifdef DEBUG_LOG_GC
     printf("%p allocate %zu for %d\n", (void*)object, size, type);
   #endif
@@ -32,6 +47,12 @@ ObjClass* newClass(ObjString* name) {
   ObjClass* klass = ALLOCATE_OBJ(ObjClass, OBJ_CLASS);
   klass->name = name;
   initTable(&klass->methods);
+  klass->rootShape = NULL;
+  klass->shapeCount = 1;
+  klass->fieldHint = 0;
+  push(OBJ_VAL(klass));
+  klass->rootShape = newShape(NULL, NULL);
+  pop();
   return klass;
 }
 
@@ -63,62 +84,339 @@ ObjFunction* newFunction() {
     ObjFunction* function = ALLOCATE_OBJ(ObjFunction, OBJ_FUNCTION);
     function->arity = 0;
     function->upvalueCount = 0;
+    function->maxStack = 0;
+    function->hotness = 0;
+    function->jit = NULL;
+    function->loopHits = NULL;
+    function->traces = NULL;
     function->name = NULL;
     initChunk(&function->chunk);
     printf("New function created: %p\n", (void*)function);
     return function;
 }
 
+// Sized from the class's fieldHint, so once a class has been seen its
+// instances are one allocation with every field inline.
 ObjInstance* newInstance(ObjClass* klass) {
-  ObjInstance* instance = ALLOCATE_OBJ(ObjInstance, OBJ_INSTANCE);
+  int capacity = klass->fieldHint;
+  ObjInstance* instance = (ObjInstance*)allocateObject(
+      sizeof(ObjInstance) + sizeof(Value) * capacity, OBJ_INSTANCE);
   instance->klass = klass;
+  instance->shape = klass->rootShape;
+  instance->slots = instance->inlineSlots;
+  instance->slotCapacity = capacity;
+  instance->inlineCapacity = capacity;
   initTable(&instance->fields);
   return instance;
 }
 
+ObjShape* newShape(ObjShape* parent, ObjString* name) {
+  ObjShape* shape = ALLOCATE_OBJ(ObjShape, OBJ_SHAPE);
+  shape->parent = parent;
+  shape->name = name;
+  shape->fieldCount = parent == NULL ? 0 : parent->fieldCount + 1;
+  initTable(&shape->transitions);
+  return shape;
+}
+
+int shapeSlot(ObjShape* shape, ObjString* name) {
+  for (; shape->name != NULL; shape = shape->parent) {
+    if (shape->name == name) return shape->fieldCount - 1;
+  }
+  return -1;
+}
+
+// Returns NULL when the class has run out of shape budget, either from
+// too many fields or from fields arriving in too many different orders.
+static ObjShape* shapeTransition(ObjClass* klass, ObjShape* shape,
+                                 ObjString* name) {
+  Value next;
+  if (tableGet(&shape->transitions, name, &next)) {
+    return (ObjShape*)AS_OBJ(next);
+  }
+  if (shape->fieldCount >= SHAPE_MAX_FIELDS ||
+      klass->shapeCount >= SHAPE_MAX_PER_CLASS) {
+    return NULL;
+  }
+  ObjShape* child = newShape(shape, name);
+  push(OBJ_VAL(child));
+  writeBarrier(&shape->obj, OBJ_VAL(child));
+  writeBarrier(&shape->obj, OBJ_VAL(name));
+  tableSet(&shape->transitions, name, OBJ_VAL(child));
+  pop();
+  klass->shapeCount++;
+  return child;
+}
+
+// The slots may already have been passed over by a mark that finds the
+// table empty, so their values count as overwritten.
+static void toDictionary(ObjInstance* instance) {
+  for (ObjShape* shape = instance->shape; shape->name != NULL;
+       shape = shape->parent) {
+    Value value = instance->slots[shape->fieldCount - 1];
+    snapshotBarrier(&instance->obj, value);
+    tableSet(&instance->fields, shape->name, value);
+  }
+  if (instance->slots != instance->inlineSlots) {
+    FREE_ARRAY(Value, instance->slots, instance->slotCapacity);
+  }
+  instance->slots = NULL;
+  instance->slotCapacity = 0;
+  PUBLISH(instance->shape, NULL);
+}
+
+bool instanceGetField(ObjInstance* instance, ObjString* name, Value* value) {
+  if (instance->shape == NULL) {
+    return tableGet(&instance->fields, name, value);
+  }
+  int slot = shapeSlot(instance->shape, name);
+  if (slot < 0) return false;
+  *value = instance->slots[slot];
+  return true;
+}
+
+void instanceSetField(ObjInstance* instance, ObjString* name, Value value) {
+  writeBarrier(&instance->obj, value);
+  if (instance->shape != NULL) {
+    int slot = shapeSlot(instance->shape, name);
+    if (slot >= 0) {
+      snapshotBarrier(&instance->obj, instance->slots[slot]);
+      instance->slots[slot] = value;
+      return;
+    }
+
+    ObjClass* klass = instance->klass;
+    ObjShape* next = shapeTransition(klass, instance->shape, name);
+    if (next != NULL) {
+      if (next->fieldCount > instance->slotCapacity) {
+        int oldCapacity = instance->slotCapacity;
+        int capacity = oldCapacity < 4 ? 4 : oldCapacity * 2;
+        if (instance->slots == instance->inlineSlots) {
+          Value* slots = ALLOCATE(Value, capacity);
+          memcpy(slots, instance->inlineSlots, sizeof(Value) * oldCapacity);
+          instance->slots = slots;
+        } else {
+          instance->slots = GROW_ARRAY(Value, instance->slots, oldCapacity,
+                                       capacity);
+        }
+        instance->slotCapacity = capacity;
+      }
+      instance->slots[next->fieldCount - 1] = value;
+      writeBarrier(&instance->obj, OBJ_VAL(next));
+      PUBLISH(instance->shape, next);
+      if (next->fieldCount > klass->fieldHint) {
+        klass->fieldHint = next->fieldCount;
+      }
+      return;
+    }
+    toDictionary(instance);
+  }
+  writeBarrier(&instance->obj, OBJ_VAL(name));
+  Value previous;
+  if (tableGet(&instance->fields, name, &previous)) {
+    snapshotBarrier(&instance->obj, previous);
+  }
+  tableSet(&instance->fields, name, value);
+}
+
 ObjNative* newNative(NativeFn function) {
   ObjNative* native = ALLOCATE_OBJ(ObjNative, OBJ_NATIVE);
   native->function = function;
   return native;
 }
 
-static ObjString* allocateString(char* chars, int length, uint32_t hash) {
-  ObjString* string = ALLOCATE_OBJ(ObjString, OBJ_STRING);
+// Characters live right after the header, in one allocation.
+static ObjString* allocateString(int length) {
+  ObjString* string = (ObjString*)allocateObject(
+      sizeof(ObjString) + length + 1, OBJ_STRING);
   string->length = length;
-  string->chars = chars;
-  string->hash = hash;
+  string->hash = 0;
+  string->chars = string->inlineChars;
   string->type = TOKEN_NIL;
-  tableSet(&vm.strings, string, NIL_VAL);
+  string->left = NULL;
+  string->right = NULL;
+  string->chars[length] = '\0';
   return string;
 }
 
-static uint32_t hashString(const char* key, int length) {
-  uint32_t hash = 2166136261u;
-  for (int i = 0; i < length; i++) {
-    hash ^= (uint8_t)key[i];
-    hash *= 16777619;
+// A wyhash-style hash: eight bytes per multiply, folded through the
+// high and low halves of a 128-bit product.
+static const uint64_t hashSecret[4] = {
+  0xa0761d6478bd642full, 0xe7037ed1a0b428dbull,
+  0x8ebc6af09c88c6e3ull, 0x589965cc75374cc3ull
+};
+
+static inline uint64_t hashMix(uint64_t a, uint64_t b) {
+#ifdef __SIZEOF_INT128__
+  __uint128_t product = (__uint128_t)a * b;
+  return (uint64_t)product ^ (uint64_t)(product >> 64);
+#else
+  uint64_t high = (a >> 32) * (b >> 32);
+  uint64_t middle = (a >> 32) * (uint32_t)b + (uint32_t)a * (b >> 32);
+  uint64_t low = (uint64_t)(uint32_t)a * (uint32_t)b;
+  return (low + (middle << 32)) ^ (high + (middle >> 32));
+#endif
+}
+
+static inline uint64_t read64(const char* p) {
+  uint64_t value;
+  memcpy(&value, p, 8);
+  return value;
+}
+
+static inline uint64_t read32(const char* p) {
+  uint32_t value;
+  memcpy(&value, p, 4);
+  return value;
+}
+
+// Never 0, which marks a string whose hash isn't known yet.
+uint32_t hashString(const char* key, int length) {
+  const char* p = key;
+  uint64_t seed = hashSecret[0] ^ hashMix(hashSecret[0], hashSecret[1]);
+  uint64_t a, b;
+  if (length <= 16) {
+    if (length >= 4) {
+      // Two overlapping pairs of 4-byte reads cover 4 to 16 bytes.
+      int middle = (length >> 3) << 2;
+      a = (read32(p) << 32) | read32(p + middle);
+      b = (read32(p + length - 4) << 32) | read32(p + length - 4 - middle);
+    } else if (length > 0) {
+      a = ((uint64_t)(uint8_t)p[0] << 16) |
+          ((uint64_t)(uint8_t)p[length >> 1] << 8) | (uint8_t)p[length - 1];
+      b = 0;
+    } else {
+      a = b = 0;
+    }
+  } else {
+    int left = length;
+    while (left > 16) {
+      seed = hashMix(read64(p) ^ hashSecret[1], read64(p + 8) ^ seed);
+      p += 16;
+      left -= 16;
+    }
+    a = read64(p + left - 16);
+    b = read64(p + left - 8);
   }
-  return hash;
+  uint64_t hash = hashMix(hashSecret[1] ^ (uint64_t)length,
+                          hashMix(a ^ hashSecret[1], b ^ seed));
+  uint32_t folded = (uint32_t)hash ^ (uint32_t)(hash >> 32);
+  return folded != 0 ? folded : 1;
 }
 
-ObjString* takeString(char* chars, int length) {
+// Computed on first use for strings that aren't interned.
+uint32_t stringHash(ObjString* string) {
+  if (string->hash == 0) {
+    flattenString(string);
+    string->hash = hashString(string->chars, string->length);
+  }
+  return string->hash;
+}
+
+ObjString* startString(int length) {
+  return allocateString(length);
+}
+
+// Interns: the compiler and natives' names come through here, so every
+// identifier, property name and string constant is in vm.strings.
+ObjString* copyString(const char* chars, int length) {
   uint32_t hash = hashString(chars, length);
-  ObjString* interned = tableFindString(&vm.strings, chars, length, hash);
+  ObjString* interned = stringSetFind(&vm.strings, chars, length, hash);
   if (interned != NULL) {
-    FREE_ARRAY(char, chars, length + 1);
+    // The set holds strings weakly: one that was garbage when the mark
+    // opened is found here and live again.
+    if (vm.marking) shadeObject(&interned->obj);
     return interned;
   }
-  return allocateString(chars, length, hash);
+  ObjString* string = allocateString(length);
+  memcpy(string->chars, chars, length);
+  string->hash = hash;
+  stringSetAdd(&vm.strings, string);
+  return string;
 }
 
-ObjString* copyString(const char* chars, int length) {
-  uint32_t hash = hashString(chars, length);
-  ObjString* interned = tableFindString(&vm.strings, chars, length, hash);
-  if (interned != NULL) return interned;
-  char* heapChars = ALLOCATE(char, length + 1);
-  memcpy(heapChars, chars, length);
-  heapChars[length] = '\0';
-  return allocateString(heapChars, length, hash);
+ObjString* newRope(ObjString* left, ObjString* right) {
+  ObjString* rope = ALLOCATE_OBJ(ObjString, OBJ_STRING);
+  rope->length = left->length + right->length;
+  rope->chars = NULL;
+  rope->hash = 0;
+  rope->type = TOKEN_NIL;
+  rope->left = left;
+  rope->right = right;
+  return rope;
+}
+
+// A rope half still waiting to be copied, and where its characters go.
+typedef struct {
+  ObjString* rope;
+  char* dest;
+} RopeWork;
+
+// Walks down whichever half is still a rope, so the ropes a loop builds
+// by appending (or prepending) need no work list. A node with two rope
+// halves leaves its right half on a heap-allocated list rather than the
+// C stack, since ropes like (c + "x") + s nest one such node per
+// iteration. The list is malloc'd so that flattening never starts a
+// collection.
+static void writeChars(ObjString* string, char* dest) {
+  RopeWork* work = NULL;
+  int count = 0;
+  int capacity = 0;
+  for (;;) {
+    while (string->chars == NULL) {
+      ObjString* left = string->left;
+      ObjString* right = string->right;
+      if (right->chars != NULL) {
+        memcpy(dest + left->length, right->chars, right->length);
+      } else if (left->chars != NULL) {
+        memcpy(dest, left->chars, left->length);
+        dest += left->length;
+        string = right;
+        continue;
+      } else {
+        if (capacity < count + 1) {
+          capacity = GROW_CAPACITY(capacity);
+          work = (RopeWork*)realloc(work, sizeof(RopeWork) * capacity);
+          if (work == NULL) exit(1);
+        }
+        work[count].rope = right;
+        work[count].dest = dest + left->length;
+        count++;
+      }
+      string = left;
+    }
+    memcpy(dest, string->chars, string->length);
+    if (count == 0) break;
+    count--;
+    string = work[count].rope;
+    dest = work[count].dest;
+  }
+  free(work);
+}
+
+void flattenString(ObjString* string) {
+  if (string->chars != NULL) return;
+  char* chars = ALLOCATE(char, string->length + 1);
+  writeChars(string, chars);
+  chars[string->length] = '\0';
+  string->chars = chars;
+  // The halves were reachable when the mark opened.
+  snapshotBarrier(&string->obj, OBJ_VAL(string->left));
+  snapshotBarrier(&string->obj, OBJ_VAL(string->right));
+  PUBLISH(string->left, NULL);
+  PUBLISH(string->right, NULL);
+}
+
+// Only names and constants are interned, so strings made at run time
+// compare their characters. Lengths, and hashes when both are already
+// known, rule most unequal pairs out first.
+bool stringsEqual(ObjString* a, ObjString* b) {
+  if (a == b) return true;
+  if (a->length != b->length) return false;
+  if (a->hash != 0 && b->hash != 0 && a->hash != b->hash) return false;
+  flattenString(a);
+  flattenString(b);
+  return memcmp(a->chars, b->chars, a->length) == 0;
 }
 
 ObjUpvalue* newUpvalue(Value* slot) {
@@ -159,7 +457,11 @@ void printObject(Value value) {
     case OBJ_NATIVE:
       printf("<native fn>");
       break;
+    case OBJ_SHAPE:
+      printf("<shape %d>", ((ObjShape*)AS_OBJ(value))->fieldCount);
+      break;
     case OBJ_STRING:
+      flattenString(AS_STRING(value));
       printf("%s", AS_CSTRING(value));
       break;
     case OBJ_UPVALUE:
@@ -30,20 +30,30 @@ typedef enum {
   OBJ_FUNCTION,
   OBJ_INSTANCE,
   OBJ_NATIVE,
+  OBJ_SHAPE,
   OBJ_STRING,
   OBJ_UPVALUE
 } ObjType;
 
 struct Obj {
   ObjType type;
-  bool isMarked;
-  struct Obj* next;
+  bool isYoung;        // still in the nursery
+  bool isRemembered;   // old, and in vm.remembered
+  struct Obj* forward; // young objects: the copy, once copied out
 };
 
+typedef struct JitCode JitCode;
+typedef struct Trace Trace;
+
 typedef struct {
   Obj obj;
   int arity;
   int upvalueCount;
+  int maxStack;        // deepest the stack gets above the frame's slots
+  int hotness;         // interpreter entries, counted while JIT is on
+  JitCode* jit;        // native code, once hot enough
+  int* loopHits;       // back edges per loop header, while tracing
+  Trace* traces;       // compiled hot loops
   Chunk chunk;
   ObjString* name;
   ValueType returnType;
@@ -56,12 +66,22 @@ typedef struct {
   NativeFn function;
 } ObjNative;
 
+// Concatenations at least this long build a rope instead of copying.
+#define ROPE_MIN_LENGTH 64
+
+// A rope is a concatenation not yet copied out: chars is NULL and left
+// and right hold the halves. It's flattened in place into a buffer of its
+// own. Every other string keeps its characters inline. hash is 0 until
+// something needs it; interned strings always have theirs.
 struct ObjString{
   Obj obj;
   int length;
-  char* chars;
   uint32_t hash;
+  char* chars;         // inlineChars, or a flattened rope's buffer
+  struct ObjString* left;
+  struct ObjString* right;
   TokenType type;
+  char inlineChars[];
 };
 
 typedef struct ObjUpvalue {
@@ -79,16 +99,38 @@ typedef struct {
   int upvalueCount;
 } ObjClosure;
 
+#define SHAPE_MAX_FIELDS    64
+#define SHAPE_MAX_PER_CLASS 64
+
+// A hidden class: the ordered set of fields an instance has, shared by
+// every instance of the class that gained the same fields in the same
+// order. Each shape adds one field, at slot fieldCount - 1, to its parent.
+typedef struct ObjShape {
+  Obj obj;
+  struct ObjShape* parent;
+  ObjString* name;     // field this shape adds, NULL for the root
+  int fieldCount;
+  Table transitions;   // next field name -> child shape
+} ObjShape;
+
 typedef struct {
   Obj obj;
   ObjString* name;
   Table methods;
+  ObjShape* rootShape;
+  int shapeCount;
+  int fieldHint;       // most fields any instance has needed so far
 } ObjClass;
 
 typedef struct {
   Obj obj;
   ObjClass* klass;
-  Table fields; // [fields]
+  ObjShape* shape;     // NULL once the instance is in dictionary mode
+  Value* slots;        // field values, indexed by shape slot
+  int slotCapacity;
+  int inlineCapacity;
+  Table fields;        // dictionary mode only
+  Value inlineSlots[]; // slots points here until it outgrows them
 } ObjInstance;
 
 typedef struct {
@@ -103,8 +145,19 @@ ObjClosure* newClosure(ObjFunction* function);
 ObjFunction* newFunction();
 ObjInstance* newInstance(ObjClass* klass);
 ObjNative* newNative(NativeFn function);
-ObjString* takeString(char* chars, int length);
+ObjShape* newShape(ObjShape* parent, ObjString* name);
+int shapeSlot(ObjShape* shape, ObjString* name);
+bool instanceGetField(ObjInstance* instance, ObjString* name, Value* value);
+void instanceSetField(ObjInstance* instance, ObjString* name, Value value);
+// A string built in place: fill the length chars startString leaves
+// room for. It isn't interned, and its hash waits until it's needed.
+ObjString* startString(int length);
 ObjString* copyString(const char* chars, int length);
+ObjString* newRope(ObjString* left, ObjString* right);
+uint32_t hashString(const char* key, int length);
+uint32_t stringHash(ObjString* string);
+void flattenString(ObjString* string);
+bool stringsEqual(ObjString* a, ObjString* b);
 ObjUpvalue* newUpvalue(Value* slot);
 void printObject(Value value);
 
@@ -0,0 +1,307 @@
+#include <stdlib.h>
+#include "chunk.h"
+#include "memory.h"
+#include "optimize.h"
+
+// Peephole pass over a finished chunk. The single-pass compiler emits the
+// same few sequences over and over (local increments, loop conditions,
+// binary ops on two locals); this folds them into superinstructions so a
+// tight loop pays for far fewer dispatches. Since fusing shrinks the code,
+// every jump is re-threaded through an old->new offset map afterwards.
+
+static bool isJump(uint8_t instruction) {
+  switch (instruction) {
+    case OP_JUMP:
+    case OP_JUMP_IF_FALSE:
+    case OP_LOOP:
+    case OP_LESS_JUMP_IF_FALSE:
+    case OP_GREATER_JUMP_IF_FALSE:
+    case OP_LESS_INT_JUMP_IF_FALSE:
+    case OP_GREATER_INT_JUMP_IF_FALSE:
+      return true;
+    default:
+      return false;
+  }
+}
+
+static int jumpTarget(uint8_t* code, int offset) {
+  uint16_t jump = (uint16_t)((code[offset + 1] << 8) | code[offset + 2]);
+  if (code[offset] == OP_LOOP) return offset + 3 - jump;
+  return offset + 3 + jump;
+}
+
+static uint8_t fusedCompareJump(uint8_t instruction) {
+  switch (instruction) {
+    case OP_LESS: return OP_LESS_JUMP_IF_FALSE;
+    case OP_GREATER: return OP_GREATER_JUMP_IF_FALSE;
+    case OP_LESS_INT: return OP_LESS_INT_JUMP_IF_FALSE;
+    case OP_GREATER_INT: return OP_GREATER_INT_JUMP_IF_FALSE;
+    default: return OP_RUNTIME_ERROR;
+  }
+}
+
+static bool isUnconditional(uint8_t instruction) {
+  return instruction == OP_JUMP || instruction == OP_LOOP ||
+         instruction == OP_RETURN;
+}
+
+// OP_GET_LOCAL a, OP_CONSTANT_INT k, OP_ADD_INT, OP_SET_LOCAL a, OP_POP
+static bool matchIncLocal(uint8_t* code, int* targets, int count, int offset) {
+  if (offset + 8 > count) return false;
+  if (code[offset] != OP_GET_LOCAL ||
+      code[offset + 2] != OP_CONSTANT_INT ||
+      code[offset + 4] != OP_ADD_INT ||
+      code[offset + 5] != OP_SET_LOCAL ||
+      code[offset + 7] != OP_POP) {
+    return false;
+  }
+  if (code[offset + 1] != code[offset + 6]) return false;
+  return targets[offset + 2] == 0 && targets[offset + 4] == 0 &&
+         targets[offset + 5] == 0 && targets[offset + 7] == 0;
+}
+
+// A comparison, OP_JUMP_IF_FALSE, OP_POP where the jump lands on an
+// OP_POP that nothing else reaches. Both pops can then go: the fused
+// instruction consumes the operands and never materializes the bool.
+static bool matchCompareJump(uint8_t* code, int* targets, int* previous,
+                             int count, int offset) {
+  if (offset + 5 > count) return false;
+  if (fusedCompareJump(code[offset]) == OP_RUNTIME_ERROR) return false;
+  if (code[offset + 1] != OP_JUMP_IF_FALSE || code[offset + 4] != OP_POP) {
+    return false;
+  }
+  if (targets[offset + 1] != 0 || targets[offset + 4] != 0) return false;
+
+  int exit = jumpTarget(code, offset + 1);
+  if (exit >= count || code[exit] != OP_POP || targets[exit] != 1) {
+    return false;
+  }
+  return previous[exit] >= 0 && isUnconditional(code[previous[exit]]);
+}
+
+void optimizeChunk(Chunk* chunk) {
+  int count = chunk->count;
+  if (count == 0) return;
+  uint8_t* code = chunk->code;
+
+  int* targets = ALLOCATE(int, count + 1);
+  int* previous = ALLOCATE(int, count + 1);
+  bool* removed = ALLOCATE(bool, count + 1);
+  bool* fuseJump = ALLOCATE(bool, count + 1);
+  for (int i = 0; i <= count; i++) {
+    targets[i] = 0;
+    previous[i] = -1;
+    removed[i] = false;
+    fuseJump[i] = false;
+  }
+
+  int last = -1;
+  for (int offset = 0; offset < count;
+       offset += instructionLength(chunk, offset)) {
+    previous[offset] = last;
+    last = offset;
+    if (isJump(code[offset])) targets[jumpTarget(code, offset)]++;
+  }
+
+  // Decide the compare-and-branch fusions up front, since each one deletes
+  // an OP_POP further down the chunk.
+  for (int offset = 0; offset < count;
+       offset += instructionLength(chunk, offset)) {
+    if (matchCompareJump(code, targets, previous, count, offset)) {
+      fuseJump[offset] = true;
+      removed[jumpTarget(code, offset + 1)] = true;
+    }
+  }
+
+  uint8_t* newCode = ALLOCATE(uint8_t, chunk->capacity);
+  int* newLines = ALLOCATE(int, chunk->capacity);
+  int* map = ALLOCATE(int, count + 1);
+  int* pendingTarget = ALLOCATE(int, count);
+  int length = 0;
+
+#define EMIT(byte, line) \
+    do { newCode[length] = (byte); newLines[length] = (line); length++; } while (false)
+
+  for (int offset = 0; offset < count;) {
+    int size = instructionLength(chunk, offset);
+    int line = chunk->lines[offset];
+    map[offset] = length;
+
+    if (removed[offset]) {
+      offset += size;
+      continue;
+    }
+
+    if (matchIncLocal(code, targets, count, offset)) {
+      EMIT(OP_INC_LOCAL_INT, line);
+      EMIT(code[offset + 1], line);
+      EMIT(code[offset + 3], line);
+      offset += 8;
+      continue;
+    }
+
+    if (fuseJump[offset]) {
+      pendingTarget[length] = jumpTarget(code, offset + 1);
+      EMIT(fusedCompareJump(code[offset]), line);
+      EMIT(0xff, line);
+      EMIT(0xff, line);
+      offset += 5;
+      continue;
+    }
+
+    if (code[offset] == OP_GET_LOCAL && offset + 4 <= count &&
+        code[offset + 2] == OP_GET_LOCAL && targets[offset + 2] == 0 &&
+        !matchIncLocal(code, targets, count, offset + 2)) {
+      EMIT(OP_GET_LOCAL_GET_LOCAL, line);
+      EMIT(code[offset + 1], line);
+      EMIT(code[offset + 3], line);
+      offset += 4;
+      continue;
+    }
+
+    if (isJump(code[offset])) pendingTarget[length] = jumpTarget(code, offset);
+    for (int i = 0; i < size; i++) {
+      EMIT(code[offset + i], chunk->lines[offset + i]);
+    }
+    offset += size;
+  }
+  map[count] = length;
+
+#undef EMIT
+
+  FREE_ARRAY(uint8_t, code, chunk->capacity);
+  FREE_ARRAY(int, chunk->lines, chunk->capacity);
+  chunk->code = newCode;
+  chunk->lines = newLines;
+  chunk->count = length;
+
+  for (int offset = 0; offset < length;
+       offset += instructionLength(chunk, offset)) {
+    uint8_t instruction = newCode[offset];
+    if (!isJump(instruction)) continue;
+    int target = map[pendingTarget[offset]];
+    int jump = instruction == OP_LOOP ? offset + 3 - target
+                                      : target - (offset + 3);
+    newCode[offset + 1] = (jump >> 8) & 0xff;
+    newCode[offset + 2] = jump & 0xff;
+  }
+
+  FREE_ARRAY(int, targets, count + 1);
+  FREE_ARRAY(int, previous, count + 1);
+  FREE_ARRAY(bool, removed, count + 1);
+  FREE_ARRAY(bool, fuseJump, count + 1);
+  FREE_ARRAY(int, map, count + 1);
+  FREE_ARRAY(int, pendingTarget, count);
+}
+
+// Net number of values an instruction leaves on the stack.
+static int stackEffect(uint8_t* code, int offset) {
+  switch (code[offset]) {
+    case OP_CONSTANT:
+    case OP_CONSTANT_INT:
+    case OP_CONSTANT_FLOAT:
+    case OP_CONSTANT_STRING:
+    case OP_NIL:
+    case OP_TRUE:
+    case OP_FALSE:
+    case OP_GET_LOCAL:
+    case OP_GET_GLOBAL_SLOT:
+    case OP_GET_UPVALUE:
+    case OP_CLOSURE:
+    case OP_CLASS:
+      return 1;
+    case OP_GET_LOCAL_GET_LOCAL:
+      return 2;
+    case OP_POP:
+    case OP_DEFINE_GLOBAL_SLOT:
+    case OP_SET_PROPERTY:
+    case OP_GET_SUPER:
+    case OP_EQUAL:
+    case OP_GREATER:
+    case OP_LESS:
+    case OP_GREATER_INT:
+    case OP_LESS_INT:
+    case OP_GREATER_FLOAT:
+    case OP_LESS_FLOAT:
+    case OP_ADD:
+    case OP_SUBTRACT:
+    case OP_MULTIPLY:
+    case OP_DIVIDE:
+    case OP_ADD_INT:
+    case OP_SUBTRACT_INT:
+    case OP_MULTIPLY_INT:
+    case OP_DIVIDE_INT:
+    case OP_ADD_FLOAT:
+    case OP_SUBTRACT_FLOAT:
+    case OP_MULTIPLY_FLOAT:
+    case OP_DIVIDE_FLOAT:
+    case OP_PRINT:
+    case OP_CLOSE_UPVALUE:
+    case OP_INHERIT:
+    case OP_METHOD:
+      return -1;
+    case OP_LESS_JUMP_IF_FALSE:
+    case OP_GREATER_JUMP_IF_FALSE:
+    case OP_LESS_INT_JUMP_IF_FALSE:
+    case OP_GREATER_INT_JUMP_IF_FALSE:
+      return -2;
+    case OP_CALL:
+    case OP_TAIL_CALL:
+      return -code[offset + 1];
+    case OP_INVOKE:
+      return -code[offset + 2];
+    case OP_SUPER_INVOKE:
+      return -code[offset + 2] - 1;
+    default:
+      return 0;
+  }
+}
+
+static bool endsBlock(uint8_t instruction) {
+  return instruction == OP_JUMP || instruction == OP_LOOP ||
+         instruction == OP_RETURN || instruction == OP_TYPE_ERROR ||
+         instruction == OP_RUNTIME_ERROR;
+}
+
+// Walks every path through the chunk to find the most stack slots a call
+// can use, counting the callee and its arguments. The VM checks this once
+// per call instead of bounds-checking every push.
+int maxStackDepth(Chunk* chunk, int arity) {
+  int count = chunk->count;
+  if (count == 0) return arity + 1;
+  uint8_t* code = chunk->code;
+
+  int* depth = ALLOCATE(int, count);
+  int* worklist = ALLOCATE(int, count);
+  for (int i = 0; i < count; i++) depth[i] = -1;
+  int pending = 0;
+  int max = arity + 1;
+  depth[0] = arity + 1;
+  worklist[pending++] = 0;
+
+  while (pending > 0) {
+    int offset = worklist[--pending];
+    int current = depth[offset];
+    for (;;) {
+      current += stackEffect(code, offset);
+      if (current > max) max = current;
+
+      if (isJump(code[offset])) {
+        int target = jumpTarget(code, offset);
+        if (target < count && depth[target] < 0) {
+          depth[target] = current;
+          worklist[pending++] = target;
+        }
+      }
+      if (endsBlock(code[offset])) break;
+
+      offset += instructionLength(chunk, offset);
+      if (offset >= count || depth[offset] >= 0) break;
+      depth[offset] = current;
+    }
+  }
+
+  FREE_ARRAY(int, depth, count);
+  FREE_ARRAY(int, worklist, count);
+  return max;
+}
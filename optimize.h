@@ -0,0 +1,9 @@
+#ifndef clox_optimize_h
+#define clox_optimize_h
+
+#include "chunk.h"
+
+void optimizeChunk(Chunk* chunk);
+int maxStackDepth(Chunk* chunk, int arity);
+
+#endif
@@ -7,147 +7,519 @@
 #include "table.h"
 #include "value.h"
 
+#ifdef SIMD_TABLES
+#include <emmintrin.h>
+#endif
+
 #define TABLE_MAX_LOAD 0.75
+// Old slots a resize moves on each change to the table. Growth at least
+// doubles the capacity, so the move is over long before the new arrays
+// fill up.
+#define TABLE_MIGRATE_SLOTS 64
+
+// Bit i of each mask is set when the group's slot i matches.
+#ifdef SIMD_TABLES
+static inline uint32_t matchByte(const uint8_t* group, uint8_t byte) {
+  __m128i control = _mm_loadu_si128((const __m128i*)group);
+  return (uint32_t)_mm_movemask_epi8(
+      _mm_cmpeq_epi8(control, _mm_set1_epi8((char)byte)));
+}
+
+// Empty and deleted are the control bytes with the top bit set.
+static inline uint32_t matchFree(const uint8_t* group) {
+  return (uint32_t)_mm_movemask_epi8(
+      _mm_loadu_si128((const __m128i*)group));
+}
+#else
+static inline uint32_t matchByte(const uint8_t* group, uint8_t byte) {
+  uint32_t mask = 0;
+  for (int i = 0; i < TABLE_GROUP; i++) {
+    if (group[i] == byte) mask |= 1u << i;
+  }
+  return mask;
+}
+
+static inline uint32_t matchFree(const uint8_t* group) {
+  uint32_t mask = 0;
+  for (int i = 0; i < TABLE_GROUP; i++) {
+    if (group[i] & 0x80) mask |= 1u << i;
+  }
+  return mask;
+}
+#endif
+
+static inline int firstBit(uint32_t mask) {
+#if defined(__GNUC__) || defined(__clang__)
+  return __builtin_ctz(mask);
+#else
+  int bit = 0;
+  while (!(mask & 1)) {
+    mask >>= 1;
+    bit++;
+  }
+  return bit;
+#endif
+}
+
+// The low 7 bits go in the control byte; the rest pick the first group.
+static inline uint8_t hashTag(uint32_t hash) {
+  return hash & 0x7f;
+}
+
+static inline int firstGroup(uint32_t hash, int capacity) {
+  return (hash >> 7) & (capacity / TABLE_GROUP - 1);
+}
+
+// Triangular steps visit every group of a power-of-two table.
+static inline int nextGroup(int group, int step, int capacity) {
+  return (group + step) & (capacity / TABLE_GROUP - 1);
+}
+
+// First empty or deleted slot on hash's probe sequence. There always is
+// one, since tables never fill up.
+static int findFree(uint8_t* control, int capacity, uint32_t hash) {
+  int group = firstGroup(hash, capacity);
+  for (int step = 1;; step++) {
+    uint32_t mask = matchFree(control + group * TABLE_GROUP);
+    if (mask != 0) return group * TABLE_GROUP + firstBit(mask);
+    group = nextGroup(group, step, capacity);
+  }
+}
+
+// A deleted slot can go back to empty when its group still has an empty
+// slot: no probe ever continued past the group.
+static bool clearSlot(uint8_t* control, int index) {
+  uint8_t* group = control + index / TABLE_GROUP * TABLE_GROUP;
+  bool empty = matchByte(group, CONTROL_EMPTY) != 0;
+  control[index] = empty ? CONTROL_EMPTY : CONTROL_DELETED;
+  return empty;
+}
+
+static int nextCapacity(int count, int capacity) {
+  if (capacity < TABLE_GROUP) capacity = TABLE_GROUP;
+  // Deleted slots go with a rehash, so growing follows the live count.
+  while (count + 1 > capacity * TABLE_MAX_LOAD / 2) capacity *= 2;
+  return capacity;
+}
+
+static size_t tableBytes(int capacity) {
+  return (size_t)capacity * (1 + sizeof(ObjString*) + sizeof(Value));
+}
 
 void initTable(Table* table) {
   table->count = 0;
+  table->used = 0;
   table->capacity = 0;
-  table->entries = NULL;
+  table->control = NULL;
+  table->keys = NULL;
+  table->values = NULL;
+  table->oldCapacity = 0;
+  table->migrated = 0;
+  table->oldControl = NULL;
+  table->oldKeys = NULL;
+  table->oldValues = NULL;
 }
 
 void freeTable(Table* table) {
-  FREE_ARRAY(Entry, table->entries, table->capacity);
+  FREE_ARRAY(uint8_t, table->control, tableBytes(table->capacity));
+  if (table->oldCapacity > 0) {
+    FREE_ARRAY(uint8_t, table->oldControl, tableBytes(table->oldCapacity));
+  }
   initTable(table);
 }
 
-static Entry* findEntry(Entry* entries, int capacity,ObjString* key) {
-  uint32_t index = key->hash & (capacity - 1);
-  Entry* tombstone = NULL;
-  for (;;) {
-    Entry* entry = &entries[index];
-    if (entry->key == NULL) {
-      if (IS_NIL(entry->value)) {
-        // Empty entry.
-        return tombstone != NULL ? tombstone : entry;
-      } else {
-        // We found a tombstone.
-        if (tombstone == NULL) tombstone = entry;
-      }
-    } else if (entry->key == key) {
-      // We found the key.
-      return entry;
+static inline bool isFull(uint8_t control) {
+  return (control & 0x80) == 0;
+}
+
+static int findSlot(uint8_t* control, ObjString** keys, int capacity,
+                    ObjString* key, uint32_t hash) {
+  if (capacity == 0) return -1;
+  uint8_t tag = hashTag(hash);
+  int group = firstGroup(hash, capacity);
+  for (int step = 1;; step++) {
+    uint8_t* bytes = control + group * TABLE_GROUP;
+    for (uint32_t mask = matchByte(bytes, tag); mask != 0;
+         mask &= mask - 1) {
+      int index = group * TABLE_GROUP + firstBit(mask);
+      if (keys[index] == key) return index;
     }
-    index = (index + 1) & (capacity - 1);
+    if (matchByte(bytes, CONTROL_EMPTY) != 0) return -1;
+    group = nextGroup(group, step, capacity);
   }
 }
 
-static void adjustCapacity(Table* table, int capacity) {
-  Entry* entries = ALLOCATE(Entry, capacity);
-  for (int i = 0; i < capacity; i++) {
-    entries[i].key = NULL;
-    entries[i].value = NIL_VAL;
+static int insert(Table* table, ObjString* key, uint32_t hash,
+                  Value value) {
+  int index = findFree(table->control, table->capacity, hash);
+  if (table->control[index] == CONTROL_EMPTY) table->used++;
+  table->control[index] = hashTag(hash);
+  table->keys[index] = key;
+  table->values[index] = value;
+  return index;
+}
+
+// Moving an entry unlinks it from the old arrays, which the marker may
+// have yet to reach or may skip once the move is over.
+static int moveEntry(Table* table, ObjString* key, Value value) {
+  if (vm.marking) {
+    shadeObject((Obj*)key);
+    if (IS_OBJ(value)) shadeObject(AS_OBJ(value));
   }
-  table->count = 0;
-  for (int i = 0; i < table->capacity; i++) {
-    Entry* entry = &table->entries[i];
-    if (entry->key == NULL) continue;
-    Entry* dest = findEntry(entries, capacity, entry->key);
-    dest->key = entry->key;
-    dest->value = entry->value;
-    table->count++;
+  return insert(table, key, key->hash, value);
+}
+
+// The old arrays keep their keys and values for the marker; only their
+// control bytes say what's been moved. They're freed when the last slot
+// is, which a running marker defers.
+static void migrate(Table* table, int slots) {
+  int end = table->migrated + slots;
+  if (end > table->oldCapacity) end = table->oldCapacity;
+  for (int i = table->migrated; i < end; i++) {
+    if (!isFull(table->oldControl[i])) continue;
+    moveEntry(table, table->oldKeys[i], table->oldValues[i]);
+    clearSlot(table->oldControl, i);
+  }
+  table->migrated = end;
+  if (end == table->oldCapacity) {
+    PUBLISH(table->oldCapacity, 0);
+    FREE_ARRAY(uint8_t, table->oldControl, tableBytes(end));
+  }
+}
+
+// The marker reads the capacity, then the arrays, then the old ones, so
+// the old arrays are published before the new ones replace them.
+static void startResize(Table* table, int capacity) {
+  if (table->oldCapacity > 0) migrate(table, table->oldCapacity);
+  uint8_t* control = ALLOCATE(uint8_t, tableBytes(capacity));
+  ObjString** keys = (ObjString**)(control + capacity);
+  Value* values = (Value*)(keys + capacity);
+  memset(control, CONTROL_EMPTY, capacity);
+  for (int i = 0; i < capacity; i++) {
+    keys[i] = NULL;
+    values[i] = NIL_VAL;
   }
-  FREE_ARRAY(Entry, table->entries, table->capacity);
-  table->entries = entries;
-  table->capacity = capacity;
+  table->oldControl = table->control;
+  PUBLISH(table->oldKeys, table->keys);
+  PUBLISH(table->oldValues, table->values);
+  table->migrated = 0;
+  PUBLISH(table->oldCapacity, table->capacity);
+  table->control = control;
+  PUBLISH(table->keys, keys);
+  PUBLISH(table->values, values);
+  table->used = 0;
+  PUBLISH(table->capacity, capacity);
+  // Small tables are moved in one go.
+  if (table->oldCapacity > 0) migrate(table, TABLE_MIGRATE_SLOTS);
+}
+
+// Slot of key in the new arrays, moving it there if a resize hasn't yet.
+static int claimSlot(Table* table, ObjString* key, uint32_t hash) {
+  int index = findSlot(table->control, table->keys, table->capacity, key,
+                       hash);
+  if (index >= 0 || table->oldCapacity == 0) return index;
+  int old = findSlot(table->oldControl, table->oldKeys, table->oldCapacity,
+                     key, hash);
+  if (old < 0) return -1;
+  clearSlot(table->oldControl, old);
+  return moveEntry(table, key, table->oldValues[old]);
 }
 
 bool tableSet(Table* table, ObjString* key, Value value) {
-  if (table->count + 1 > table->capacity * TABLE_MAX_LOAD) {
-    int capacity = GROW_CAPACITY(table->capacity);
-    adjustCapacity(table, capacity);
-  }
-  Entry* entry = findEntry(table->entries, table->capacity, key);
-  bool isNewKey = entry->key == NULL;
-  if (isNewKey && IS_NIL(entry->value)) table->count++;
-  entry->key = key;
-  entry->value = value;
-  return isNewKey;
-}
-
-// bool tableGet(Table* table, ObjString* key, Value* value) {
-//   if (table->count == 0) return false;
-//   Entry* entry = findEntry(table->entries, table->capacity, key);
-//   if (entry->key == NULL) return false;
-//   *value = entry->value;
-//   return true;
-// }
+  if (table->oldCapacity > 0) migrate(table, TABLE_MIGRATE_SLOTS);
+  uint32_t hash = stringHash(key);
+  int index = claimSlot(table, key, hash);
+  if (index >= 0) {
+    table->values[index] = value;
+    return false;
+  }
+  if (table->used + 1 > table->capacity * TABLE_MAX_LOAD) {
+    startResize(table, nextCapacity(table->count, table->capacity));
+  }
+  insert(table, key, hash, value);
+  table->count++;
+  return true;
+}
 
 bool tableGet(Table* table, ObjString* key, Value* value) {
-    printf("Searching for key: %s\n", key->chars);
-    if (table->count == 0) {
-        printf("Table is empty\n");
-        return false;
-    }
-    Entry* entry = findEntry(table->entries, table->capacity, key);
-    if (entry->key == NULL) {
-        printf("Key not found\n");
-        return false;
-    }
-    *value = entry->value;
-    printf("Key found. Value: ");
-    printValue(entry->value);
-    printf("\n");
+  if (table->count == 0) return false;
+  uint32_t hash = stringHash(key);
+  int index = findSlot(table->control, table->keys, table->capacity, key,
+                       hash);
+  if (index >= 0) {
+    *value = table->values[index];
     return true;
+  }
+  if (table->oldCapacity == 0) return false;
+  index = findSlot(table->oldControl, table->oldKeys, table->oldCapacity,
+                   key, hash);
+  if (index < 0) return false;
+  *value = table->oldValues[index];
+  return true;
+}
+
+// Position of key in table->keys and table->values, or -1. Only good
+// until the next resize, so callers holding on to it must re-check the
+// key.
+int tableFindIndex(Table* table, ObjString* key) {
+  if (table->count == 0) return -1;
+  return claimSlot(table, key, stringHash(key));
 }
 
 bool tableDelete(Table* table, ObjString* key) {
   if (table->count == 0) return false;
-  Entry* entry = findEntry(table->entries, table->capacity, key);
-  if (entry->key == NULL) return false;
-  entry->key = NULL;
-  entry->value = BOOL_VAL(true);
+  if (table->oldCapacity > 0) migrate(table, TABLE_MIGRATE_SLOTS);
+  uint32_t hash = stringHash(key);
+  int index = findSlot(table->control, table->keys, table->capacity, key,
+                       hash);
+  if (index >= 0) {
+    if (clearSlot(table->control, index)) table->used--;
+    table->keys[index] = NULL;
+    table->values[index] = NIL_VAL;
+  } else if (table->oldCapacity > 0 &&
+             (index = findSlot(table->oldControl, table->oldKeys,
+                               table->oldCapacity, key, hash)) >= 0) {
+    clearSlot(table->oldControl, index);
+  } else {
+    return false;
+  }
+  table->count--;
   return true;
 }
 
 void tableAddAll(Table* from, Table* to) {
   for (int i = 0; i < from->capacity; i++) {
-    Entry* entry = &from->entries[i];
-    if (entry->key != NULL) {
-      tableSet(to, entry->key, entry->value);
+    if (from->keys[i] != NULL) {
+      tableSet(to, from->keys[i], from->values[i]);
     }
   }
-}
-
-ObjString* tableFindString(Table* table, const char* chars, int length, uint32_t hash) {
-  if (table->count == 0) return NULL;
-  uint32_t index = hash & (table->capacity - 1);
-  for (;;) {
-    Entry* entry = &table->entries[index];
-    if (entry->key == NULL) {
-      if (IS_NIL(entry->value)) return NULL;
-    } else if (entry->key->length == length &&
-        entry->key->hash == hash &&
-        memcmp(entry->key->chars, chars, length) == 0) {
-      return entry->key;
+  for (int i = 0; i < from->oldCapacity; i++) {
+    if (isFull(from->oldControl[i])) {
+      tableSet(to, from->oldKeys[i], from->oldValues[i]);
     }
-    index = (index + 1) & (table->capacity - 1);
   }
 }
 
-void tableRemoveWhite(Table* table) {
+// Some key mapped to value, by a linear scan.
+ObjString* tableFindKey(Table* table, Value value) {
   for (int i = 0; i < table->capacity; i++) {
-    Entry* entry = &table->entries[i];
-    if (entry->key != NULL && !entry->key->obj.isMarked) {
-      tableDelete(table, entry->key);
+    if (table->keys[i] != NULL && valuesEqual(table->values[i], value)) {
+      return table->keys[i];
     }
   }
+  for (int i = 0; i < table->oldCapacity; i++) {
+    if (isFull(table->oldControl[i]) &&
+        valuesEqual(table->oldValues[i], value)) {
+      return table->oldKeys[i];
+    }
+  }
+  return NULL;
 }
 
+// Keys and values are published before the capacity that covers them,
+// and a resize leaves the old arrays to the marker until it's done. If
+// these arrays are a resize's new ones, the old ones are published too
+// and hold whatever hasn't been moved; what's moved while marking is
+// shaded.
 void markTable(Table* table) {
+  int capacity = ACQUIRE(table->capacity);
+  ObjString** keys = ACQUIRE(table->keys);
+  Value* values = ACQUIRE(table->values);
+  for (int i = 0; i < capacity; i++) {
+    markObject((Obj*)keys[i]);
+    markValue(values[i]);
+  }
+  capacity = ACQUIRE(table->oldCapacity);
+  keys = ACQUIRE(table->oldKeys);
+  values = ACQUIRE(table->oldValues);
+  for (int i = 0; i < capacity; i++) {
+    markObject((Obj*)keys[i]);
+    markValue(values[i]);
+  }
+}
+
+// The old arrays' moved and deleted slots are forwarded too, since the
+// marker still reads them.
+void forwardTable(Table* table) {
   for (int i = 0; i < table->capacity; i++) {
-    Entry* entry = &table->entries[i];
-    markObject((Obj*)entry->key);
-    markValue(entry->value);
+    table->keys[i] = (ObjString*)forwardObject((Obj*)table->keys[i]);
+    forwardValue(&table->values[i]);
+  }
+  for (int i = 0; i < table->oldCapacity; i++) {
+    table->oldKeys[i] = (ObjString*)forwardObject((Obj*)table->oldKeys[i]);
+    forwardValue(&table->oldValues[i]);
+  }
+}
+
+static size_t stringSetBytes(int capacity) {
+  return (size_t)capacity *
+         (1 + sizeof(ObjString*) + sizeof(uint32_t));
+}
+
+void initStringSet(StringSet* set) {
+  set->count = 0;
+  set->used = 0;
+  set->young = 0;
+  set->capacity = 0;
+  set->control = NULL;
+  set->keys = NULL;
+  set->hashes = NULL;
+  set->oldCapacity = 0;
+  set->migrated = 0;
+  set->oldControl = NULL;
+  set->oldKeys = NULL;
+  set->oldHashes = NULL;
+}
+
+void freeStringSet(StringSet* set) {
+  FREE_ARRAY(uint8_t, set->control, stringSetBytes(set->capacity));
+  if (set->oldCapacity > 0) {
+    FREE_ARRAY(uint8_t, set->oldControl, stringSetBytes(set->oldCapacity));
+  }
+  initStringSet(set);
+}
+
+static ObjString* findString(uint8_t* control, ObjString** keys,
+                             uint32_t* hashes, int capacity,
+                             const char* chars, int length, uint32_t hash) {
+  if (capacity == 0) return NULL;
+  uint8_t tag = hashTag(hash);
+  int group = firstGroup(hash, capacity);
+  for (int step = 1;; step++) {
+    uint8_t* bytes = control + group * TABLE_GROUP;
+    for (uint32_t mask = matchByte(bytes, tag); mask != 0;
+         mask &= mask - 1) {
+      int index = group * TABLE_GROUP + firstBit(mask);
+      ObjString* key = keys[index];
+      if (hashes[index] == hash && key->length == length &&
+          memcmp(key->chars, chars, length) == 0) {
+        return key;
+      }
+    }
+    if (matchByte(bytes, CONTROL_EMPTY) != 0) return NULL;
+    group = nextGroup(group, step, capacity);
+  }
+}
+
+ObjString* stringSetFind(StringSet* set, const char* chars, int length,
+                         uint32_t hash) {
+  if (set->count == 0) return NULL;
+  ObjString* string = findString(set->control, set->keys, set->hashes,
+                                 set->capacity, chars, length, hash);
+  if (string != NULL || set->oldCapacity == 0) return string;
+  return findString(set->oldControl, set->oldKeys, set->oldHashes,
+                    set->oldCapacity, chars, length, hash);
+}
+
+static void insertString(StringSet* set, ObjString* string,
+                         uint32_t hash) {
+  int index = findFree(set->control, set->capacity, hash);
+  if (set->control[index] == CONTROL_EMPTY) set->used++;
+  set->control[index] = hashTag(hash);
+  set->keys[index] = string;
+  set->hashes[index] = hash;
+}
+
+// Nothing but the collector reads the set, so unlike a Table's, its old
+// slots are emptied as they're moved.
+static void migrateStrings(StringSet* set, int slots) {
+  int end = set->migrated + slots;
+  if (end > set->oldCapacity) end = set->oldCapacity;
+  for (int i = set->migrated; i < end; i++) {
+    if (set->oldKeys[i] == NULL) continue;
+    insertString(set, set->oldKeys[i], set->oldHashes[i]);
+    clearSlot(set->oldControl, i);
+    set->oldKeys[i] = NULL;
+  }
+  set->migrated = end;
+  if (end == set->oldCapacity) {
+    FREE_ARRAY(uint8_t, set->oldControl, stringSetBytes(end));
+    set->oldCapacity = 0;
+  }
+}
+
+static void resizeStringSet(StringSet* set) {
+  if (set->oldCapacity > 0) migrateStrings(set, set->oldCapacity);
+  int capacity = nextCapacity(set->count, set->capacity);
+  uint8_t* control = ALLOCATE(uint8_t, stringSetBytes(capacity));
+  ObjString** keys = (ObjString**)(control + capacity);
+  uint32_t* hashes = (uint32_t*)(keys + capacity);
+  memset(control, CONTROL_EMPTY, capacity);
+  memset(keys, 0, sizeof(ObjString*) * capacity);
+  set->oldControl = set->control;
+  set->oldKeys = set->keys;
+  set->oldHashes = set->hashes;
+  set->oldCapacity = set->capacity;
+  set->migrated = 0;
+  set->control = control;
+  set->keys = keys;
+  set->hashes = hashes;
+  set->capacity = capacity;
+  set->used = 0;
+  if (set->oldCapacity > 0) migrateStrings(set, TABLE_MIGRATE_SLOTS);
+}
+
+// The string must not be in the set already.
+void stringSetAdd(StringSet* set, ObjString* string) {
+  if (set->oldCapacity > 0) migrateStrings(set, TABLE_MIGRATE_SLOTS);
+  if (set->used + 1 > set->capacity * TABLE_MAX_LOAD) resizeStringSet(set);
+  insertString(set, string, string->hash);
+  set->count++;
+  if (string->obj.isYoung) set->young++;
+}
+
+// Only the current arrays count towards used.
+static void removeSlot(StringSet* set, uint8_t* control, ObjString** keys,
+                       int index) {
+  if (clearSlot(control, index) && control == set->control) set->used--;
+  keys[index] = NULL;
+  set->count--;
+}
+
+static void removeWhite(StringSet* set, uint8_t* control, ObjString** keys,
+                        int capacity) {
+  for (int i = 0; i < capacity; i++) {
+    ObjString* key = keys[i];
+    if (key != NULL && !isMarked(&key->obj)) {
+      removeSlot(set, control, keys, i);
+    }
+  }
+}
+
+void stringSetRemoveWhite(StringSet* set) {
+  removeWhite(set, set->control, set->keys, set->capacity);
+  removeWhite(set, set->oldControl, set->oldKeys, set->oldCapacity);
+}
+
+static void removeYoung(StringSet* set, uint8_t* control, ObjString** keys,
+                        int capacity) {
+  for (int i = 0; i < capacity; i++) {
+    ObjString* key = keys[i];
+    if (key == NULL || !key->obj.isYoung) continue;
+    if (key->obj.forward != NULL) {
+      keys[i] = (ObjString*)key->obj.forward;
+    } else {
+      removeSlot(set, control, keys, i);
+    }
   }
 }
 
+// The weak side of a minor collection: strings that were promoted follow
+// their copies, and the ones left in the nursery are dropped. Interned
+// strings mostly come from the compiler, already old, so this is usually
+// nothing.
+void stringSetRemoveYoung(StringSet* set) {
+  if (set->young == 0) return;
+  set->young = 0;
+  removeYoung(set, set->control, set->keys, set->capacity);
+  removeYoung(set, set->oldControl, set->oldKeys, set->oldCapacity);
+}
+
+void forwardStringSet(StringSet* set) {
+  for (int i = 0; i < set->capacity; i++) {
+    set->keys[i] = (ObjString*)forwardObject((Obj*)set->keys[i]);
+  }
+  for (int i = 0; i < set->oldCapacity; i++) {
+    set->oldKeys[i] = (ObjString*)forwardObject((Obj*)set->oldKeys[i]);
+  }
+}
@@ -4,25 +4,68 @@
 #include "value.h"
 #include "object.h"
 
-typedef struct {
-  ObjString* key;
-  Value value;
-  ValueType type;
-} Entry;
+// Open addressing in the style of a Swiss table: slots come in groups of
+// TABLE_GROUP, and each has a control byte holding 7 bits of its key's
+// hash (or CONTROL_EMPTY / CONTROL_DELETED), so a probe checks a whole
+// group at once before it touches a key. Control bytes, keys and values
+// are separate arrays in one allocation.
+//
+// Growing doesn't rehash everything at once: the old arrays stay beside
+// the new ones, and each change moves a few more of their slots over
+// until they're empty. Lookups check both in the meantime.
+#define TABLE_GROUP 16
+#define CONTROL_EMPTY   0x80
+#define CONTROL_DELETED 0xfe
 
 typedef struct {
-  int count;
-  int capacity;
-  Entry* entries;
+  int count;           // keys in the table
+  int used;            // slots that aren't empty, deleted ones included
+  int capacity;        // 0, or a power of two no less than TABLE_GROUP
+  uint8_t* control;
+  ObjString** keys;
+  Value* values;
+  int oldCapacity;     // the arrays a resize is moving out of, or 0
+  int migrated;        // their slots moved so far
+  uint8_t* oldControl;
+  ObjString** oldKeys;
+  Value* oldValues;
 } Table;
 
 void initTable(Table* table);
 void freeTable(Table* table);
 bool tableGet(Table* table, ObjString* key, Value* value);
+int tableFindIndex(Table* table, ObjString* key);
 bool tableSet(Table* table, ObjString* key, Value value);
 bool tableDelete(Table* table, ObjString* key);
 void tableAddAll(Table* from, Table* to);
-ObjString* tableFindString(Table* table, const char* chars,int length, uint32_t hash);
-void tableRemoveWhite(Table* table);
+ObjString* tableFindKey(Table* table, Value value);
 void markTable(Table* table);
+void forwardTable(Table* table);
+
+// The intern table: a weak set of strings, laid out like a Table but
+// with each key's full hash in place of a value.
+typedef struct {
+  int count;           // strings in the set
+  int used;            // slots that aren't empty, deleted ones included
+  int young;           // strings added from the nursery since it was last
+                       // collected
+  int capacity;
+  uint8_t* control;
+  ObjString** keys;
+  uint32_t* hashes;
+  int oldCapacity;
+  int migrated;
+  uint8_t* oldControl;
+  ObjString** oldKeys;
+  uint32_t* oldHashes;
+} StringSet;
+
+void initStringSet(StringSet* set);
+void freeStringSet(StringSet* set);
+ObjString* stringSetFind(StringSet* set, const char* chars, int length,
+                         uint32_t hash);
+void stringSetAdd(StringSet* set, ObjString* string);
+void stringSetRemoveWhite(StringSet* set);
+void stringSetRemoveYoung(StringSet* set);
+void forwardStringSet(StringSet* set);
 #endif
@@ -65,7 +65,7 @@ void freeValueArray(ValueArray* array) {
 
 void printValue(Value value) {
   //printf("entered printValue\n");
-  switch (value.type) {
+  switch (VALUE_TYPE(value)) {
     case VAL_BOOL:
       printf(AS_BOOL(value) ? "true" : "false");
       break;
@@ -90,7 +90,7 @@ void printValue(Value value) {
 }
 
 bool isValueType(Value value, const char* type) {
-  switch (value.type) {
+  switch (VALUE_TYPE(value)) {
     case VAL_BOOL:
       return strcmp(type, "bool") == 0;
     case VAL_NIL:
@@ -116,13 +116,26 @@ ValueType stringToValueType(const char* type) {
 }
 
 bool valuesEqual(Value a, Value b) {
+#ifdef NAN_BOXING
+  // Floats compare numerically so that NaN != NaN; every other kind of
+  // value is equal exactly when its bits are.
+  if (IS_FLOAT(a) && IS_FLOAT(b)) return AS_FLOAT(a) == AS_FLOAT(b);
+  if (a == b) return true;
+  return IS_STRING(a) && IS_STRING(b) &&
+         stringsEqual(AS_STRING(a), AS_STRING(b));
+#else
   if (a.type != b.type) return false;
   switch (a.type) {
     case VAL_BOOL:   return AS_BOOL(a) == AS_BOOL(b);
     case VAL_NIL:    return true;
     case VAL_INT:    return AS_INT(a) == AS_INT(b);
     case VAL_FLOAT:  return AS_FLOAT(a) == AS_FLOAT(b);
-    case VAL_OBJ:    return AS_OBJ(a) == AS_OBJ(b);
+    case VAL_OBJ:
+      if (IS_STRING(a) && IS_STRING(b)) {
+        return stringsEqual(AS_STRING(a), AS_STRING(b));
+      }
+      return AS_OBJ(a) == AS_OBJ(b);
     default:         return false; // Unreachable.
   }
+#endif
 }
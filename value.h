@@ -15,6 +15,79 @@ typedef enum {
   VAL_OBJ
 } ValueType;
 
+#ifdef NAN_BOXING
+
+// Every non-float value hides in the payload of a quiet NaN. Floats are
+// stored widened to double, so any double that isn't one of our NaNs is a
+// float. Ints get their own tag bit with the 32-bit value in the low
+// bits, so int and float stay distinct for the static typing.
+#define SIGN_BIT      ((uint64_t)0x8000000000000000)
+#define QNAN          ((uint64_t)0x7ffc000000000000)
+#define INT_TAG       ((uint64_t)0x0001000000000000)
+#define CANONICAL_NAN ((uint64_t)0x7ff8000000000000)
+
+#define TAG_NIL       1 // 001.
+#define TAG_FALSE     2 // 010.
+#define TAG_TRUE      3 // 011.
+#define TAG_UNDEFINED 4 // 100.
+
+typedef uint64_t Value;
+
+#define IS_BOOL(value)    (((value) | 1) == TRUE_VAL)
+#define IS_NIL(value)     ((value) == NIL_VAL)
+#define IS_INT(value) \
+    (((value) & (SIGN_BIT | QNAN | INT_TAG)) == (QNAN | INT_TAG))
+#define IS_FLOAT(value)   (((value) & QNAN) != QNAN)
+#define IS_OBJ(value) \
+    (((value) & (QNAN | SIGN_BIT)) == (QNAN | SIGN_BIT))
+
+#define AS_BOOL(value)    ((value) == TRUE_VAL)
+#define AS_INT(value)     ((int)(uint32_t)(value))
+#define AS_FLOAT(value)   ((float)valueToDouble(value))
+#define AS_OBJ(value) \
+    ((Obj*)(uintptr_t)((value) & ~(SIGN_BIT | QNAN)))
+
+#define BOOL_VAL(b)       ((b) ? TRUE_VAL : FALSE_VAL)
+#define FALSE_VAL         ((Value)(uint64_t)(QNAN | TAG_FALSE))
+#define TRUE_VAL          ((Value)(uint64_t)(QNAN | TAG_TRUE))
+#define NIL_VAL           ((Value)(uint64_t)(QNAN | TAG_NIL))
+#define INT_VAL(i)        ((Value)(QNAN | INT_TAG | (uint32_t)(int)(i)))
+#define FLOAT_VAL(f)      floatToValue((float)(f))
+#define STRING_VAL(value) (OBJ_VAL(value))
+#define OBJ_VAL(obj) \
+    (Value)(SIGN_BIT | QNAN | (uint64_t)(uintptr_t)(obj))
+
+// Marks a global slot the compiler has reserved but nothing has defined
+// yet. Never escapes to user code.
+#define UNDEFINED_VAL     ((Value)(uint64_t)(QNAN | TAG_UNDEFINED))
+#define IS_UNDEFINED(value) ((value) == UNDEFINED_VAL)
+
+static inline double valueToDouble(Value value) {
+  double num;
+  memcpy(&num, &value, sizeof(Value));
+  return num;
+}
+
+// A NaN float could carry payload bits that collide with the tags.
+static inline Value floatToValue(float f) {
+  double num = f;
+  if (num != num) return CANONICAL_NAN;
+  Value value;
+  memcpy(&value, &num, sizeof(double));
+  return value;
+}
+
+static inline ValueType valueType(Value value) {
+  if (IS_FLOAT(value)) return VAL_FLOAT;
+  if (IS_INT(value)) return VAL_INT;
+  if (IS_OBJ(value)) return VAL_OBJ;
+  if (IS_BOOL(value)) return VAL_BOOL;
+  return VAL_NIL;
+}
+#define VALUE_TYPE(value) valueType(value)
+
+#else
+
 typedef struct {
   ValueType type;
   union {
@@ -43,6 +116,15 @@ typedef struct {
 #define STRING_VAL(value) (OBJ_VAL(value))
 #define OBJ_VAL(object)   ((Value){VAL_OBJ, {.obj = (Obj*)object}})
 
+// Marks a global slot the compiler has reserved but nothing has defined
+// yet. Never escapes to user code.
+#define UNDEFINED_VAL     ((Value){VAL_NIL, {.integer = 1}})
+#define IS_UNDEFINED(value) ((value).type == VAL_NIL && (value).as.integer == 1)
+
+#define VALUE_TYPE(value) ((value).type)
+
+#endif
+
 typedef struct {
   int capacity;
   int count;
@@ -1,3 +1,4 @@
+#include <assert.h>
 #include <stdarg.h>
 #include <stdlib.h>
 #include <stdio.h>
@@ -6,6 +7,7 @@
 #include "common.h"
 #include "compiler.h"
 #include "debug.h"
+#include "jit.h"
 #include "value.h"
 #include "object.h"
 #include "memory.h"
@@ -20,6 +22,7 @@ static void resetStack() {
   vm.stackTop = vm.stack;
   vm.frameCount = 0;
   vm.openUpvalues = NULL;
+  vm.recording = false;
 }
 
 void printStack(VM* vm){
@@ -51,36 +54,210 @@ static void runtimeError(const char* format, ...) {
   resetStack();
 }
 
+// Globals live in vm.globalValues, indexed by a slot the compiler
+// resolves once per name. vm.globalSlots maps each name to its slot so
+// natives, later REPL lines and error messages can find it again.
+int globalSlot(ObjString* name) {
+  Value slot;
+  if (tableGet(&vm.globalSlots, name, &slot)) return AS_INT(slot);
+
+  push(OBJ_VAL(name));
+  writeValueArray(&vm.globalValues, UNDEFINED_VAL);
+  writeValueArray(&vm.globalTypes, NIL_VAL);
+  tableSet(&vm.globalSlots, name, INT_VAL(vm.globalValues.count - 1));
+  pop();
+  return vm.globalValues.count - 1;
+}
+
+// Set by the compiler for globals declared int, float or string. Code
+// compiled before the declaration stores without OP_CHECK_*, so the slot
+// itself is checked on every store, or typed reads could not be trusted.
+void setGlobalType(int slot, ValueType type) {
+  vm.globalTypes.values[slot] = INT_VAL(type);
+}
+
+// Returns the name of the declared type value doesn't have, or NULL.
+static const char* globalTypeMismatch(int slot, Value value) {
+  Value type = vm.globalTypes.values[slot];
+  if (IS_NIL(type)) return NULL;
+  switch ((ValueType)AS_INT(type)) {
+    case VAL_INT: return IS_INT(value) ? NULL : "int";
+    case VAL_FLOAT: return IS_FLOAT(value) ? NULL : "float";
+    case VAL_OBJ: return IS_STRING(value) ? NULL : "string";
+    default: return NULL;
+  }
+}
+
+// Only needed on error and disassembly paths, so a linear scan is fine.
+ObjString* globalSlotName(int slot) {
+  return tableFindKey(&vm.globalSlots, INT_VAL(slot));
+}
+
 static void defineNative(const char* name, NativeFn function) {
   push(OBJ_VAL(copyString(name, (int)strlen(name))));
   push(OBJ_VAL(newNative(function)));
-  tableSet(&vm.globals, AS_STRING(vm.stack[0]), vm.stack[1]);
+  int slot = globalSlot(AS_STRING(vm.stack[0]));
+  vm.globalValues.values[slot] = vm.stack[1];
   pop();
   pop();
 }
 
 void initVM() {
+  vm.stack = ALLOCATE(Value, STACK_INITIAL);
+  vm.stackCapacity = STACK_INITIAL;
+  vm.frames = ALLOCATE(CallFrame, FRAMES_INITIAL);
+  vm.frameCapacity = FRAMES_INITIAL;
+  vm.maxFrames = DEFAULT_MAX_FRAMES;
   resetStack();
-  vm.objects = NULL;
+  vm.nursery = NULL;
+  vm.nurseryTop = NULL;
+  vm.nurseryEnd = NULL;
+  vm.remembered = NULL;
+  vm.rememberedCount = 0;
+  vm.rememberedCapacity = 0;
+  vm.pretenure = true;
+  vm.gcRequested = false;
+  vm.marking = false;
+  vm.sweeping = false;
+  vm.sweepPending = 0;
+  vm.gcPagesSwept = 0;
+  vm.gcPagesSweptOnAllocation = 0;
+  vm.concurrentGc = false;
+  vm.gcPauseTarget = GC_DEFAULT_PAUSE_US;
+  vm.gcStats = false;
+  memset(vm.gcPauses, 0, sizeof(vm.gcPauses));
+  vm.gcPauseCount = 0;
+  vm.gcPauseTotal = 0;
+  vm.gcPauseMax = 0;
+  vm.gcCompactPercent = 0;
+  vm.gcCompactions = 0;
+  vm.gcBytesMoved = 0;
   vm.bytesAllocated = 0;
-  vm.nextGC = 1024 * 1024;
+  vm.gcMinHeap = GC_DEFAULT_MIN_HEAP;
+  vm.gcMaxHeap = SIZE_MAX;
+  vm.gcCpuPercent = GC_DEFAULT_CPU_PERCENT;
+  vm.gcLog = false;
+  vm.gcCycles = 0;
+  vm.nextGC = vm.gcMinHeap;
   vm.grayCount = 0;
   vm.grayCapacity = 0;
   vm.grayStack = NULL;
-  initTable(&vm.globals);
-  initTable(&vm.strings);
-  for (int i = 0; i < STACK_MAX; i++) {
-        vm.stack[i] = NIL_VAL;
-    }
+  vm.cacheHits = 0;
+  vm.cacheMisses = 0;
+  vm.cacheMegamorphic = 0;
+  vm.stringStats = false;
+  vm.jitEnabled = false;
+  vm.jitThreshold = JIT_DEFAULT_THRESHOLD;
+  vm.jitDepth = 0;
+  vm.tracing = false;
+  vm.traceThreshold = TRACE_DEFAULT_THRESHOLD;
+  vm.dumpTraces = false;
+  initTable(&vm.globalSlots);
+  initValueArray(&vm.globalValues);
+  initValueArray(&vm.globalTypes);
+  initStringSet(&vm.strings);
   vm.initString = copyString("init", 4);
   defineNative("clock", clockNative);
+  vm.pretenure = false;
 }
 
 void freeVM() {
-  freeTable(&vm.globals);
-  freeTable(&vm.strings);
+#ifdef DEBUG_PRINT_CACHE_STATS
+  printf("inline caches: %zu hits, %zu misses, %zu megamorphic\n",
+         vm.cacheHits, vm.cacheMisses, vm.cacheMegamorphic);
+#endif
+  if (vm.gcStats) printGcStats();
+  if (vm.stringStats) printStringStats();
+  freeTable(&vm.globalSlots);
+  freeValueArray(&vm.globalValues);
+  freeValueArray(&vm.globalTypes);
+  freeStringSet(&vm.strings);
   vm.initString = NULL;
   freeObjects();
+  FREE_ARRAY(Value, vm.stack, vm.stackCapacity);
+  FREE_ARRAY(CallFrame, vm.frames, vm.frameCapacity);
+}
+
+void setMaxCallDepth(int depth) {
+  vm.maxFrames = depth < 1 ? 1 : depth;
+}
+
+// Returns false when this build has no JIT for the host.
+bool enableJit(int threshold) {
+#ifdef BASELINE_JIT
+  vm.jitEnabled = true;
+  vm.jitThreshold = threshold < 1 ? 1 : threshold;
+  return true;
+#else
+  (void)threshold;
+  return false;
+#endif
+}
+
+// Like enableJit, but compiles hot loops from recorded iterations.
+bool enableTracing(int threshold) {
+#ifdef BASELINE_JIT
+  vm.tracing = true;
+  vm.traceThreshold = threshold < 1 ? 1 : threshold;
+  return true;
+#else
+  (void)threshold;
+  return false;
+#endif
+}
+
+void setDumpTraces(bool dump) {
+  vm.dumpTraces = dump;
+}
+
+bool enableConcurrentGc() {
+#ifdef CONCURRENT_GC
+  vm.concurrentGc = true;
+  return true;
+#else
+  return false;
+#endif
+}
+
+void setGcPauseTarget(int microseconds) {
+  vm.gcPauseTarget = microseconds > 0 ? microseconds : 1;
+}
+
+void setGcStats(bool report) {
+  vm.gcStats = report;
+}
+
+void setStringStats(bool report) {
+  vm.stringStats = report;
+}
+
+// Percent of the old space's page bytes left free before a full
+// collection compacts it; 0 turns compaction off.
+void setGcCompaction(int percent) {
+  vm.gcCompactPercent = percent < 0 ? 0 : percent > 100 ? 100 : percent;
+}
+
+// The heap sizes below exclude the nursery. No mark starts before the
+// heap reaches the minimum.
+void setGcMinHeap(size_t bytes) {
+  vm.gcMinHeap = bytes;
+  if (vm.gcCycles == 0 || vm.nextGC < bytes) vm.nextGC = bytes;
+  if (vm.nextGC > vm.gcMaxHeap) vm.nextGC = vm.gcMaxHeap;
+}
+
+// Past the cap (0 for none) everything is collected at once, and the
+// program exits if that isn't enough.
+void setGcMaxHeap(size_t bytes) {
+  vm.gcMaxHeap = bytes == 0 ? SIZE_MAX : bytes;
+  if (vm.nextGC > vm.gcMaxHeap) vm.nextGC = vm.gcMaxHeap;
+}
+
+void setGcCpuTarget(int percent) {
+  vm.gcCpuPercent = percent < 1 ? 1 : percent > 99 ? 99 : percent;
+}
+
+void setGcLog(bool log) {
+  vm.gcLog = log;
 }
 
 void push(Value value) {
@@ -97,6 +274,29 @@ static Value peek(int distance) {
   return vm.stackTop[-1 - distance];
 }
 
+// Moves the value stack to a bigger array. Everything that points into
+// it (frame bases, open upvalues, stackTop) is rebased onto the new one
+// before the old one is freed.
+static void growStack(int needed) {
+  int capacity = vm.stackCapacity;
+  while (capacity < needed) capacity *= 2;
+
+  Value* stack = ALLOCATE(Value, capacity);
+  Value* old = vm.stack;
+  memcpy(stack, old, sizeof(Value) * (vm.stackTop - old));
+  for (int i = 0; i < vm.frameCount; i++) {
+    vm.frames[i].slots = stack + (vm.frames[i].slots - old);
+  }
+  for (ObjUpvalue* upvalue = vm.openUpvalues; upvalue != NULL;
+       upvalue = upvalue->next) {
+    upvalue->location = stack + (upvalue->location - old);
+  }
+  vm.stackTop = stack + (vm.stackTop - old);
+  vm.stack = stack;
+  FREE_ARRAY(Value, old, vm.stackCapacity);
+  vm.stackCapacity = capacity;
+}
+
 static bool call(ObjClosure* closure, int argCount) {
   if (argCount != closure->function->arity) {
     runtimeError("Expected %d arguments but got %d.",
@@ -104,10 +304,21 @@ static bool call(ObjClosure* closure, int argCount) {
     return false;
   }
 
-  if (vm.frameCount == FRAMES_MAX) {
+  if (vm.frameCount == vm.maxFrames) {
     runtimeError("Stack overflow.");
     return false;
   }
+  if (vm.frameCount == vm.frameCapacity) {
+    int oldCapacity = vm.frameCapacity;
+    vm.frameCapacity = GROW_CAPACITY(oldCapacity);
+    vm.frames = GROW_ARRAY(CallFrame, vm.frames, oldCapacity,
+                           vm.frameCapacity);
+  }
+  // The only stack check a call pays: the callee never needs more than
+  // maxStack slots above its base.
+  int needed = (int)(vm.stackTop - vm.stack) - argCount - 1 +
+               closure->function->maxStack + STACK_SLACK;
+  if (needed > vm.stackCapacity) growStack(needed);
 
   CallFrame* frame = &vm.frames[vm.frameCount++];
   frame->closure = closure;
@@ -162,19 +373,187 @@ static bool invokeFromClass(ObjClass* klass, ObjString* name,int argCount) {
   return call(AS_CLOSURE(method), argCount);
 }
 
-static bool invoke(ObjString* name, int argCount) {
+typedef enum {
+  PROPERTY_NONE,
+  PROPERTY_FIELD,
+  PROPERTY_METHOD
+} PropertyKind;
+
+// Remembers where name was found for this receiver shape. A site goes
+// monomorphic, then polymorphic up to INLINE_CACHE_WAYS shapes, and after
+// that stops caching altogether.
+static void updateCache(InlineCache* cache, ObjShape* shape, int index,
+                        Obj* target) {
+  if (cache->count == CACHE_MEGAMORPHIC) return;
+  CacheEntry* entry = NULL;
+  for (int i = 0; i < cache->count; i++) {
+    if (cache->entries[i].shape == (Obj*)shape) {
+      entry = &cache->entries[i];
+      break;
+    }
+  }
+  if (entry == NULL && cache->count == INLINE_CACHE_WAYS) {
+    cache->count = CACHE_MEGAMORPHIC;
+    return;
+  }
+  // Caches live in the running function, which is usually old.
+  Obj* function = &vm.frames[vm.frameCount - 1].closure->function->obj;
+  writeBarrier(function, OBJ_VAL(shape));
+  if (target != NULL) writeBarrier(function, OBJ_VAL(target));
+  if (entry != NULL) {
+    if (entry->target != NULL) {
+      snapshotBarrier(function, OBJ_VAL(entry->target));
+    }
+    entry->index = index;
+    entry->target = target;
+    return;
+  }
+  // Filled in before it's counted, for a marker reading along.
+  entry = &cache->entries[cache->count];
+  entry->shape = (Obj*)shape;
+  entry->index = index;
+  entry->target = target;
+  PUBLISH(cache->count, cache->count + 1);
+}
+
+// Looks name up on instance, fields first, then methods. Shapes are per
+// class and never change their fields, so a shape match settles both.
+// Dictionary-mode instances are never cached.
+static PropertyKind lookupProperty(InlineCache* cache, ObjInstance* instance,
+                                   ObjString* name, Value* value) {
+  ObjShape* shape = instance->shape;
+  if (shape != NULL && cache->count != CACHE_MEGAMORPHIC) {
+    for (int i = 0; i < cache->count; i++) {
+      CacheEntry* entry = &cache->entries[i];
+      if (entry->shape != (Obj*)shape) continue;
+      vm.cacheHits++;
+      if (entry->index < 0) {
+        *value = OBJ_VAL(entry->target);
+        return PROPERTY_METHOD;
+      }
+      *value = instance->slots[entry->index];
+      return PROPERTY_FIELD;
+    }
+    vm.cacheMisses++;
+  } else {
+    vm.cacheMegamorphic++;
+  }
+
+  if (shape == NULL) {
+    if (tableGet(&instance->fields, name, value)) return PROPERTY_FIELD;
+    if (tableGet(&instance->klass->methods, name, value)) {
+      return PROPERTY_METHOD;
+    }
+    return PROPERTY_NONE;
+  }
+
+  int slot = shapeSlot(shape, name);
+  if (slot >= 0) {
+    *value = instance->slots[slot];
+    updateCache(cache, shape, slot, NULL);
+    return PROPERTY_FIELD;
+  }
+  if (tableGet(&instance->klass->methods, name, value)) {
+    updateCache(cache, shape, -1, AS_OBJ(*value));
+    return PROPERTY_METHOD;
+  }
+  return PROPERTY_NONE;
+}
+
+// Both plain stores and field-adding transitions are cached, so the
+// this.x = x writes in an initializer hit as well.
+static void storeProperty(InlineCache* cache, ObjInstance* instance,
+                          ObjString* name, Value value) {
+  ObjShape* shape = instance->shape;
+  if (shape != NULL && cache->count != CACHE_MEGAMORPHIC) {
+    for (int i = 0; i < cache->count; i++) {
+      CacheEntry* entry = &cache->entries[i];
+      if (entry->shape != (Obj*)shape) continue;
+      ObjShape* next = (ObjShape*)entry->target;
+      if (next == NULL) {
+        vm.cacheHits++;
+        writeBarrier(&instance->obj, value);
+        snapshotBarrier(&instance->obj, instance->slots[entry->index]);
+        instance->slots[entry->index] = value;
+        return;
+      }
+      if (next->fieldCount <= instance->slotCapacity) {
+        vm.cacheHits++;
+        writeBarrier(&instance->obj, value);
+        writeBarrier(&instance->obj, OBJ_VAL(next));
+        instance->slots[entry->index] = value;
+        PUBLISH(instance->shape, next);
+        return;
+      }
+      break;
+    }
+    vm.cacheMisses++;
+  } else {
+    vm.cacheMegamorphic++;
+  }
+
+  instanceSetField(instance, name, value);
+  if (shape == NULL || instance->shape == NULL) return;
+  if (instance->shape == shape) {
+    updateCache(cache, shape, shapeSlot(shape, name), NULL);
+  } else {
+    updateCache(cache, shape, instance->shape->fieldCount - 1,
+                (Obj*)instance->shape);
+  }
+}
+
+static bool getProperty(ObjString* name, InlineCache* cache) {
+  if (!IS_INSTANCE(peek(0))) {
+    runtimeError("Only instances have properties.");
+    return false;
+  }
+  Value value;
+  switch (lookupProperty(cache, AS_INSTANCE(peek(0)), name, &value)) {
+    case PROPERTY_FIELD:
+      pop(); // Instance.
+      push(value);
+      return true;
+    case PROPERTY_METHOD: {
+      ObjBoundMethod* bound = newBoundMethod(peek(0), AS_CLOSURE(value));
+      pop();
+      push(OBJ_VAL(bound));
+      return true;
+    }
+    default:
+      runtimeError("Undefined property '%s'.", name->chars);
+      return false;
+  }
+}
+
+static bool setProperty(ObjString* name, InlineCache* cache) {
+  if (!IS_INSTANCE(peek(1))) {
+    runtimeError("Only instances have fields.");
+    return false;
+  }
+  storeProperty(cache, AS_INSTANCE(peek(1)), name, peek(0));
+  Value value = pop();
+  pop();
+  push(value);
+  return true;
+}
+
+static bool invokeCached(ObjString* name, int argCount, InlineCache* cache) {
   Value receiver = peek(argCount);
   if (!IS_INSTANCE(receiver)) {
     runtimeError("Only instances have methods.");
     return false;
   }
-  ObjInstance* instance = AS_INSTANCE(receiver);
   Value value;
-  if (tableGet(&instance->fields, name, &value)) {
-    vm.stackTop[-argCount - 1] = value;
-    return callValue(value, argCount);
+  switch (lookupProperty(cache, AS_INSTANCE(receiver), name, &value)) {
+    case PROPERTY_FIELD:
+      vm.stackTop[-argCount - 1] = value;
+      return callValue(value, argCount);
+    case PROPERTY_METHOD:
+      return call(AS_CLOSURE(value), argCount);
+    default:
+      runtimeError("Undefined property '%s'.", name->chars);
+      return false;
   }
-  return invokeFromClass(instance->klass, name, argCount);
 }
 
 static bool bindMethod(ObjClass* klass, ObjString* name) {
@@ -213,15 +592,55 @@ static ObjUpvalue* captureUpvalue(Value* local) {
 static void closeUpvalues(Value* last) {
   while (vm.openUpvalues != NULL && vm.openUpvalues->location >= last) {
     ObjUpvalue* upvalue = vm.openUpvalues;
+    writeBarrier(&upvalue->obj, *upvalue->location);
     upvalue->closed = *upvalue->location;
     upvalue->location = &upvalue->closed;
     vm.openUpvalues = upvalue->next;
   }
 }
 
+// Runs a call in tail position in the caller's own frame: its upvalues
+// are closed, the callee and arguments slide down over it and ip starts
+// over. Natives and classes are called normally, and the OP_RETURN that
+// always follows OP_TAIL_CALL returns their result.
+static bool tailCall(Value callee, int argCount) {
+  if (IS_BOUND_METHOD(callee)) {
+    ObjBoundMethod* bound = AS_BOUND_METHOD(callee);
+    vm.stackTop[-argCount - 1] = bound->receiver;
+    callee = OBJ_VAL(bound->method);
+  }
+  if (!IS_CLOSURE(callee)) return callValue(callee, argCount);
+
+  ObjClosure* closure = AS_CLOSURE(callee);
+  if (argCount != closure->function->arity) {
+    runtimeError("Expected %d arguments but got %d.",
+        closure->function->arity, argCount);
+    return false;
+  }
+
+  CallFrame* frame = &vm.frames[vm.frameCount - 1];
+  closeUpvalues(frame->slots);
+  memmove(frame->slots, vm.stackTop - argCount - 1,
+          sizeof(Value) * (argCount + 1));
+  vm.stackTop = frame->slots + argCount + 1;
+  int needed = (int)(frame->slots - vm.stack) + closure->function->maxStack +
+               STACK_SLACK;
+  if (needed > vm.stackCapacity) growStack(needed);
+
+  frame->closure = closure;
+  frame->ip = closure->function->chunk.code;
+  return true;
+}
+
 static void defineMethod(ObjString* name) {
   Value method = peek(0);
   ObjClass* klass = AS_CLASS(peek(1));
+  writeBarrier(&klass->obj, method);
+  writeBarrier(&klass->obj, OBJ_VAL(name));
+  Value previous;
+  if (tableGet(&klass->methods, name, &previous)) {
+    snapshotBarrier(&klass->obj, previous);
+  }
   tableSet(&klass->methods, name, method);
   pop();
 }
@@ -230,456 +649,794 @@ static bool isFalsey(Value value) {
   return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
 }
 
+// Short results are built in place. No rope is shorter
+// than ROPE_MIN_LENGTH, so their operands are always flat.
 static void concatenate() {
   ObjString* b = AS_STRING(peek(0));
   ObjString* a = AS_STRING(peek(1));
   int length = a->length + b->length;
-  char* chars = ALLOCATE(char, length + 1);
-  memcpy(chars, a->chars, a->length);
-  memcpy(chars + a->length, b->chars, b->length);
-  chars[length] = '\0';
-  ObjString* result = takeString(chars, length);
+  ObjString* result;
+  if (length < ROPE_MIN_LENGTH) {
+    result = startString(length);
+    memcpy(result->chars, a->chars, a->length);
+    memcpy(result->chars + a->length, b->chars, b->length);
+  } else {
+    result = newRope(a, b);
+  }
   pop();
   pop();
   push(OBJ_VAL(result));
 }
 
-static InterpretResult run() {
+// Runs until the frame at baseFrame returns. Only the outermost run()
+// starts at 0; the JIT nests others to finish calls it cannot compile.
+static InterpretResult run(int baseFrame) {
   CallFrame* frame = &vm.frames[vm.frameCount - 1];
-#define READ_BYTE() (*frame->ip++)
-#define READ_SHORT() (frame->ip += 2,(uint16_t)((frame->ip[-2] << 8) | frame->ip[-1]))
-#define READ_CONSTANT() (frame->closure->function->chunk.constants.values[READ_BYTE()])
+  // The hot frame state lives in locals for the whole dispatch loop and is
+  // only written back to the CallFrame when something else needs to see it.
+  register uint8_t* ip = frame->ip;
+  Value* slots = frame->slots;
+  Value* constants = frame->closure->function->chunk.constants.values;
+
+#define READ_BYTE() (*ip++)
+#define READ_SHORT() (ip += 2, (uint16_t)((ip[-2] << 8) | ip[-1]))
+#define READ_CONSTANT() (constants[READ_BYTE()])
 #define READ_STRING() AS_STRING(READ_CONSTANT())
-// #define BINARY_OP(valueType, op) \
-//     do { if (!IS_OBJ(peek(0)) || !IS_OBJ(peek(1))) { runtimeError("From BINARY_OP_PRINT. Operands must be numbers."); return INTERPRET_RUNTIME_ERROR; } \
-//       char b = AS_OBJ(pop()); char a = AS_OBJ(pop()); push(valueType(a op b)); } while (false) ;
-#define BINARY_OP_INT(valueType, op) \
-    do { if (!IS_INT(peek(0)) || !IS_INT(peek(1))) { runtimeError("From BINARY_OP_INT. Operands must be numbers."); return INTERPRET_RUNTIME_ERROR; } \
-      double b = AS_INT(pop()); double a = AS_INT(pop()); push(valueType(a op b)); } while (false) ;
-#define BINARY_OP_FLOAT(valueType, op) \
-    do { if (!IS_FLOAT(peek(0)) || !IS_FLOAT(peek(1))) { runtimeError("From BINARY_OP_FLOAT. Operands must be numbers."); return INTERPRET_RUNTIME_ERROR; } \
-      double b = AS_FLOAT(pop()); double a = AS_FLOAT(pop()); push(valueType(a op b)); \
+#define READ_CACHE() (&frame->closure->function->chunk.caches[READ_SHORT()])
+#define STORE_FRAME() (frame->ip = ip)
+#define LOAD_FRAME() \
+    do { \
+      frame = &vm.frames[vm.frameCount - 1]; \
+      ip = frame->ip; \
+      slots = frame->slots; \
+      constants = frame->closure->function->chunk.constants.values; \
+    } while (false)
+#define RUNTIME_ERROR(...) \
+    do { STORE_FRAME(); runtimeError(__VA_ARGS__); return INTERPRET_RUNTIME_ERROR; } while (false)
+#ifdef DEBUG_ASSERT_TYPES
+#define ASSERT_OPERANDS(is) assert(is(peek(0)) && is(peek(1)))
+#else
+#define ASSERT_OPERANDS(is) ((void)0)
+#endif
+// Unchecked forms. The compiler only emits these once it has proven both
+// operand types, so DEBUG_ASSERT_TYPES is the only thing that looks.
+// Int arithmetic is done in uint32_t so overflow wraps, like the JIT's
+// add, sub and imul, instead of being undefined.
+#define INT_OP(op) \
+    do { \
+      ASSERT_OPERANDS(IS_INT); \
+      uint32_t b = (uint32_t)AS_INT(pop()); \
+      uint32_t a = (uint32_t)AS_INT(pop()); \
+      push(INT_VAL((int32_t)(a op b))); \
+    } while (false)
+#define INT_COMPARE(op) \
+    do { \
+      ASSERT_OPERANDS(IS_INT); \
+      int b = AS_INT(pop()); \
+      int a = AS_INT(pop()); \
+      push(BOOL_VAL(a op b)); \
     } while (false)
-  for (;;) {
+#define FLOAT_OP(valueType, op) \
+    do { \
+      ASSERT_OPERANDS(IS_FLOAT); \
+      double b = AS_FLOAT(pop()); \
+      double a = AS_FLOAT(pop()); \
+      push(valueType(a op b)); \
+    } while (false)
+// INT32_MIN / -1 doesn't fit in an int and traps in C as in idiv, so a
+// divisor of -1 negates instead, wrapping INT32_MIN back to itself.
+#define INT_DIVIDE() \
+    do { \
+      ASSERT_OPERANDS(IS_INT); \
+      if (AS_INT(peek(0)) == 0) RUNTIME_ERROR("Division by zero."); \
+      if (AS_INT(peek(0)) == -1) { \
+        uint32_t a = (uint32_t)AS_INT(peek(1)); \
+        vm.stackTop -= 2; \
+        push(INT_VAL((int32_t)(0u - a))); \
+      } else { \
+        int b = AS_INT(pop()); \
+        int a = AS_INT(pop()); \
+        push(INT_VAL(a / b)); \
+      } \
+    } while (false)
+// Checked forms for operands whose types the compiler could not prove.
+#define CHECKED_OP(intOp, floatType, op) \
+    do { \
+      if (IS_INT(peek(0)) && IS_INT(peek(1))) intOp(op); \
+      else if (IS_FLOAT(peek(0)) && IS_FLOAT(peek(1))) FLOAT_OP(floatType, op); \
+      else RUNTIME_ERROR("Operands must be two integers or two floats."); \
+    } while (false)
+#define COMPARE_JUMP(op) \
+    do { \
+      uint16_t offset = READ_SHORT(); \
+      Value b = peek(0); \
+      Value a = peek(1); \
+      bool result; \
+      if (IS_INT(a) && IS_INT(b)) result = AS_INT(a) op AS_INT(b); \
+      else if (IS_FLOAT(a) && IS_FLOAT(b)) result = AS_FLOAT(a) op AS_FLOAT(b); \
+      else RUNTIME_ERROR("Operands must be two integers or two floats."); \
+      vm.stackTop -= 2; \
+      if (!result) ip += offset; \
+    } while (false)
+#define INT_COMPARE_JUMP(op) \
+    do { \
+      uint16_t offset = READ_SHORT(); \
+      ASSERT_OPERANDS(IS_INT); \
+      bool result = AS_INT(peek(1)) op AS_INT(peek(0)); \
+      vm.stackTop -= 2; \
+      if (!result) ip += offset; \
+    } while (false)
+
+// Backward jumps and returns give allocation-heavy code a steady supply
+// of points where the heap can be collected.
+#define GC_SAFEPOINT() \
+    do { \
+      if (vm.gcRequested) { \
+        STORE_FRAME(); \
+        gcSafepoint(); \
+        LOAD_FRAME(); \
+      } \
+    } while (false)
+
+#ifdef BASELINE_JIT
+// Hands the top frame to native code. That may run frames to completion
+// or exit anywhere, so everything is reloaded afterwards.
+#define JIT_RESUME(call) \
+    do { \
+      STORE_FRAME(); \
+      JitStatus status = (call); \
+      if (status == JIT_ERROR) return INTERPRET_RUNTIME_ERROR; \
+      if (status == JIT_FINISHED || vm.frameCount == baseFrame) { \
+        return INTERPRET_OK; \
+      } \
+      LOAD_FRAME(); \
+    } while (false)
+// Offers the top frame to the JIT wherever control enters a function's
+// code: calls, returns and loop back edges. Not while an iteration is
+// being recorded, which has to see the loop's frame through to its end.
+#define JIT_ENTER() \
+    do { \
+      if (vm.jitEnabled && !vm.recording) JIT_RESUME(jitEnter()); \
+    } while (false)
+// Back edges also go to the tracer, which may start or finish recording,
+// so the dispatch table is picked again afterwards.
+#define ENTER_TRACE() \
+    do { \
+      if (vm.tracing) { \
+        JIT_RESUME(traceLoop()); \
+        SELECT_TABLE(); \
+      } \
+    } while (false)
+#define RECORD_INSTRUCTION() \
+    do { if (vm.recording) recordInstruction(ip); } while (false)
+#else
+#define JIT_ENTER() do { } while (false)
+#define ENTER_TRACE() do { } while (false)
+#define RECORD_INSTRUCTION() do { } while (false)
+#endif
+
 #ifdef DEBUG_TRACE_EXECUTION
-    printStack(&vm);
-    disassembleInstruction(&frame->closure->function->chunk,(int)(frame->ip - frame->closure->function->chunk.code)); 
+#define TRACE_INSTRUCTION() \
+    do { \
+      printStack(&vm); \
+      disassembleInstruction(&frame->closure->function->chunk, \
+          (int)(ip - frame->closure->function->chunk.code)); \
+    } while (false)
+#else
+#define TRACE_INSTRUCTION() do { } while (false)
 #endif
 
-    uint8_t instruction;
-    switch (instruction = READ_BYTE()) {
-      case OP_CONSTANT: {
-        printf("OP_CONSTANT\n");
-        Value constant = READ_CONSTANT();
-        printf("%s", constant);
-        push(constant);
-        printf("Pushed constant: %s", constant);
-        break;
-      }
-      case OP_CONSTANT_INT: {
-        printf("OP_CONSTANT_INT\n");
-        int value = AS_INT(READ_CONSTANT());
-        push(INT_VAL(value));
-        //printf("Pushed constant: ");
-        //printValue(INT_VAL(value));
-        printf("\n");
-        break;
-      }
-      case OP_CONSTANT_FLOAT: {
-        printf("OP_CONSTANT_FLOAT\n");
-        double value = AS_FLOAT(READ_CONSTANT());
-        push(FLOAT_VAL(value));
-        //printf("Pushed constant: ");
-        //printValue(FLOAT_VAL(value));
-        printf("\n");
-        break;
-      }
-      case OP_CONSTANT_STRING: {
-        printf("OP_CONSTANT_STRING\n");
-        ObjString* string = AS_STRING(READ_CONSTANT());
-        push(OBJ_VAL(string));
-        if ((string)->type == VAL_OBJ) {
-            runtimeError("Expected a string");
-            break;
-        }
-        break;
-      }
-      case OP_NIL: push(NIL_VAL); break;
-      case OP_TRUE: push(BOOL_VAL(true)); break;
-      case OP_FALSE: push(BOOL_VAL(false)); break;
-      case OP_POP: pop(); break;
-      case OP_GET_LOCAL: {
-        uint8_t slot = READ_BYTE();
-        push(frame->slots[slot]);
-        break;
-      }
-      case OP_SET_LOCAL: {
-        uint8_t slot = READ_BYTE();
-        frame->slots[slot] = peek(0);
-        break;
-      }
-      case OP_GET_GLOBAL: {
-        ObjString* name = READ_STRING();
-        Value value;
-        if (!tableGet(&vm.globals, name, &value)) {
-            runtimeError("Undefined variable '%s'.", name->chars);
-            return INTERPRET_RUNTIME_ERROR;
-        }
-        //printf("After tableGet, value type: %d\n", value.type);
-        if (value.type == VAL_FLOAT) {
-            //printf("Float value: %f\n", value.as.float_val);
-        }
-        push(value);
-        break;
-      }
-   case OP_SET_GLOBAL: {
-        printf("OP_SET_GLOBAL\n");
-        // ObjString* name = READ_STRING();
-        // printf("%s", name);
-        // if (tableSet(&vm.globals, name, peek(0))) {
-        //   printf("value being deleted is: ", name);
-        //   tableDelete(&vm.globals, name); // [delete]
-        //   runtimeError("Undefined variable '%s'.", name->chars);
-        //   return INTERPRET_RUNTIME_ERROR;
-        // }
-        break;
-      }
-      case OP_DEFINE_GLOBAL: {
-        printf("entered OP_DEFINE_GLOBAL\n");
-        printf("OP_DEFINE_GLOBAL\n");
-        ObjString* name = READ_STRING();
-        printf("Defining global: %s = ", name->chars);
-        printValue(peek(0));
-        printf("\n");
-        tableSet(&vm.globals, name, peek(0));
-        pop();
-        break;
-      }
-      case OP_GET_GLOBAL_INT: {
-        printf("OP_GET_GLOBAL_INT");
-        ObjString* name = READ_STRING();
-        Value value;
-        if (!tableGet(&vm.globals, name, &value)) {
-            runtimeError("Undefined variable '%s'.", name->chars);
-            break;
-        }
-        if (!IS_INT(value)) {
-            runtimeError("Expected int value for variable '%s'.", name->chars);
-            break;
-        }
-        push(value);
-        break;
-    }
-      case OP_GET_GLOBAL_FLOAT: {
-        ObjString* name = READ_STRING();
-        Value value;
-        if (!tableGet(&vm.globals, name, &value)) {
-            runtimeError("Undefined variable '%s'.", name->chars);
-            break;
-        }
-        if (!IS_FLOAT(value)) {
-            runtimeError("Expected float value for variable '%s'.", name->chars);
-            break;
-        }
-        push(value);
-        break;
-    }
-      case OP_GET_GLOBAL_STRING: {
-        ObjString* name = READ_STRING();
-        Value value;
-        if (!tableGet(&vm.globals, name, &value)) {
-            runtimeError("Undefined variable '%s'.", name->chars);
-            break;
-        }
-        if (!IS_STRING(value)) {
-            runtimeError("Expected string value for variable '%s'.", name->chars);
-            break;
-        }
-        push(value);
-        break;
-    }
-      case OP_DEFINE_GLOBAL_INT: {
-          printf("OP_DEFINE_GLOBAL_INT\n");
-          ObjString* name = READ_STRING();
-          Value value = pop();
-          // if (!IS_INT(value)) {
-          //   runtimeError("Cannot assign non-integer value to int variable.");
-          //   return INTERPRET_RUNTIME_ERROR;
-          // }
-          tableSet(&vm.globals, name, value);
-          break;
-      }
-      case OP_DEFINE_GLOBAL_FLOAT: {
-        printf("OP_DEFINE_GLOBAL_FLOAT\n");
-          ObjString* name = READ_STRING();
-          Value value = pop();
-          if (!IS_FLOAT(value)) {
-            runtimeError("Cannot assign non-float value to float variable.");
-            return INTERPRET_RUNTIME_ERROR;
-          }
-          tableSet(&vm.globals, name, value);
-          break;
-      }
-      case OP_DEFINE_GLOBAL_STRING: {
-        printf("OP_DEFINE_GLOBAL_STRING\n");
-          ObjString* name = READ_STRING();
-          Value value = pop();
-          if (!IS_STRING(value)) {
-            runtimeError("Cannot assign non-string value to string variable.");
-            return INTERPRET_RUNTIME_ERROR;
-          }
-          tableSet(&vm.globals, name, value);
-          break;
-      }
-      case OP_SET_GLOBAL_INT: {
-          ObjString* name = READ_STRING();
-          Value value = pop();
-          if (!IS_INT(value)) {
-              runtimeError("Expected int value for variable '%s'.", name->chars);
-              break;
-          }
-          tableSet(&vm.globals, name, value);
-          break;
-      }
-      case OP_SET_GLOBAL_FLOAT: {
-          ObjString* name = READ_STRING();
-          Value value = pop();
-          if (!IS_FLOAT(value)) {
-              runtimeError("Expected float value for variable '%s'.", name->chars);
-              break;
-          }
-          tableSet(&vm.globals, name, value);
-          break;
-      }
-      case OP_SET_GLOBAL_STRING: {
-        ObjString* name = READ_STRING();
-        Value value = pop();
-        if (!IS_STRING(value)) {
-            runtimeError("Expected string value for variable '%s'.", name->chars);
-            break;
-        }
-        tableSet(&vm.globals, name, value);
-        break;
+#ifdef COMPUTED_GOTO
+  // Direct threading: every handler ends in its own indirect jump, so the
+  // branch predictor sees one jump site per opcode instead of a single shared
+  // one at the top of a switch. Opcodes without an entry land on
+  // op_UNKNOWN; overriding that default is the point, so don't warn.
+#pragma GCC diagnostic push
+#ifdef __clang__
+#pragma GCC diagnostic ignored "-Winitializer-overrides"
+#else
+#pragma GCC diagnostic ignored "-Woverride-init"
+#endif
+  static void* dispatchTable[256] = {
+    [0 ... 255]               = &&op_UNKNOWN,
+    [OP_CONSTANT]             = &&op_CONSTANT,
+    [OP_CONSTANT_INT]         = &&op_CONSTANT_INT,
+    [OP_CONSTANT_FLOAT]       = &&op_CONSTANT_FLOAT,
+    [OP_CONSTANT_STRING]      = &&op_CONSTANT_STRING,
+    [OP_NIL]                  = &&op_NIL,
+    [OP_TRUE]                 = &&op_TRUE,
+    [OP_FALSE]                = &&op_FALSE,
+    [OP_POP]                  = &&op_POP,
+    [OP_GET_LOCAL]            = &&op_GET_LOCAL,
+    [OP_SET_LOCAL]            = &&op_SET_LOCAL,
+    [OP_GET_GLOBAL_SLOT]      = &&op_GET_GLOBAL_SLOT,
+    [OP_SET_GLOBAL_SLOT]      = &&op_SET_GLOBAL_SLOT,
+    [OP_DEFINE_GLOBAL_SLOT]   = &&op_DEFINE_GLOBAL_SLOT,
+    [OP_GET_UPVALUE]          = &&op_GET_UPVALUE,
+    [OP_SET_UPVALUE]          = &&op_SET_UPVALUE,
+    [OP_GET_PROPERTY]         = &&op_GET_PROPERTY,
+    [OP_SET_PROPERTY]         = &&op_SET_PROPERTY,
+    [OP_GET_SUPER]            = &&op_GET_SUPER,
+    [OP_EQUAL]                = &&op_EQUAL,
+    [OP_GREATER]              = &&op_GREATER,
+    [OP_LESS]                 = &&op_LESS,
+    [OP_GREATER_INT]          = &&op_GREATER_INT,
+    [OP_LESS_INT]             = &&op_LESS_INT,
+    [OP_GREATER_FLOAT]        = &&op_GREATER_FLOAT,
+    [OP_LESS_FLOAT]           = &&op_LESS_FLOAT,
+    [OP_ADD]                  = &&op_ADD,
+    [OP_SUBTRACT]             = &&op_SUBTRACT,
+    [OP_MULTIPLY]             = &&op_MULTIPLY,
+    [OP_DIVIDE]               = &&op_DIVIDE,
+    [OP_ADD_INT]              = &&op_ADD_INT,
+    [OP_SUBTRACT_INT]         = &&op_SUBTRACT_INT,
+    [OP_MULTIPLY_INT]         = &&op_MULTIPLY_INT,
+    [OP_DIVIDE_INT]           = &&op_DIVIDE_INT,
+    [OP_ADD_FLOAT]            = &&op_ADD_FLOAT,
+    [OP_SUBTRACT_FLOAT]       = &&op_SUBTRACT_FLOAT,
+    [OP_MULTIPLY_FLOAT]       = &&op_MULTIPLY_FLOAT,
+    [OP_DIVIDE_FLOAT]         = &&op_DIVIDE_FLOAT,
+    [OP_NOT]                  = &&op_NOT,
+    [OP_NEGATE]               = &&op_NEGATE,
+    [OP_NEGATE_INT]           = &&op_NEGATE_INT,
+    [OP_NEGATE_FLOAT]         = &&op_NEGATE_FLOAT,
+    [OP_PRINT]                = &&op_PRINT,
+    [OP_JUMP]                 = &&op_JUMP,
+    [OP_JUMP_IF_FALSE]        = &&op_JUMP_IF_FALSE,
+    [OP_LOOP]                 = &&op_LOOP,
+    [OP_CALL]                 = &&op_CALL,
+    [OP_TAIL_CALL]            = &&op_TAIL_CALL,
+    [OP_INVOKE]               = &&op_INVOKE,
+    [OP_SUPER_INVOKE]         = &&op_SUPER_INVOKE,
+    [OP_CLOSURE]              = &&op_CLOSURE,
+    [OP_CLOSE_UPVALUE]        = &&op_CLOSE_UPVALUE,
+    [OP_RETURN]               = &&op_RETURN,
+    [OP_CLASS]                = &&op_CLASS,
+    [OP_INHERIT]              = &&op_INHERIT,
+    [OP_METHOD]               = &&op_METHOD,
+    [OP_TYPE_ERROR]           = &&op_TYPE_ERROR,
+    [OP_CHECK_INT]            = &&op_CHECK_INT,
+    [OP_CHECK_FLOAT]          = &&op_CHECK_FLOAT,
+    [OP_CHECK_STRING]         = &&op_CHECK_STRING,
+    [OP_RUNTIME_ERROR]        = &&op_RUNTIME_ERROR,
+    [OP_INC_LOCAL_INT]        = &&op_INC_LOCAL_INT,
+    [OP_LESS_JUMP_IF_FALSE]   = &&op_LESS_JUMP_IF_FALSE,
+    [OP_GREATER_JUMP_IF_FALSE] = &&op_GREATER_JUMP_IF_FALSE,
+    [OP_GET_LOCAL_GET_LOCAL]  = &&op_GET_LOCAL_GET_LOCAL,
+    [OP_LESS_INT_JUMP_IF_FALSE] = &&op_LESS_INT_JUMP_IF_FALSE,
+    [OP_GREATER_INT_JUMP_IF_FALSE] = &&op_GREATER_INT_JUMP_IF_FALSE,
+  };
+#pragma GCC diagnostic pop
+  void** dispatch = dispatchTable;
+#ifdef BASELINE_JIT
+  // While an iteration is being recorded every opcode detours through
+  // op_RECORD, so the normal path never tests for it.
+  static void* recordTable[256] = { [0 ... 255] = &&op_RECORD };
+#define SELECT_TABLE() \
+    (dispatch = vm.recording ? recordTable : dispatchTable)
+  SELECT_TABLE();
+#endif
+
+#define INTERPRET_LOOP DISPATCH();
+#define CASE(name)     op_##name
+#define DEFAULT_CASE   op_UNKNOWN
+#define DISPATCH() \
+    do { TRACE_INSTRUCTION(); goto *dispatch[instruction = READ_BYTE()]; } while (false)
+#else
+#define INTERPRET_LOOP \
+    loop: TRACE_INSTRUCTION(); RECORD_INSTRUCTION(); \
+    switch (instruction = READ_BYTE())
+#define CASE(name)     case OP_##name
+#define DEFAULT_CASE   default
+#define DISPATCH()     goto loop
+#define SELECT_TABLE() ((void)0)
+#endif
+
+  uint8_t instruction;
+  INTERPRET_LOOP
+  {
+    CASE(CONSTANT): {
+      push(READ_CONSTANT());
+      DISPATCH();
+    }
+    CASE(CONSTANT_INT): {
+      int value = AS_INT(READ_CONSTANT());
+      push(INT_VAL(value));
+      DISPATCH();
+    }
+    CASE(CONSTANT_FLOAT): {
+      double value = AS_FLOAT(READ_CONSTANT());
+      push(FLOAT_VAL(value));
+      DISPATCH();
     }
-      case OP_GET_UPVALUE: {
-        uint8_t slot = READ_BYTE();
-        push(*frame->closure->upvalues[slot]->location);
-        break;
+    CASE(CONSTANT_STRING): {
+      ObjString* string = AS_STRING(READ_CONSTANT());
+      push(OBJ_VAL(string));
+      DISPATCH();
+    }
+    CASE(NIL): push(NIL_VAL); DISPATCH();
+    CASE(TRUE): push(BOOL_VAL(true)); DISPATCH();
+    CASE(FALSE): push(BOOL_VAL(false)); DISPATCH();
+    CASE(POP): pop(); DISPATCH();
+    CASE(GET_LOCAL): {
+      uint8_t slot = READ_BYTE();
+      push(slots[slot]);
+      DISPATCH();
+    }
+    CASE(SET_LOCAL): {
+      uint8_t slot = READ_BYTE();
+      slots[slot] = peek(0);
+      DISPATCH();
+    }
+    CASE(GET_GLOBAL_SLOT): {
+      uint16_t slot = READ_SHORT();
+      Value value = vm.globalValues.values[slot];
+      if (IS_UNDEFINED(value)) {
+        RUNTIME_ERROR("Undefined variable '%s'.", globalSlotName(slot)->chars);
       }
-      case OP_SET_UPVALUE: {
-        uint8_t slot = READ_BYTE();
-        *frame->closure->upvalues[slot]->location = peek(0);
-        break;
+      push(value);
+      DISPATCH();
+    }
+    CASE(SET_GLOBAL_SLOT): {
+      uint16_t slot = READ_SHORT();
+      if (IS_UNDEFINED(vm.globalValues.values[slot])) {
+        RUNTIME_ERROR("Undefined variable '%s'.", globalSlotName(slot)->chars);
       }
-      case OP_GET_PROPERTY:{
-        if (!IS_INSTANCE(peek(0))) {
-          runtimeError("Only instances have properties.");
-          return INTERPRET_RUNTIME_ERROR;
-        }
-        ObjInstance* instance = AS_INSTANCE(peek(0));
-        ObjString* name = READ_STRING();
-        Value value;
-        if (tableGet(&instance->fields, name, &value)) {
-          pop(); // Instance.
-          push(value);
-          break;
-        }
-        if (!bindMethod(instance->klass, name)) {
-          return INTERPRET_RUNTIME_ERROR;
-        }
-        break;
-        }
-      case OP_SET_PROPERTY: {
-        if (!IS_INSTANCE(peek(1))) {
-          runtimeError("Only instances have fields.");
-          return INTERPRET_RUNTIME_ERROR;
-        }
-        ObjInstance* instance = AS_INSTANCE(peek(1));
-        tableSet(&instance->fields, READ_STRING(), peek(0));
-        Value value = pop();
-        pop();
-        push(value);
-        break;
+      const char* expected = globalTypeMismatch(slot, peek(0));
+      if (expected != NULL) {
+        RUNTIME_ERROR("Expected %s value for '%s'.", expected,
+                      globalSlotName(slot)->chars);
       }
-      case OP_GET_SUPER: {
-        ObjString* name = READ_STRING();
-        ObjClass* superclass = AS_CLASS(pop());  
-        if (!bindMethod(superclass, name)) {
-          return INTERPRET_RUNTIME_ERROR;
-        }
-        break;
+      vm.globalValues.values[slot] = peek(0);
+      DISPATCH();
+    }
+    CASE(DEFINE_GLOBAL_SLOT): {
+      uint16_t slot = READ_SHORT();
+      const char* expected = globalTypeMismatch(slot, peek(0));
+      if (expected != NULL) {
+        RUNTIME_ERROR("Expected %s value for '%s'.", expected,
+                      globalSlotName(slot)->chars);
       }
-      case OP_EQUAL: {
-        Value b = pop();
-        Value a = pop();
-        push(BOOL_VAL(valuesEqual(a, b)));
-        break;
+      vm.globalValues.values[slot] = pop();
+      DISPATCH();
+    }
+    CASE(GET_UPVALUE): {
+      uint8_t slot = READ_BYTE();
+      push(*frame->closure->upvalues[slot]->location);
+      DISPATCH();
+    }
+    CASE(SET_UPVALUE): {
+      ObjUpvalue* upvalue = frame->closure->upvalues[READ_BYTE()];
+      writeBarrier(&upvalue->obj, peek(0));
+      snapshotBarrier(&upvalue->obj, *upvalue->location);
+      *upvalue->location = peek(0);
+      DISPATCH();
+    }
+    CASE(GET_PROPERTY): {
+      ObjString* name = READ_STRING();
+      InlineCache* cache = READ_CACHE();
+      STORE_FRAME();
+      if (!getProperty(name, cache)) return INTERPRET_RUNTIME_ERROR;
+      DISPATCH();
+    }
+    CASE(SET_PROPERTY): {
+      ObjString* name = READ_STRING();
+      InlineCache* cache = READ_CACHE();
+      STORE_FRAME();
+      if (!setProperty(name, cache)) return INTERPRET_RUNTIME_ERROR;
+      DISPATCH();
+    }
+    CASE(GET_SUPER): {
+      ObjString* name = READ_STRING();
+      ObjClass* superclass = AS_CLASS(pop());
+      STORE_FRAME();
+      if (!bindMethod(superclass, name)) {
+        return INTERPRET_RUNTIME_ERROR;
       }
-     case OP_GREATER: {
-        if(IS_INT(peek(0))) {BINARY_OP_INT(BOOL_VAL, >); break;}
-        else if(IS_FLOAT(peek(0))) {BINARY_OP_FLOAT(BOOL_VAL, >); break;}
-      }  
-     case OP_LESS: { 
-        if(IS_INT(peek(0))) {BINARY_OP_INT(BOOL_VAL, <); break;}
-        else if(IS_FLOAT(peek(0))) {BINARY_OP_FLOAT(BOOL_VAL, <); break;}
+      DISPATCH();
+    }
+    CASE(EQUAL): {
+      Value b = pop();
+      Value a = pop();
+      push(BOOL_VAL(valuesEqual(a, b)));
+      DISPATCH();
+    }
+    CASE(GREATER): CHECKED_OP(INT_COMPARE, BOOL_VAL, >); DISPATCH();
+    CASE(LESS): CHECKED_OP(INT_COMPARE, BOOL_VAL, <); DISPATCH();
+    CASE(GREATER_INT): INT_COMPARE(>); DISPATCH();
+    CASE(LESS_INT): INT_COMPARE(<); DISPATCH();
+    CASE(GREATER_FLOAT): FLOAT_OP(BOOL_VAL, >); DISPATCH();
+    CASE(LESS_FLOAT): FLOAT_OP(BOOL_VAL, <); DISPATCH();
+    CASE(ADD): {
+      if (IS_STRING(peek(0)) && IS_STRING(peek(1))) {
+        concatenate();
+      } else if (IS_INT(peek(0)) && IS_INT(peek(1))) {
+        INT_OP(+);
+      } else if (IS_FLOAT(peek(0)) && IS_FLOAT(peek(1))) {
+        FLOAT_OP(FLOAT_VAL, +);
+      } else {
+        RUNTIME_ERROR("Operands must be two numbers or two strings.");
       }
-     case OP_ADD: concatenate(); break;
-     case OP_ADD_INT: BINARY_OP_INT(INT_VAL, +); break;
-     case OP_SUBTRACT_INT: BINARY_OP_INT(INT_VAL, -); break;
-     case OP_MULTIPLY_INT: BINARY_OP_INT(INT_VAL, *); break;
-     case OP_DIVIDE_INT: BINARY_OP_INT(INT_VAL, /); break;
-     case OP_ADD_FLOAT: BINARY_OP_FLOAT(FLOAT_VAL, +);
-     case OP_SUBTRACT_FLOAT: BINARY_OP_FLOAT(FLOAT_VAL, -);
-     case OP_MULTIPLY_FLOAT: BINARY_OP_FLOAT(FLOAT_VAL, *);
-     case OP_DIVIDE_FLOAT: BINARY_OP_FLOAT(FLOAT_VAL, /);
-     case OP_NOT: push(BOOL_VAL(isFalsey(pop()))); break;
-     case OP_NEGATE_INT:
-        if (!IS_INT(peek(0))) {
-          runtimeError("Operand must be a number.");
-          return INTERPRET_RUNTIME_ERROR;
-        }
-        push(INT_VAL(-AS_INT(pop()))); 
-        break;
-     case OP_NEGATE_FLOAT:
-        if (!IS_FLOAT(peek(0))) {
-          runtimeError("Operand must be a number.");
-          return INTERPRET_RUNTIME_ERROR;
-        }
+      DISPATCH();
+    }
+    CASE(SUBTRACT): CHECKED_OP(INT_OP, FLOAT_VAL, -); DISPATCH();
+    CASE(MULTIPLY): CHECKED_OP(INT_OP, FLOAT_VAL, *); DISPATCH();
+    CASE(DIVIDE): {
+      if (IS_INT(peek(0)) && IS_INT(peek(1))) INT_DIVIDE();
+      else if (IS_FLOAT(peek(0)) && IS_FLOAT(peek(1))) FLOAT_OP(FLOAT_VAL, /);
+      else RUNTIME_ERROR("Operands must be two integers or two floats.");
+      DISPATCH();
+    }
+    CASE(ADD_INT): INT_OP(+); DISPATCH();
+    CASE(SUBTRACT_INT): INT_OP(-); DISPATCH();
+    CASE(MULTIPLY_INT): INT_OP(*); DISPATCH();
+    CASE(DIVIDE_INT): INT_DIVIDE(); DISPATCH();
+    CASE(ADD_FLOAT): FLOAT_OP(FLOAT_VAL, +); DISPATCH();
+    CASE(SUBTRACT_FLOAT): FLOAT_OP(FLOAT_VAL, -); DISPATCH();
+    CASE(MULTIPLY_FLOAT): FLOAT_OP(FLOAT_VAL, *); DISPATCH();
+    CASE(DIVIDE_FLOAT): FLOAT_OP(FLOAT_VAL, /); DISPATCH();
+    CASE(NOT): push(BOOL_VAL(isFalsey(pop()))); DISPATCH();
+    CASE(NEGATE): {
+      if (IS_INT(peek(0))) {
+        push(INT_VAL((int32_t)(0u - (uint32_t)AS_INT(pop()))));
+      } else if (IS_FLOAT(peek(0))) {
         push(FLOAT_VAL(-AS_FLOAT(pop())));
-        break;
-     case OP_PRINT: {
-        Value value = pop();
-        //printf("About to print value of type: %d\n", value.type);
-        printValue(value);
-        printf("\n");
-        break;
-      }
-     case OP_JUMP: {
-        uint16_t offset = READ_SHORT();
-        frame->ip += offset;
-        break;
-      }
-     case OP_JUMP_IF_FALSE: {
-        uint16_t offset = READ_SHORT();
-        if (isFalsey(peek(0))) frame->ip += offset;
-        break;
+      } else {
+        RUNTIME_ERROR("Operand must be a number.");
       }
-     case OP_LOOP: {
-        uint16_t offset = READ_SHORT();
-        frame->ip -= offset;
-        break;
+      DISPATCH();
+    }
+    CASE(NEGATE_INT): {
+#ifdef DEBUG_ASSERT_TYPES
+      assert(IS_INT(peek(0)));
+#endif
+      push(INT_VAL((int32_t)(0u - (uint32_t)AS_INT(pop()))));
+      DISPATCH();
+    }
+    CASE(NEGATE_FLOAT): {
+#ifdef DEBUG_ASSERT_TYPES
+      assert(IS_FLOAT(peek(0)));
+#endif
+      push(FLOAT_VAL(-AS_FLOAT(pop())));
+      DISPATCH();
+    }
+    CASE(PRINT): {
+      printValue(pop());
+      printf("\n");
+      DISPATCH();
+    }
+    CASE(JUMP): {
+      uint16_t offset = READ_SHORT();
+      ip += offset;
+      DISPATCH();
+    }
+    CASE(JUMP_IF_FALSE): {
+      uint16_t offset = READ_SHORT();
+      if (isFalsey(peek(0))) ip += offset;
+      DISPATCH();
+    }
+    CASE(LOOP): {
+      uint16_t offset = READ_SHORT();
+      ip -= offset;
+      GC_SAFEPOINT();
+      ENTER_TRACE();
+      JIT_ENTER();
+      DISPATCH();
+    }
+    CASE(CALL): {
+      int argCount = READ_BYTE();
+      STORE_FRAME();
+      if (!callValue(peek(argCount), argCount)) {
+        return INTERPRET_RUNTIME_ERROR;
       }
-     case OP_CALL: {
-        int argCount = READ_BYTE();
-        if (!callValue(peek(argCount), argCount)) {
-          return INTERPRET_RUNTIME_ERROR;
-        }
-        frame = &vm.frames[vm.frameCount - 1];
-        break;
+      LOAD_FRAME();
+      JIT_ENTER();
+      DISPATCH();
+    }
+    CASE(TAIL_CALL): {
+      int argCount = READ_BYTE();
+      STORE_FRAME();
+      if (!tailCall(peek(argCount), argCount)) {
+        return INTERPRET_RUNTIME_ERROR;
       }
-     case OP_INVOKE: {
-        ObjString* method = READ_STRING();
-        int argCount = READ_BYTE();
-        if (!invoke(method, argCount)) {
-          return INTERPRET_RUNTIME_ERROR;
-        }
-        frame = &vm.frames[vm.frameCount - 1];
-        break;
+      LOAD_FRAME();
+      JIT_ENTER();
+      DISPATCH();
+    }
+    CASE(INVOKE): {
+      ObjString* method = READ_STRING();
+      int argCount = READ_BYTE();
+      InlineCache* cache = READ_CACHE();
+      STORE_FRAME();
+      if (!invokeCached(method, argCount, cache)) {
+        return INTERPRET_RUNTIME_ERROR;
       }
-     case OP_SUPER_INVOKE: {
-        ObjString* method = READ_STRING();
-        int argCount = READ_BYTE();
-        ObjClass* superclass = AS_CLASS(pop());
-        if (!invokeFromClass(superclass, method, argCount)) {
-          return INTERPRET_RUNTIME_ERROR;
-        }
-        frame = &vm.frames[vm.frameCount - 1];
-        break;
+      LOAD_FRAME();
+      JIT_ENTER();
+      DISPATCH();
+    }
+    CASE(SUPER_INVOKE): {
+      ObjString* method = READ_STRING();
+      int argCount = READ_BYTE();
+      ObjClass* superclass = AS_CLASS(pop());
+      STORE_FRAME();
+      if (!invokeFromClass(superclass, method, argCount)) {
+        return INTERPRET_RUNTIME_ERROR;
       }
-     case OP_CLOSURE: {
-        ObjFunction* function = AS_FUNCTION(READ_CONSTANT());
-        ObjClosure* closure = newClosure(function);
-        push(OBJ_VAL(closure));
-        for (int i = 0; i < closure->upvalueCount; i++) {
-          uint8_t isLocal = READ_BYTE();
-          uint8_t index = READ_BYTE();
-          if (isLocal) {
-            closure->upvalues[i] =
-                captureUpvalue(frame->slots + index);
-          } else {
-            closure->upvalues[i] = frame->closure->upvalues[index];
-          }
+      LOAD_FRAME();
+      JIT_ENTER();
+      DISPATCH();
+    }
+    CASE(CLOSURE): {
+      ObjFunction* function = AS_FUNCTION(READ_CONSTANT());
+      ObjClosure* closure = newClosure(function);
+      push(OBJ_VAL(closure));
+      for (int i = 0; i < closure->upvalueCount; i++) {
+        uint8_t isLocal = READ_BYTE();
+        uint8_t index = READ_BYTE();
+        if (isLocal) {
+          closure->upvalues[i] = captureUpvalue(slots + index);
+        } else {
+          closure->upvalues[i] = frame->closure->upvalues[index];
         }
-        break;
       }
-     case OP_CLOSE_UPVALUE:{
-        closeUpvalues(vm.stackTop - 1);
+      DISPATCH();
+    }
+    CASE(CLOSE_UPVALUE): {
+      closeUpvalues(vm.stackTop - 1);
+      pop();
+      DISPATCH();
+    }
+    CASE(RETURN): {
+      Value result = pop();
+      closeUpvalues(slots);
+      vm.frameCount--;
+      if (vm.frameCount == 0) {
         pop();
-        break;
-      }
-     case OP_RETURN: {
         return INTERPRET_OK;
-        Value result = pop();
-        closeUpvalues(frame->slots);
-        vm.frameCount--;
-        if (vm.frameCount == 0) {
-          pop();
-          return INTERPRET_OK;
-        }
-        vm.stackTop = frame->slots;
-        push(result);
-        frame = &vm.frames[vm.frameCount - 1];
-        break;
-      }
-     case OP_CLASS: {
-        push(OBJ_VAL(newClass(READ_STRING())));
-        break;
-      }
-     case OP_INHERIT: {
-        Value superclass = peek(1);
-        if (!IS_CLASS(superclass)) {
-          runtimeError("Superclass must be a class.");
-          return INTERPRET_RUNTIME_ERROR;
-        }
-        ObjClass* subclass = AS_CLASS(peek(0));
-        tableAddAll(&AS_CLASS(superclass)->methods, &subclass->methods);
-        pop();
-        break;
       }
-     case OP_METHOD:{
-        defineMethod(READ_STRING());
-        break;
-      }
-     case OP_TYPE_ERROR:{
-        runtimeError("Type mismatch");
-        return INTERPRET_RUNTIME_ERROR;
+      vm.stackTop = slots;
+      push(result);
+      if (vm.frameCount == baseFrame) return INTERPRET_OK;
+      LOAD_FRAME();
+      GC_SAFEPOINT();
+      JIT_ENTER();
+      DISPATCH();
+    }
+    CASE(CLASS): {
+      push(OBJ_VAL(newClass(READ_STRING())));
+      DISPATCH();
+    }
+    CASE(INHERIT): {
+      Value superclass = peek(1);
+      if (!IS_CLASS(superclass)) {
+        RUNTIME_ERROR("Superclass must be a class.");
       }
-     case OP_RUNTIME_ERROR: {}
-        runtimeError("An error occurred");
-        return INTERPRET_RUNTIME_ERROR;
+      ObjClass* subclass = AS_CLASS(peek(0));
+      rememberObject(&subclass->obj);
+      tableAddAll(&AS_CLASS(superclass)->methods, &subclass->methods);
+      pop();
+      DISPATCH();
+    }
+    CASE(METHOD): {
+      defineMethod(READ_STRING());
+      DISPATCH();
+    }
+    CASE(CHECK_INT): {
+      if (!IS_INT(peek(0))) RUNTIME_ERROR("Expected int value.");
+      DISPATCH();
+    }
+    CASE(CHECK_FLOAT): {
+      if (!IS_FLOAT(peek(0))) RUNTIME_ERROR("Expected float value.");
+      DISPATCH();
+    }
+    CASE(CHECK_STRING): {
+      if (!IS_STRING(peek(0))) RUNTIME_ERROR("Expected string value.");
+      DISPATCH();
+    }
+    CASE(TYPE_ERROR): {
+      RUNTIME_ERROR("Type mismatch");
+    }
+    CASE(RUNTIME_ERROR): {
+      RUNTIME_ERROR("An error occurred");
+    }
+    CASE(INC_LOCAL_INT): {
+      uint8_t slot = READ_BYTE();
+      Value increment = READ_CONSTANT();
+#ifdef DEBUG_ASSERT_TYPES
+      assert(IS_INT(slots[slot]) && IS_INT(increment));
+#endif
+      slots[slot] = INT_VAL((int32_t)((uint32_t)AS_INT(slots[slot]) +
+                                     (uint32_t)AS_INT(increment)));
+      DISPATCH();
+    }
+    CASE(LESS_JUMP_IF_FALSE): COMPARE_JUMP(<); DISPATCH();
+    CASE(GREATER_JUMP_IF_FALSE): COMPARE_JUMP(>); DISPATCH();
+    CASE(LESS_INT_JUMP_IF_FALSE): INT_COMPARE_JUMP(<); DISPATCH();
+    CASE(GREATER_INT_JUMP_IF_FALSE): INT_COMPARE_JUMP(>); DISPATCH();
+    CASE(GET_LOCAL_GET_LOCAL): {
+      uint8_t first = READ_BYTE();
+      uint8_t second = READ_BYTE();
+      push(slots[first]);
+      push(slots[second]);
+      DISPATCH();
+    }
+    DEFAULT_CASE: {
+      RUNTIME_ERROR("Unknown opcode %d.", instruction);
     }
   }
+#if defined(COMPUTED_GOTO) && defined(BASELINE_JIT)
+op_RECORD:
+  recordInstruction(ip - 1);
+  SELECT_TABLE();
+  goto *dispatchTable[instruction];
+#endif
+
+#undef INTERPRET_LOOP
+#undef CASE
+#undef DEFAULT_CASE
+#undef DISPATCH
+#undef TRACE_INSTRUCTION
+#undef GC_SAFEPOINT
+#undef JIT_RESUME
+#undef JIT_ENTER
+#undef ENTER_TRACE
+#undef RECORD_INSTRUCTION
+#undef SELECT_TABLE
 }
 
 #undef READ_BYTE
 #undef READ_SHORT
 #undef READ_CONSTANT
 #undef READ_STRING
-#undef BINARY_OP
+#undef READ_CACHE
+#undef STORE_FRAME
+#undef LOAD_FRAME
+#undef RUNTIME_ERROR
+#undef ASSERT_OPERANDS
+#undef INT_OP
+#undef INT_COMPARE
+#undef FLOAT_OP
+#undef INT_DIVIDE
+#undef CHECKED_OP
+#undef COMPARE_JUMP
+#undef INT_COMPARE_JUMP
+
+#ifdef BASELINE_JIT
+// Native code keeps no object in a register across a helper, so every
+// helper is a safepoint too.
+static void setFrameIp(uint8_t* ip) {
+  vm.frames[vm.frameCount - 1].ip = ip;
+  if (vm.gcRequested) gcSafepoint();
+}
+
+// Runs whatever a call from native code pushed above depth until it
+// returns: natively when compiled, in a nested run() when not. Too deep
+// for the C stack, it hands the frames to the outer run() instead.
+static JitStatus finishCall(int depth) {
+  if (vm.frameCount == depth) return JIT_CONTINUE;
+  JitStatus status = vm.jitEnabled ? jitEnter() : JIT_INTERPRET;
+  if (status == JIT_INTERPRET && vm.frameCount > depth &&
+      vm.jitDepth < JIT_MAX_NESTING) {
+    vm.jitDepth++;
+    status = run(depth) == INTERPRET_OK ? JIT_INTERPRET : JIT_ERROR;
+    vm.jitDepth--;
+  }
+  if (status == JIT_INTERPRET && vm.frameCount == depth) return JIT_CONTINUE;
+  return status;
+}
+
+JitStatus jitExit(uint8_t* ip) {
+  setFrameIp(ip);
+  return JIT_INTERPRET;
+}
+
+JitStatus jitCall(uint8_t* ip, int argCount) {
+  setFrameIp(ip);
+  int depth = vm.frameCount;
+  if (!callValue(peek(argCount), argCount)) return JIT_ERROR;
+  return finishCall(depth);
+}
+
+JitStatus jitTailCall(uint8_t* ip, int argCount) {
+  setFrameIp(ip);
+  int depth = vm.frameCount;
+  Value callee = peek(argCount);
+  bool reusesFrame = IS_CLOSURE(callee) || IS_BOUND_METHOD(callee);
+  if (!tailCall(callee, argCount)) return JIT_ERROR;
+  return reusesFrame ? JIT_REENTER : finishCall(depth);
+}
+
+JitStatus jitInvoke(uint8_t* ip, ObjString* name, int argCount,
+                    InlineCache* cache) {
+  setFrameIp(ip);
+  int depth = vm.frameCount;
+  if (!invokeCached(name, argCount, cache)) return JIT_ERROR;
+  return finishCall(depth);
+}
+
+JitStatus jitGetProperty(uint8_t* ip, ObjString* name, InlineCache* cache) {
+  setFrameIp(ip);
+  return getProperty(name, cache) ? JIT_CONTINUE : JIT_ERROR;
+}
+
+JitStatus jitSetProperty(uint8_t* ip, ObjString* name, InlineCache* cache) {
+  setFrameIp(ip);
+  return setProperty(name, cache) ? JIT_CONTINUE : JIT_ERROR;
+}
+
+JitStatus jitGetUpvalue(uint8_t* ip, int slot) {
+  setFrameIp(ip);
+  ObjClosure* closure = vm.frames[vm.frameCount - 1].closure;
+  push(*closure->upvalues[slot]->location);
+  return JIT_CONTINUE;
+}
+
+JitStatus jitSetUpvalue(uint8_t* ip, int slot) {
+  setFrameIp(ip);
+  ObjUpvalue* upvalue = vm.frames[vm.frameCount - 1].closure->upvalues[slot];
+  writeBarrier(&upvalue->obj, peek(0));
+  snapshotBarrier(&upvalue->obj, *upvalue->location);
+  *upvalue->location = peek(0);
+  return JIT_CONTINUE;
+}
+
+JitStatus jitCloseUpvalue(uint8_t* ip) {
+  setFrameIp(ip);
+  closeUpvalues(vm.stackTop - 1);
+  pop();
+  return JIT_CONTINUE;
+}
+
+JitStatus jitEqual(uint8_t* ip) {
+  setFrameIp(ip);
+  Value b = pop();
+  Value a = pop();
+  push(BOOL_VAL(valuesEqual(a, b)));
+  return JIT_CONTINUE;
+}
+
+JitStatus jitPrint(uint8_t* ip) {
+  setFrameIp(ip);
+  printValue(pop());
+  printf("\n");
+  return JIT_CONTINUE;
+}
+
+JitStatus jitReturn(uint8_t* ip) {
+  setFrameIp(ip);
+  Value result = pop();
+  Value* slots = vm.frames[vm.frameCount - 1].slots;
+  closeUpvalues(slots);
+  vm.frameCount--;
+  if (vm.frameCount == 0) {
+    pop();
+    return JIT_FINISHED;
+  }
+  vm.stackTop = slots;
+  push(result);
+  return JIT_INTERPRET;
+}
+#endif
 
 void hack(bool b) {
-  run();
+  run(0);
   if (b) hack(false);
 }
 
 InterpretResult interpret(const char* source) {
   printf("Interpreting...");
+  // The compiler holds objects the collector can't move, and the code it
+  // emits may embed their addresses.
+  collectYoung();
+  vm.pretenure = true;
   ObjFunction* function = compile(source);
+  vm.pretenure = false;
   if (function == NULL) return INTERPRET_COMPILE_ERROR;
   push(OBJ_VAL(function));
   ObjClosure* closure = newClosure(function);
   pop();
   push(OBJ_VAL(closure));
   call(closure, 0);
-  return run();
+  return run(0);
 }
@@ -3,9 +3,22 @@
 #include "object.h"
 #include "table.h"
 #include "value.h"
-#define FRAMES_MAX 64
-#define STACK_MAX (FRAMES_MAX * UINT8_COUNT)
+#define FRAMES_INITIAL 64
+#define STACK_INITIAL 256
+#define DEFAULT_MAX_FRAMES 100000
+// Headroom beyond a function's maxStack for values pushed by helpers
+// (GC roots held across allocation, native calls) rather than bytecode.
+#define STACK_SLACK 16
 #define LOCALS_MAX (UINT8_COUNT)
+// Microseconds an incremental collection step aims to stay under.
+#define GC_DEFAULT_PAUSE_US 500
+// Pause histogram buckets: under 1us, then one per power of two.
+#define GC_PAUSE_BUCKETS 24
+#define GC_DEFAULT_COMPACT_PERCENT 50
+#define GC_DEFAULT_MIN_HEAP (1024 * 1024)
+#define GC_DEFAULT_CPU_PERCENT 25
+
+typedef struct NurseryBlock NurseryBlock;
 
 typedef struct {
   ObjClosure* closure;
@@ -14,23 +27,65 @@ typedef struct {
 } CallFrame;
 
 typedef struct {
-  CallFrame frames[FRAMES_MAX];
+  CallFrame* frames;
   int frameCount;
-  Value stack[STACK_MAX];
+  int frameCapacity;
+  int maxFrames;
+  Value* stack;
   Value* stackTop;
-  Table globals;
-  Table globalTypes;
+  int stackCapacity;
+  Table globalSlots;
+  ValueArray globalValues;
+  ValueArray globalTypes;    // declared type per slot, nil if untyped
   int localCount;
   int scopeDepth;
-  Table strings;
+  StringSet strings;         // interned: names and constants
   ObjString* initString;
   ObjUpvalue* openUpvalues;
   size_t bytesAllocated;
   size_t nextGC;
-  Obj* objects;
+  size_t gcMinHeap;         // never start a mark below this
+  size_t gcMaxHeap;         // collect everything past this, or give up
+  int gcCpuPercent;         // share of the time the pacer lets the GC have
+  bool gcLog;               // a line per cycle on stderr
+  size_t gcCycles;
+  NurseryBlock* nursery;    // the young space, newest block first
+  uint8_t* nurseryTop;
+  uint8_t* nurseryEnd;
+  Obj** remembered;         // old objects that may point into the nursery
+  int rememberedCount;
+  int rememberedCapacity;
+  bool pretenure;           // allocate straight into the old space
+  bool gcRequested;         // collect at the next safepoint
+  bool marking;             // a mark of the old space is open
+  bool sweeping;            // its garbage isn't all freed yet
+  size_t sweepPending;      // bytes of dead objects left to sweep
+  size_t gcPagesSwept;
+  size_t gcPagesSweptOnAllocation;
+  bool concurrentGc;        // mark on a background thread
+  int gcPauseTarget;        // microseconds
+  bool gcStats;             // report pause times on exit
+  size_t gcPauses[GC_PAUSE_BUCKETS];
+  size_t gcPauseCount;
+  uint64_t gcPauseTotal;    // nanoseconds
+  uint64_t gcPauseMax;
+  int gcCompactPercent;     // compact past this much free page space; 0 never
+  size_t gcCompactions;
+  size_t gcBytesMoved;
   int grayCount;
   int grayCapacity;
   Obj** grayStack;
+  size_t cacheHits;
+  size_t cacheMisses;
+  size_t cacheMegamorphic;  // lookups that bypassed the cache entirely
+  bool stringStats;         // time string hashing and vm.strings on exit
+  bool jitEnabled;
+  int jitThreshold;
+  int jitDepth;             // native and nested run() levels on the C stack
+  bool tracing;
+  int traceThreshold;
+  bool dumpTraces;
+  bool recording;           // a loop iteration is being recorded
 } VM;
   
 typedef enum {
@@ -42,8 +97,24 @@ typedef enum {
 extern VM vm;
 
 void initVM();
+void setMaxCallDepth(int depth);
+bool enableJit(int threshold);
+bool enableTracing(int threshold);
+void setDumpTraces(bool dump);
+bool enableConcurrentGc();
+void setGcPauseTarget(int microseconds);
+void setGcStats(bool report);
+void setGcCompaction(int percent);
+void setGcMinHeap(size_t bytes);
+void setGcMaxHeap(size_t bytes);
+void setGcCpuTarget(int percent);
+void setGcLog(bool log);
+void setStringStats(bool report);
 void freeVM();
 InterpretResult interpret(const char* source);
+int globalSlot(ObjString* name);
+ObjString* globalSlotName(int slot);
+void setGlobalType(int slot, ValueType type);
 void push(Value value);
 void printStack(VM* vm);
 Value pop();